@@ -52,9 +52,10 @@ void check_decl_bounds(Decl decl) {
 void check_instr_op_bounds(Instr instr) {
     if (instr.opcode == INSTR_CALL) return;
 
-    if (instropcode_in_args(instr.opcode, 2, INSTR_IN, INSTR_OUT)) {
+    InstrShape shape = instr_shape(instr.opcode);
+    if (shape == SHAPE_PORT_IO || shape == SHAPE_PORT) {
         check_number_bounds(instr.ops[0], 1);
-    } else if (vector_size(instr.ops) == 2 && instr.ops[1].type != TOKEN_REG){
+    } else if (instr.amount_of_ops == 2 && instr.ops[1].type != TOKEN_REG){
         check_number_bounds(instr.ops[1], 2);
     }
 }
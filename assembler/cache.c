@@ -0,0 +1,46 @@
+#include "cache.h"
+#include "common/io.h"
+#include "common/object.h"
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static uint64_t hash_bytes(uint64_t hash, const void *data, size_t size) {
+    const byte *bytes = data;
+    for (size_t i = 0; i < size; i++) {
+        hash = (hash ^ bytes[i]) * 1099511628211u; // FNV-1a
+    }
+    return hash;
+}
+
+char *cache_object_path(const char *cache_dir, const char *source_file, bool optimize) {
+    size_t size;
+    char *source = map_whole_file(source_file, &size);
+    // Objects of another format, or assembled with other options, are never found
+    char version[32];
+    sprintf(version, "sobj %d%s", OBJECT_FORMAT_VERSION, optimize ? " -O" : "");
+    uint64_t hash = hash_bytes(14695981039346656037u, version, strlen(version) + 1);
+    hash = hash_bytes(hash, source, size);
+    unmap_whole_file(source, size);
+
+    char *path = malloc(strlen(cache_dir) + 32);
+    sprintf(path, "%s/%016lx.sobj", cache_dir, (unsigned long)hash);
+    return path;
+}
+
+void cache_store(ExecFile object, const char *cache_dir, const char *path) {
+    if (mkdir(cache_dir, 0777) != 0 && errno != EEXIST) {
+        error_file_doesnot_exist(cache_dir);
+    }
+    char *temporary = malloc(strlen(path) + 32);
+    sprintf(temporary, "%s.%d.tmp", path, (int)getpid());
+    execfile_write(object, temporary);
+    if (rename(temporary, path) != 0) {
+        unlink(temporary);
+    }
+    free(temporary);
+}
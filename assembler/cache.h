@@ -0,0 +1,15 @@
+#ifndef __ASM_CACHE_H
+#define __ASM_CACHE_H
+
+#include "common/sex.h"
+
+// Objects of assembled sources are kept in a directory under a hash of the source, so that only the
+// sources that changed are assembled again
+
+// Returns where the object of the source assembled with or without -O is kept, it may not be there
+// yet. Needs to be freed
+char *cache_object_path(const char *cache_dir, const char *source_file, bool optimize);
+// Writes the object so that no other sasm ever sees it half-written
+void cache_store(ExecFile object, const char *cache_dir, const char *path);
+
+#endif
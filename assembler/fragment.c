@@ -0,0 +1,109 @@
+#include "fragment.h"
+#include "analysis.h"
+#include "phases.h"
+#include "common/io.h"
+#include "common/utils.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+extern bool SHOW_TOKENS;
+
+Fragment new_fragment(const char *file_name) {
+    return (Fragment) {
+        .file_name = file_name,
+        .arena = new_arena(),
+        .labels = NULL,
+        .directives = NULL,
+        .has_parser = false,
+        .has_diagnostics = false,
+    };
+}
+
+void free_fragment(void *fragment) {
+    Fragment *f = fragment;
+    if (f->has_parser) {
+        free_parser(&f->parser);
+    }
+    free_vector(&f->labels);
+    free_vector(&f->directives);
+    free_arena(f->arena); // NULL once the program adopted it
+}
+
+// Same as parse_top_level, but the labels are kept in the fragment
+static void parse_fragment(Fragment *fragment) {
+    jmp_buf trap;
+    if (setjmp(trap) != 0) {
+        // A lexer error leaves the source mapped, but the main thread reports it again and exits
+        DIAGNOSTICS_TRAP = NULL;
+        fragment->has_diagnostics = true;
+        return;
+    }
+    DIAGNOSTICS_TRAP = &trap;
+
+    double begin = phase_begin();
+    fragment->parser = new_parser(fragment->file_name, fragment->arena);
+    fragment->has_parser = true;
+    fragment->parser_time = phase_begin() - begin;
+
+    begin = phase_begin();
+    Parser *parser = &fragment->parser;
+    while (parser->tokens[parser->idx].type != TOKEN_EOF) {
+        Token tok = parser->tokens[parser->idx];
+        switch (tok.type) {
+            case TOKEN_DIRECTIVE: {
+                Directive dir = parse_directive(parser);
+                analyse_directive(dir);
+                vector_push_back(fragment->directives, dir);
+            }; break;
+            case TOKEN_LABEL: {
+                Label lbl = parse_label(parser);
+                analyse_label(lbl);
+                vector_push_back(fragment->labels, lbl);
+            }; break;
+            default:
+                UNREACHABLE("If you see this, something actually went wrong, create an issue");
+        }
+    }
+    fragment->parse_time = phase_begin() - begin;
+    DIAGNOSTICS_TRAP = NULL;
+    if (!SHOW_TOKENS) {
+        free_parser(parser);
+        fragment->has_parser = false;
+    }
+}
+
+typedef struct {
+    vector(Fragment) fragments;
+    _Atomic size_t next;
+} FragmentQueue;
+
+static void *parse_fragments_worker(void *arg) {
+    FragmentQueue *queue = arg;
+    size_t i;
+    while ((i = atomic_fetch_add(&queue->next, 1)) < vector_size(queue->fragments)) {
+        parse_fragment(&queue->fragments[i]);
+    }
+    return NULL;
+}
+
+void parse_fragments(vector(Fragment) fragments, size_t jobs) {
+    if (jobs == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        jobs = cpus > 0 ? cpus : 1;
+    }
+    jobs = max(1, min(jobs, vector_size(fragments)));
+
+    FragmentQueue queue = { fragments, 0 };
+    pthread_t *threads = malloc(jobs * sizeof(pthread_t));
+    // The main thread is one of the workers
+    for (size_t i = 1; i < jobs; i++) {
+        pthread_create(&threads[i], NULL, parse_fragments_worker, &queue);
+    }
+    parse_fragments_worker(&queue);
+    for (size_t i = 1; i < jobs; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+}
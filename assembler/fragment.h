@@ -0,0 +1,31 @@
+#ifndef __ASM_FRAGMENT_H
+#define __ASM_FRAGMENT_H
+
+#include <stdbool.h>
+#include "common/arena.h"
+#include "common/vector.h"
+#include "parser.h"
+
+// Labels and directives of one input file, parsed apart from the program and added to it later
+typedef struct {
+    const char *file_name;
+    Arena *arena; // Everything the labels and directives point to, adopted by the program
+    vector(Label) labels;
+    vector(Directive) directives;
+    Parser parser; // Kept until the fragment is added only if the tokens are to be printed
+    bool has_parser;
+    // The file has a diagnostic. Nothing is printed, the file is parsed again by the main thread
+    // so that the diagnostics come out as they would without workers
+    bool has_diagnostics;
+    // Spent in new_parser and in parsing the tokens
+    double parser_time;
+    double parse_time;
+} Fragment;
+
+Fragment new_fragment(const char *file_name);
+void free_fragment(void *fragment);
+
+// Parses every fragment on up to `jobs` threads, 0 means one per processor
+void parse_fragments(vector(Fragment) fragments, size_t jobs);
+
+#endif
@@ -1,12 +1,15 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdarg.h>
+#include <string.h>
 #include <assert.h>
 #include "io.h"
 #include "common/io.h"
 #include "common/utils.h"
 
 extern const char *INPUT_FILE_NAME;
+extern bool SHOW_WARNINGS;
+extern size_t MAX_WARNINGS;
 
 const char *token_type_to_str(TokenType type) {
     switch (type) {
@@ -26,24 +29,55 @@ const char *token_type_to_str(TokenType type) {
     }
 }
 
-void print_line_with_underline(const char *filename, Span span, Color color) {
-    char *file_content = read_whole_file(filename);
-    long new_lines = 0;
-    long lines = (long)span.line;
-    while (new_lines < max(lines - 3, 0) && *file_content != '\0') {
-        if (*file_content == 10) {
-            new_lines++;
+// Every file that got a diagnostic, mapped once with the offsets its lines begin at, so that
+// a diagnostic does not read and scan the file again
+typedef struct {
+    const char *file_name;
+    char *content;
+    size_t size;
+    vector(size_t) line_begins;
+} SourceFile;
+
+static vector(SourceFile) SOURCE_FILES = NULL;
+
+static SourceFile *source_file(const char *filename) {
+    foreach(SourceFile, file, SOURCE_FILES) {
+        if (strcmp(file->file_name, filename) == 0) {
+            return file;
         }
-        file_content++;
     }
-    char *line = strsep(&file_content, "\n");
-    char offset[32];
-    for (long i = lines - 3; i < lines; i++) {
-        if (i < 0) continue;
-        sprintf(offset, "%lu | ", i + 1);
-        printf("%s%s\n", offset, line);
+    SourceFile file = { .file_name = filename, .line_begins = NULL };
+    file.content = map_whole_file(filename, &file.size);
+    vector_push_back(file.line_begins, 0);
+    for (size_t i = 0; i < file.size; i++) {
+        if (file.content[i] == '\n') {
+            vector_push_back(file.line_begins, i + 1);
+        }
+    }
+    vector_push_back(SOURCE_FILES, file);
+    return &SOURCE_FILES[vector_size(SOURCE_FILES) - 1];
+}
+
+// Lines are counted from 0, the ones past the end of the file are empty
+static void print_source_line(SourceFile *file, size_t line) {
+    if (line >= vector_size(file->line_begins)) {
+        return;
+    }
+    size_t begin = file->line_begins[line];
+    size_t end = line + 1 < vector_size(file->line_begins)
+        ? file->line_begins[line + 1] - 1 : file->size;
+    printf("%.*s", (int)(end - begin), file->content + begin);
+}
 
-        line = strsep(&file_content, "\n");
+void print_line_with_underline(const char *filename, Span span, Color color) {
+    SourceFile *file = source_file(filename);
+    long lines = (long)span.line;
+    char offset[32] = "";
+    for (long i = max(lines - 3, 0); i < lines; i++) {
+        sprintf(offset, "%lu | ", i + 1);
+        printf("%s", offset);
+        print_source_line(file, (size_t)i);
+        printf("\n");
     }
     for (size_t i = 0; i < span.column - 1 + strlen(offset); i++) {
         printf(" ");
@@ -96,6 +130,7 @@ void print_program(Program prog) {
 //-------------------------------------------------------------------------------------------------
 
 static void print_message(const char *lvl, const char *color, Span pos, const char *header, ...) {
+    begin_diagnostic();
     va_list args;
     va_start(args, header);
 
@@ -240,6 +275,12 @@ void error_invalid_character(Span pos) {
     exit(EXIT_FAILURE);
 }
 
+void error_unterminated_string(Span pos) {
+    print_error(pos, "Syntax error. Unterminated string", NULL);
+    printf("  The string is not closed with `\"` before the end of the file\n");
+    exit(EXIT_FAILURE);
+}
+
 void error_redefinition(const char *name, Span pos) {
     print_error(pos, "Redefinition of name `%s`!", name);
     exit(EXIT_FAILURE);
@@ -261,6 +302,7 @@ void error_unresolved_name(Symbol name) {
 }
 
 void error_entry_point_with_decls(void) {
+    begin_diagnostic();
     style(STYLE_BOLD);
     printf("%s: ", INPUT_FILE_NAME);
     printf_red("error: ");
@@ -269,6 +311,7 @@ void error_entry_point_with_decls(void) {
 }
 
 void error_empty_file(void) {
+    begin_diagnostic();
     style(STYLE_BOLD);
     printf("%s: ", INPUT_FILE_NAME);
     printf_red("error: ");
@@ -279,6 +322,7 @@ ENTRY_POINT_NAME":\n\t;; your code goes here\nret\n")
 }
 
 void error_no_entry(void) {
+    begin_diagnostic();
     style(STYLE_BOLD);
     printf("%s: ", INPUT_FILE_NAME);
     printf_red("error: ");
@@ -293,15 +337,63 @@ void error_unknown_directive(Token directive) {
 }
 
 void error_no_input_file(void) {
+    begin_diagnostic();
     style(STYLE_BOLD);
     printf_red("error: ");
     printf("no input file\n");
     exit(EXIT_FAILURE);
 }
 
+void error_link(LinkError error) {
+    if (error.kind == LINK_NO_ENTRY) {
+        INPUT_FILE_NAME = error.file_name;
+        error_no_entry();
+    }
+    begin_diagnostic();
+    style(STYLE_BOLD);
+    printf("%s: ", error.file_name);
+    printf_red("error: ");
+    switch (error.kind) {
+        case LINK_REDEFINITION: printf("Redefinition of name `%s`!\n", error.name); break;
+        case LINK_UNRESOLVED:   printf("Cannot find definition of name `%s`!\n", error.name); break;
+        case LINK_SIZEOF_CODE:  printf("Code label `%s` has no size!\n", error.name); break;
+        default: break;
+    }
+    exit(EXIT_FAILURE);
+}
+
 // ------------------------------------------------------------------------------------------------
 
+static size_t SHOWN_WARNINGS = 0; // And notes
+static size_t HIDDEN_WARNINGS = 0;
+static size_t HIDDEN_NOTES = 0;
+
+static void print_hidden_warnings(void) {
+    style(STYLE_BOLD);
+    printf_yellow("warning: ");
+    printf("%zu more warnings and %zu more notes were not shown, `-W 0` shows all of them\n",
+           HIDDEN_WARNINGS, HIDDEN_NOTES);
+}
+
+// Warnings and notes past MAX_WARNINGS are only counted, the counts are printed on exit
+static bool is_shown(size_t *hidden) {
+    if (!SHOW_WARNINGS) {
+        return false;
+    }
+    begin_diagnostic();
+    if (MAX_WARNINGS == 0 || SHOWN_WARNINGS < MAX_WARNINGS) {
+        SHOWN_WARNINGS++;
+        return true;
+    }
+    if (HIDDEN_WARNINGS + HIDDEN_NOTES == 0) {
+        atexit(print_hidden_warnings);
+    }
+    (*hidden)++;
+    return false;
+}
+
 void warning_number_out_of_bounds(long num, long lower_bound, long upper_bound, Span pos) {
+    if (!is_shown(&HIDDEN_WARNINGS)) return;
     print_warning(pos, "Narrowing convertion is possible. Number %ld is out of bounds [%ld;%ld]",
                   num, lower_bound, upper_bound);
 }
@@ -309,5 +401,6 @@ void warning_number_out_of_bounds(long num, long lower_bound, long upper_bound,
 // ------------------------------------------------------------------------------------------------
 
 void note_zero_alignment(Span pos) {
+    if (!is_shown(&HIDDEN_NOTES)) return;
     print_note(pos, "You use a zero alignment here.", NULL);
 }
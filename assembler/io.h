@@ -2,6 +2,7 @@
 #define __ASM_IO_H
 
 #include "program.h"
+#include "link.h"
 #include "lexer.h"
 #include "common/io.h"
 
@@ -23,6 +24,7 @@ void error_missed_label(TokenType instead_of_label, Span pos);
 void error_invalid_operand_in_vec(TokenType invalid_op, Span pos, vector(TokenType) valid_types);
 void error_unknown_register(const char *reg_name, Span pos);
 void error_invalid_character(Span pos);
+void error_unterminated_string(Span pos);
 void error_redefinition(const char *name, Span pos);
 void error_invalid_name(const char *name, const char *name_of_what, Span pos);
 void error_negative_alignment_size(Span pos);
@@ -32,6 +34,7 @@ void error_empty_file(void);
 void error_no_entry(void);
 void error_unknown_directive(Token directive);
 void error_no_input_file(void);
+void error_link(LinkError error);
 
 void warning_number_out_of_bounds(long num, long lower_bound, long upper_bound, Span pos);
 
@@ -10,22 +10,18 @@
 #include "common/utils.h"
 
 Token new_token(TokenType type, const char *value, Span span) {
-    return (Token) { type, strdup(value), span };
+    return (Token) { type, value, span };
 }
 
-Token copy_token(Token tok) {
+Token copy_token(Arena *arena, Token tok) {
     Token t = {
-        .value = strdup(tok.value),
+        .value = arena_strdup(arena, tok.value),
         .type = tok.type,
         .span = tok.span,
     };
     return t;
 }
 
-void free_token(void *lexem) {
-    free((void *)((Token*)lexem)->value);
-}
-
 bool is_reg(const char *buffer) {
     if (string_in_args(buffer, 3, "sp", "cf", "ip")) return true;
     if (buffer[0] != 'r') return false;
@@ -33,167 +29,212 @@ bool is_reg(const char *buffer) {
     return false;
 }
 
-bool is_ident(const char *buffer) {
-    if (isdigit(buffer[0])) return false;
-    for (size_t i = 0; i < strlen(buffer); i++) {
-        if (!(buffer[i] == '_' || (buffer[i] == '.' && i == 0) || isalnum(buffer[i]))) return false;
-    }
-    return true;
-}
-
 bool is_number(const char *buffer) {
-    for (size_t i = 0; i < strlen(buffer); i++) {
+    for (size_t i = 0; buffer[i] != '\0'; i++) {
         if (buffer[i] == '-') continue;
         if (!isdigit(buffer[i])) return false;
     }
     return true;
 }
 
-bool is_cmp(const char *buffer) {
-    return string_in_args(buffer, 6, "eq", "nq", "lt", "lq", "gt", "gq");
+// ------------------------------------------------------------------------------------------------
+
+static bool is(const char *word, const char *keyword) {
+    while (*keyword && *word == *keyword) {
+        word++;
+        keyword++;
+    }
+    return *word == *keyword;
 }
 
-const char *is_incorrect(const char *buffer) {
-    for (const char *c = buffer; *c != '\0'; c++)
-        if (*c != '#' && *c != '-' && *c != '.' && *c != '_' && !isalnum(*c)) return c;
-    return NULL;
+// Mnemonics come from the instruction set, the first char of a word rules out all other keywords
+// but a few
+static TokenType classify_keyword(const char *w, size_t len) {
+    if (len <= MNEMONIC_MAX_LEN && instropcode_from_str(w) != INSTR_COUNT) return TOKEN_INSTR;
+    switch (w[0]) {
+        case '#':
+            if (is(w, "#use")) return TOKEN_DIRECTIVE;
+            break;
+        case '.':
+            if (is(w, ".byte") || is(w, ".word") || is(w, ".align") || is(w, ".ascii")
+                || is(w, ".sizeof")) return TOKEN_DECL;
+            break;
+        case 'c':
+            if (is(w, "cf")) return TOKEN_REG;
+            break;
+        case 'e':
+            if (is(w, "eq")) return TOKEN_CMP;
+            break;
+        case 'g':
+            if (is(w, "gt") || is(w, "gq")) return TOKEN_CMP;
+            break;
+        case 'i':
+            if (is(w, "ip")) return TOKEN_REG;
+            break;
+        case 'l':
+            if (is(w, "lt") || is(w, "lq")) return TOKEN_CMP;
+            break;
+        case 'n':
+            if (is(w, "nq")) return TOKEN_CMP;
+            break;
+        case 'r':
+            // r0 - r12
+            if (isdigit(w[1]) && (w[2] == '\0' || (w[1] == '1' && w[2] >= '0' && w[2] <= '2' && w[3] == '\0')))
+                return TOKEN_REG;
+            break;
+        case 's':
+            if (is(w, "sp")) return TOKEN_REG;
+            break;
+    }
+    return TOKEN_UNKNOWN;
 }
 
-// ------------------------------------------------------------------------------------------------
+static Span span_at(const Lexer *lexer, const char *begin, size_t len) {
+    return (Span) { begin - lexer->line_begin + 1, lexer->line, len };
+}
 
-static Span calc_span(Span span, size_t buff_size) {
-    return (Span) { span.column - buff_size, span.line, buff_size };
+static void new_line(Lexer *lexer, const char *newline) {
+    lexer->line++;
+    lexer->line_begin = newline + 1;
 }
 
 Lexer new_lexer(const char *file_name) {
-    vector(Token) token_buffer = NULL;
-    vector_reserve(token_buffer, 3);
-    char *source = read_whole_file(file_name);
-    if (strlen(source) == 0) {
+    size_t size;
+    char *source = map_whole_file(file_name, &size);
+    if (size == 0 || source[0] == '\0') {
         error_empty_file();
     }
     return (Lexer){
-        .i = 1,
-        .c = source[0],
-        .source_file = source,
-        .current_span = (Span){ 1, 1, 0 },
+        .source = source,
+        .source_size = size,
         .file_name = file_name,
-        .token_buffer = token_buffer,
-        .buffer = NULL,
+        .cur = source,
+        .line_begin = source,
+        .line = 1,
+        .comma_pending = false,
     };
 }
 
-void lexer_forward(Lexer *lexer) {
-    if (lexer->i < strlen(lexer->source_file)) {
-        lexer->c = lexer->source_file[lexer->i++];
-    }
-    switch (lexer->c) {
-        case '\n':
-            lexer->current_span.line++;
-            lexer->current_span.column = 1;
+// Skips whitespaces and comments
+static void skip_blank(Lexer *lexer) {
+    char *c = lexer->cur;
+    for (;;) {
+        if (*c == '\n') {
+            new_line(lexer, c);
+            c++;
+        } else if (*c == ' ' || *c == '\t' || *c == '\r' || *c == '\v' || *c == '\f') {
+            c++;
+        } else if (*c == ';') {
+            while (*c != '\n' && *c != '\0') c++;
+        } else {
             break;
-        default:
-            lexer->current_span.column++;
+        }
     }
+    lexer->cur = c;
 }
 
-Token lex_string(Lexer *lexer) {
-    vector(char) buff = NULL;
-    lexer_forward(lexer);
-    while (lexer->c != '"') {
-        vector_push_back(buff, lexer->c);
-        lexer_forward(lexer);
+static Token lex_string(Lexer *lexer) {
+    char *begin = lexer->cur;
+    const char *line_begin = lexer->line_begin;
+    size_t line = lexer->line;
+    char *c = begin + 1;
+    while (*c != '"' && *c != '\0') {
+        if (*c == '\n') new_line(lexer, c);
+        c++;
+    }
+    if (*c == '\0') {
+        error_unterminated_string((Span) { begin - line_begin + 1, line, 1 });
     }
-    vector_push_back(buff, '\0');
-    Token str = new_token(TOKEN_STRING, buff, calc_span(lexer->current_span, strlen(buff) + 2));
-    lexer_forward(lexer);
-    free_vector(&buff);
-    return str;
+    Span span = { begin - line_begin + 1, line, c - begin + 1 };
+    lexer->cur = c + 1;
+    *c = '\0';
+    return new_token(TOKEN_STRING, begin + 1, span);
 }
 
-void lexer_skip_whitespaces(Lexer *lexer) {
-    if (lexer->i >= strlen(lexer->source_file)) return;
-    while (isspace(lexer->c)) lexer_forward(lexer);
+static bool is_word_end(char c) {
+    return c == ' ' || c == '\n' || c == '\t' || c == '\r' || c == ',' || c == ':' || c == '\0'
+           || c == '\v' || c == '\f';
 }
 
-void lexer_skip_comment(Lexer *lexer) {
-    while (lexer->c == ';') {
-        while (lexer->c != 10) lexer_forward(lexer);
-        lexer_forward(lexer);
-    }
+static bool is_digit(char c) {
+    return c >= '0' && c <= '9';
 }
 
-Token make_nonterm(const char *buffer, Span token_span) {
-    if (is_ident(buffer))
-        return new_token(TOKEN_IDENT, buffer, token_span);
-    if (is_number(buffer))
-        return new_token(TOKEN_NUMBER, buffer, token_span);
-    return new_token(TOKEN_UNKNOWN, buffer, token_span);
-}
+// What the chars of a word allow it to be, collected while it is scanned
+typedef struct {
+    bool number;
+    bool ident;
+    const char *incorrect; // The first char that cannot be in any word
+} WordChars;
 
-Token lexer_get_next_token(Lexer *lexer) {
-    Span tok_span;
-    string_clean(lexer->buffer);
-    if (!vector_empty(lexer->token_buffer)) {
-        Token tok = lexer->token_buffer[0];
-        vector_erase(lexer->token_buffer, 0);
-        return tok;
+static Token classify_word(const Lexer *lexer, char *word, WordChars chars, Span span) {
+    TokenType type = classify_keyword(word, span.len);
+    if (type != TOKEN_UNKNOWN) {
+        return new_token(type, word, span);
     }
-    do {
-        // if the entire line is a comment it will skip it.
-        lexer_skip_comment(lexer);
-        lexer_skip_whitespaces(lexer);
-        if (lexer->i >= strlen(lexer->source_file))
-            return new_token(TOKEN_EOF, "EOF", lexer->current_span);
-    } while (isspace(lexer->c) || lexer->c == ';');
-
-    switch (lexer->c) {
-        case '"': return lex_string(lexer);
-        case ';': lexer_skip_comment(lexer); break;
-        case ',':
-            lexer_forward(lexer);
-            return new_token(TOKEN_COMMA, ",", lexer->current_span);
+    if (word[0] == 'r' && is_reg(word)) { // Every other register is a keyword
+        error_unknown_register(word, span);
     }
-
-    while (!isspace(lexer->c) && lexer->c != ',') {
-        if (lexer->c == ':') {
-            lexer_forward(lexer);
-            return new_token(TOKEN_LABEL, lexer->buffer, tok_span);
-        }
-        string_push_char(&lexer->buffer, tolower(lexer->c));
-        tok_span = calc_span(lexer->current_span, strlen(lexer->buffer));
-        lexer_forward(lexer);
+    if (chars.incorrect != NULL) {
+        error_invalid_character(span_at(lexer, chars.incorrect, 1));
     }
-
-    // Terms
-    if (in_directive_set(lexer->buffer)) {
-        return new_token(TOKEN_DIRECTIVE, lexer->buffer, tok_span);
+    if (chars.ident)
+        return new_token(TOKEN_IDENT, word, span);
+    if (chars.number)
+        return new_token(TOKEN_NUMBER, word, span);
+    return new_token(TOKEN_UNKNOWN, word, span);
+}
+
+static Token lex_word(Lexer *lexer) {
+    char *begin = lexer->cur;
+    char *c = begin;
+    WordChars chars = { true, !is_digit(*begin), NULL };
+    for (; !is_word_end(*c); c++) {
+        if (*c >= 'A' && *c <= 'Z') {
+            *c += 'a' - 'A';
+        }
+        bool alnum = (*c >= 'a' && *c <= 'z') || is_digit(*c);
+        chars.number &= is_digit(*c) || *c == '-';
+        chars.ident &= alnum || *c == '_' || (*c == '.' && c == begin);
+        if (!alnum && *c != '#' && *c != '-' && *c != '.' && *c != '_' && !chars.incorrect) {
+            chars.incorrect = c;
+        }
     }
-    if (string_in_args(lexer->buffer, 5, ".byte", ".word", ".align", ".ascii", ".sizeof"))
-        return new_token(TOKEN_DECL, lexer->buffer, tok_span);
-    if (is_cmp(lexer->buffer)) {
-        return new_token(TOKEN_CMP, lexer->buffer, tok_span);
+    Span span = span_at(lexer, begin, c - begin);
+    char end = *c;
+    *c = '\0';
+    Token tok = end == ':' ? new_token(TOKEN_LABEL, begin, span)
+                           : classify_word(lexer, begin, chars, span);
+    lexer->cur = end == '\0' ? c : c + 1;
+    if (end == '\n') {
+        new_line(lexer, c);
+    } else if (end == ',') {
+        lexer->comma_pending = true;
+        lexer->comma_span = span_at(lexer, c, 1);
     }
-    if (in_instruction_set(lexer->buffer))
-        return new_token(TOKEN_INSTR, lexer->buffer, tok_span);
-    if (is_reg(lexer->buffer)) {
-        if (!in_register_set(lexer->buffer))
-            error_unknown_register(lexer->buffer, tok_span);
-        return new_token(TOKEN_REG, lexer->buffer, tok_span);
+    return tok;
+}
+
+Token lexer_get_next_token(Lexer *lexer) {
+    if (lexer->comma_pending) {
+        lexer->comma_pending = false;
+        return new_token(TOKEN_COMMA, ",", lexer->comma_span);
     }
-    const char *incorrect_at = is_incorrect(lexer->buffer);
-    if (incorrect_at != NULL) {
-        tok_span.column += tok_span.len - 1;
-        tok_span.len = 1;
-        error_invalid_character(tok_span);
+    skip_blank(lexer);
+    switch (*lexer->cur) {
+        case '\0':
+            return new_token(TOKEN_EOF, "EOF", span_at(lexer, lexer->cur, 0));
+        case '"':
+            return lex_string(lexer);
+        case ',':
+            lexer->cur++;
+            return new_token(TOKEN_COMMA, ",", span_at(lexer, lexer->cur - 1, 1));
+        default:
+            return lex_word(lexer);
     }
-
-    return make_nonterm(lexer->buffer, tok_span);
 }
 
 void free_lexer(void *lexer_ptr) {
-    Lexer lexer = *(Lexer *)lexer_ptr;
-    free((void *)lexer.source_file);
-    free_vector(&lexer.token_buffer);
-    free_string(&lexer.buffer);
+    Lexer *lexer = (Lexer *)lexer_ptr;
+    unmap_whole_file(lexer->source, lexer->source_size);
 }
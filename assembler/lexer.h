@@ -1,4 +1,3 @@
-// FIX: rewrite lexer
 #ifndef __ASM_LEXER_H
 #define __ASM_LEXER_H
 
@@ -6,6 +5,7 @@
 #include <stdbool.h>
 #include "common/vector.h"
 #include "common/str.h"
+#include "common/arena.h"
 
 typedef enum {
     TOKEN_UNKNOWN = 0,
@@ -32,37 +32,32 @@ typedef struct {
     Span span;
 } Token;
 
+// Tokens made by the lexer point into the source of their Parser. copy_token copies the value to
+// the arena, so that the token outlives the source
 Token new_token(TokenType type, const char *value, Span span);
-Token copy_token(Token tok);
-void free_token(void *lexem);
+Token copy_token(Arena *arena, Token tok);
 
 bool is_reg(const char *buffer);
-bool is_instr(const char *buffer);
 bool is_number(const char *buffer);
-bool is_cmp(const char *buffer);
-// Checks buffer for incorrect chars, returns a pointer to wrong char in buffer.
-// Returns NULL if everything is correct
-const char *is_incorrect(const char *buffer);
 
 // ------------------------------------------------------------------------------------------------
 
+// Scans the source in a single pass. Words are lowercased and terminated in place, so token values
+// point into the source instead of being copied
 typedef struct {
-    char *source_file;
+    char *source; // Mapped with map_whole_file, followed by a zero
+    size_t source_size;
     const char *file_name;
-    size_t i;
-    char c;
-    Span current_span;
-    vector(Token) token_buffer;
-    string buffer;
+    char *cur;
+    const char *line_begin;
+    size_t line;
+    bool comma_pending; // The comma that ended the last word was overwritten by its terminator
+    Span comma_span;
 } Lexer;
 
 Lexer new_lexer(const char *file_name);
-void lexer_forward(Lexer *lexer);
-Token lex_string(Lexer *lexer);
-void lexer_skip_whitespaces(Lexer *lexer);
-void lexer_skip_comment(Lexer *lexer);
-Token make_nonterm(const char *buffer, Span token_span);
 Token lexer_get_next_token(Lexer *lexer);
+// Unmaps the source, so every token it made becomes invalid
 void free_lexer(void *lexer);
 
 #endif
@@ -0,0 +1,117 @@
+#include "link.h"
+#include "common/utils.h"
+#include <stdlib.h>
+#include <string.h>
+
+// Addresses past the 16-bit space wrap around, as they do when the sources are assembled together
+typedef struct {
+    size_t data_base; // Where the data of the object goes
+    size_t code_base;
+    size_t first_symbol; // Index of its first label in Program.sym_table
+} Placement;
+
+static size_t place(const Object *object, const Placement *placement, word address, bool is_data) {
+    if (is_data) {
+        return placement->data_base + address;
+    }
+    return placement->code_base + address - object->data_size;
+}
+
+static bool define_labels(Program *prog, vector(Object) objects, Placement *placements,
+                          ObjectSymbolTable *table, LinkError *error)
+{
+    for (size_t i = 0; i < vector_size(objects); i++) {
+        Object *object = &objects[i];
+        placements[i].first_symbol = vector_size(table->definitions);
+        if (!object_define_symbols(table, object, i, error)) {
+            return false;
+        }
+        foreach(ObjectSymbol, symbol, object->symbols) {
+            word address = place(object, &placements[i], symbol->address, symbol->is_data);
+            program_add_definition(prog, symbol->name, address);
+        }
+    }
+    if (!program_get_symbol(*prog, ENTRY_POINT_NAME)) {
+        const char *last = vector_empty(objects) ? "" : objects[vector_size(objects) - 1].file_name;
+        *error = (LinkError) { LINK_NO_ENTRY, ENTRY_POINT_NAME, last };
+        return false;
+    }
+    return true;
+}
+
+// The equivalent of program_resolve_names
+static bool apply_relocs(Program *prog, vector(Object) objects, Placement *placements,
+                         const ObjectSymbolTable *table, vector(byte) image, LinkError *error)
+{
+    for (size_t i = 0; i < vector_size(objects); i++) {
+        Object *object = &objects[i];
+        foreach(Reloc, reloc, object->relocs) {
+            size_t symbol;
+            if (!object_bind_reloc(table, object, placements[i].first_symbol, *reloc, &symbol,
+                                   error)) {
+                return false;
+            }
+            word where = place(object, &placements[i], reloc->address,
+                               reloc->address < object->data_size);
+            object_patch_reloc(image + where, reloc->kind, prog->sym_table[symbol].address,
+                               table->definitions[symbol].symbol.size);
+        }
+    }
+    return true;
+}
+
+bool program_link(Program *prog, vector(Object) objects, ExecFile *output, LinkError *error) {
+    size_t count = vector_size(objects);
+    Placement *placements = calloc(max(count, 1), sizeof(Placement));
+    size_t size = 0;
+    for (size_t i = 0; i < count; i++) {
+        placements[i].data_base = size;
+        size += objects[i].data_size;
+    }
+    for (size_t i = 0; i < count; i++) {
+        placements[i].code_base = size;
+        size += objects[i].program.size - objects[i].data_size;
+    }
+
+    ObjectSymbolTable table = new_object_symbol_table(); // In the order of the symbols of prog
+    vector(byte) image = NULL;
+    bool linked = define_labels(prog, objects, placements, &table, error);
+    if (linked) {
+        vector_reserve(image, size);
+        __vector_set_size(image, size);
+        for (size_t i = 0; i < count; i++) {
+            SectionView program = objects[i].program;
+            word data = objects[i].data_size;
+            memcpy(image + placements[i].data_base, program.data, data);
+            memcpy(image + placements[i].code_base, program.data + data, program.size - data);
+        }
+        linked = apply_relocs(prog, objects, placements, &table, image, error);
+    }
+    if (linked) {
+        *output = new_execfile();
+        vector(byte) directives = NULL;
+        foreach(Object, object, objects) {
+            output->version = max(output->version, object->file.version);
+            for (size_t i = 0; i < object->directives.size; i++) {
+                vector_push_back(directives, object->directives.data[i]);
+            }
+        }
+        if (!vector_empty(directives)) {
+            execfile_add_section(output, "directives", directives);
+        }
+        if (!vector_empty(image)) {
+            execfile_add_section(output, "program", image);
+        }
+        vector(byte) symbols = NULL;
+        program_compile_symbol_table(*prog, &symbols);
+        if (!vector_empty(symbols)) {
+            execfile_add_section(output, "symbols", symbols);
+        }
+        free_vector(&directives);
+        free_vector(&symbols);
+    }
+    free_vector(&image);
+    free_object_symbol_table(&table);
+    free(placements);
+    return linked;
+}
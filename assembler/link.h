@@ -0,0 +1,14 @@
+#ifndef __ASM_LINK_H
+#define __ASM_LINK_H
+
+#include "common/object.h"
+#include "common/sex.h"
+#include "common/vector.h"
+#include "program.h"
+
+// Lays the objects out as if their sources were assembled together: the data of every object in
+// order, then the code of every object. The labels become the symbols of prog, which should be
+// empty. Returns false and leaves output alone if the objects cannot be linked
+bool program_link(Program *prog, vector(Object) objects, ExecFile *output, LinkError *error);
+
+#endif
@@ -1,10 +1,10 @@
-// FIX: Memory leaks, despite the fact that nobody cares about them in compilers
 #define VECTOR_IMPLEMENTATION
 #define STR_IMPLEMENTATION
 
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <assert.h>
 #include "io.h"
@@ -13,16 +13,32 @@
 #include "program.h"
 #include "parser.h"
 #include "analysis.h"
+#include "phases.h"
+#include "fragment.h"
+#include "link.h"
+#include "cache.h"
+#include "common/object.h"
 #include "common/utils.h"
 
 const char *INPUT_FILE_NAME;
 char *OUTPUT_FILE_NAME = "a.out";
 bool SHOW_TOKENS = false;
 bool SHOW_IMAGE = false;
+bool SHOW_PHASE_TIMES = false;
 bool ENABLE_COLORS = true;
+bool SHOW_WARNINGS = true; // And notes
+size_t MAX_WARNINGS = 100; // And notes, 0 is no limit
+bool OPTIMIZE = false;
 
 void print_help(const char *name);
+void parse_files(Program *prog, vector(const char *) input_files, size_t jobs);
+ExecFile link_files(Program *prog, vector(const char *) input_files, size_t jobs,
+                    const char *cache_dir);
+void add_fragment(Program *prog, Fragment *fragment);
+bool is_object_file(const char *filename);
+void parse_file(Program *prog, const char *filename);
 void parse_top_level(Program *prog, Parser *parser);
+void print_tokens(const char *filename, Parser parser);
 
 int main(int argc, char *argv[]) {
     if (argc < 2) {
@@ -30,15 +46,24 @@ int main(int argc, char *argv[]) {
         return 0;
     }
     vector(const char *) input_files = NULL;
+    size_t jobs = 0;
+    bool make_object = false;
+    const char *cache_dir = NULL;
 
     int res = 0;
-    while ( (res = getopt(argc, argv, "hcito:")) != -1 ) {
+    while ( (res = getopt(argc, argv, "hcritTOo:j:C:W:")) != -1 ) {
         switch (res) {
             case 'h': print_help(argv[0]); return 0;
             case 't': SHOW_TOKENS = true; break;
+            case 'T': SHOW_PHASE_TIMES = true; break;
+            case 'O': OPTIMIZE = true; break;
             case 'i': SHOW_IMAGE = true; break;
+            case 'r': make_object = true; break;
+            case 'C': cache_dir = optarg; break;
             case 'c': ENABLE_COLORS = false; break;
             case 'o': OUTPUT_FILE_NAME = optarg; break;
+            case 'j': jobs = strtoul(optarg, NULL, 10); break;
+            case 'W': MAX_WARNINGS = strtoul(optarg, NULL, 10); break;
             case '?': return 1;
         }
     }
@@ -49,27 +74,34 @@ int main(int argc, char *argv[]) {
         error_no_input_file();
     }
 
-    Program program = new_program();
-
+    bool has_objects = false;
     foreach(const char *, filename, input_files) {
-        INPUT_FILE_NAME = *filename;
-        Parser parser = new_parser(INPUT_FILE_NAME);
-        if (SHOW_TOKENS) {
-            printf("%s:\n", *filename);
-            for (size_t i = 0; i < vector_size(parser.tokens); i++) {
-                print_token(parser.tokens[i]);
-            }
-        }
-        parse_top_level(&program, &parser);
-        free_parser(&parser);
+        has_objects |= is_object_file(*filename);
+    }
+
+    Program program = new_program();
+    ExecFile output;
+    if (!make_object && (cache_dir || has_objects)) {
+        output = link_files(&program, input_files, jobs, cache_dir);
+    } else {
+        parse_files(&program, input_files, jobs);
+        double begin = phase_begin();
+        output = make_object ? program_compile_object(&program) : program_compile(&program);
+        phase_end(PHASE_PROGRAM_COMPILE, begin);
     }
-    ExecFile output = program_compile(&program);
 
     if (SHOW_IMAGE) {
         print_program(program);
     }
-    program_check_unresolved_names(program);
+    if (!make_object) {
+        program_check_unresolved_names(program);
+    }
+    double begin = phase_begin();
     execfile_write(output, OUTPUT_FILE_NAME);
+    phase_end(PHASE_EXECFILE_WRITE, begin);
+    if (SHOW_PHASE_TIMES) {
+        print_phase_times();
+    }
 
     free_program(&program);
     free_vector(&input_files);
@@ -78,6 +110,132 @@ int main(int argc, char *argv[]) {
     return 0;
 }
 
+void parse_files(Program *prog, vector(const char *) input_files, size_t jobs) {
+    if (jobs == 1 || vector_size(input_files) == 1) {
+        foreach(const char *, filename, input_files) {
+            parse_file(prog, *filename);
+        }
+        return;
+    }
+    // Files are parsed on their own, then added in the order they were given in
+    vector(Fragment) fragments = NULL;
+    vector_set_destructor(fragments, free_fragment);
+    foreach(const char *, filename, input_files) {
+        vector_push_back(fragments, new_fragment(*filename));
+    }
+    parse_fragments(fragments, jobs);
+    foreach(Fragment, fragment, fragments) {
+        add_fragment(prog, fragment);
+    }
+    free_vector(&fragments);
+}
+
+// Objects are read, sources found in the cache are read from it, the other sources are assembled
+// into objects of their own. Then they are linked in the order they were given in
+ExecFile link_files(Program *prog, vector(const char *) input_files, size_t jobs,
+                    const char *cache_dir)
+{
+    vector(Object) objects = NULL;
+    vector_set_destructor(objects, free_object);
+    vector(char *) cache_paths = NULL; // Of the objects to make
+    vector(size_t) sources = NULL;    // Indices of the objects to make
+    vector(Fragment) fragments = NULL; // Of the sources to assemble
+    vector_set_destructor(fragments, free_fragment);
+    bool has_objects = false;
+    foreach(const char *, filename, input_files) {
+        Object object = { .file_name = *filename };
+        char *cache_path = cache_dir && !is_object_file(*filename)
+                           ? cache_object_path(cache_dir, *filename, OPTIMIZE) : NULL;
+        if (is_object_file(*filename)) {
+            has_objects = true;
+            if (access(*filename, R_OK) != 0) {
+                error_file_doesnot_exist(*filename);
+            }
+            if (!object_read(*filename, &object)) {
+                error_invalid_file_format(*filename);
+            }
+        } else if (cache_path && object_read(cache_path, &object)) {
+            object.file_name = *filename;
+            free(cache_path);
+        } else {
+            vector_push_back(sources, vector_size(objects));
+            vector_push_back(cache_paths, cache_path);
+            vector_push_back(fragments, new_fragment(*filename));
+        }
+        vector_push_back(objects, object);
+    }
+
+    parse_fragments(fragments, jobs);
+    for (size_t i = 0; i < vector_size(fragments); i++) {
+        Program source = new_program();
+        add_fragment(&source, &fragments[i]);
+        double begin = phase_begin();
+        ExecFile object = program_compile_object(&source);
+        phase_end(PHASE_PROGRAM_COMPILE, begin);
+        if (cache_paths[i]) {
+            cache_store(object, cache_dir, cache_paths[i]);
+            free(cache_paths[i]);
+        }
+        object_from_execfile(object, fragments[i].file_name, &objects[sources[i]]);
+        free_program(&source);
+    }
+    free_vector(&fragments);
+    free_vector(&sources);
+    free_vector(&cache_paths);
+
+    double begin = phase_begin();
+    ExecFile output;
+    LinkError error;
+    bool linked = program_link(prog, objects, &output, &error);
+    phase_end(PHASE_PROGRAM_COMPILE, begin);
+    if (!linked && has_objects) {
+        error_link(error); // The names point into the objects
+    }
+    free_vector(&objects);
+    if (!linked) {
+        // Assembled together, the sources get the error they get without the cache. Their warnings
+        // were printed when they were assembled
+        SHOW_WARNINGS = false;
+        free_program(prog);
+        *prog = new_program();
+        parse_files(prog, input_files, jobs);
+        begin = phase_begin();
+        output = program_compile(prog);
+        phase_end(PHASE_PROGRAM_COMPILE, begin);
+    }
+    return output;
+}
+
+void add_fragment(Program *prog, Fragment *fragment) {
+    if (fragment->has_diagnostics) {
+        parse_file(prog, fragment->file_name);
+        return;
+    }
+    INPUT_FILE_NAME = fragment->file_name;
+    if (SHOW_TOKENS) {
+        print_tokens(fragment->file_name, fragment->parser);
+    }
+    phase_add(PHASE_NEW_PARSER, fragment->parser_time);
+    double begin = phase_begin();
+    program_add_fragment(prog, fragment);
+    phase_end(PHASE_PARSE_TOP_LEVEL, begin);
+    phase_add(PHASE_PARSE_TOP_LEVEL, fragment->parse_time);
+}
+
+void parse_file(Program *prog, const char *filename) {
+    INPUT_FILE_NAME = filename;
+    double begin = phase_begin();
+    Parser parser = new_parser(filename, prog->arena);
+    phase_end(PHASE_NEW_PARSER, begin);
+    if (SHOW_TOKENS) {
+        print_tokens(filename, parser);
+    }
+    begin = phase_begin();
+    parse_top_level(prog, &parser);
+    phase_end(PHASE_PARSE_TOP_LEVEL, begin);
+    free_parser(&parser);
+}
+
 void parse_top_level(Program *prog, Parser *parser) {
     while (parser->tokens[parser->idx].type != TOKEN_EOF) {
         Token tok = parser->tokens[parser->idx];
@@ -98,13 +256,32 @@ void parse_top_level(Program *prog, Parser *parser) {
     }
 }
 
+bool is_object_file(const char *filename) {
+    size_t len = strlen(filename);
+    return len >= 5 && strcmp(filename + len - 5, ".sobj") == 0;
+}
+
+void print_tokens(const char *filename, Parser parser) {
+    printf("%s:\n", filename);
+    for (size_t i = 0; i < vector_size(parser.tokens); i++) {
+        print_token(parser.tokens[i]);
+    }
+}
+
 void print_help(const char *name) {
     printf("%s - an assembler for svm.\n", name);
-    printf("Usage: %s [options] file\n", name);
+    printf("Usage: %s [options] file...\n", name);
+    printf("Files ending with .sobj are objects, they are linked with the sources.\n");
     printf("Options:\n");
     printf("  -h          Prints this message and exit\n");
     printf("  -o <file>   Places output to <file>\n");
+    printf("  -j <jobs>   Parses up to <jobs> files at once, 0 (default) is one per processor\n");
     printf("  -i          Prints information about the program\n");
     printf("  -t          Prints token tree\n");
+    printf("  -T          Prints the time spent in every phase to stderr\n");
+    printf("  -O          Rewrites instructions into fewer and cheaper ones within every label\n");
+    printf("  -r          Makes a relocatable object of the sources instead of an executable\n");
+    printf("  -C <dir>    Keeps objects of the sources in <dir> to assemble only changed ones\n");
+    printf("  -W <count>  Prints up to <count> warnings and notes (default 100), 0 prints all\n");
     printf("  -c          Disables colors in output\n");
 }
@@ -10,71 +10,65 @@ Decl new_decl(Token decl_kind, Token decl_value, Span span) {
     return (Decl){ decl_kind, decl_value, span };
 }
 
-void free_decl(void *decl) {
-    Decl *d = (Decl *)decl;
-    free_token(&d->kind);
-    free_token(&d->value);
-}
-
-Instr new_instr(InstrOpcode opcode, vector(Token) ops, Span pos) {
-    return (Instr){ opcode, ops, pos };
-}
-
-void free_instr(void *instr) {
-    Instr *i = (Instr *)instr;
-    free_vector(&i->ops);
+Instr new_instr(InstrOpcode opcode, Token *ops, size_t amount_of_ops, Span pos) {
+    return (Instr){ opcode, ops, amount_of_ops, pos, 0 };
 }
 
 void check_single_op(Token op, size_t expected_types_count, ...) {
     va_list args;
     va_start(args, expected_types_count);
-    vector(TokenType) types = NULL;
+    TokenType expected[TOKEN_EOF + 1];
     for (size_t i = 0; i < expected_types_count; i++) {
-        TokenType tt = va_arg(args, TokenType);
-        vector_push_back(types, tt);
-        if (op.type == tt) {
+        expected[i] = va_arg(args, TokenType);
+        if (op.type == expected[i]) {
+            va_end(args);
             return;
         }
     }
-    if (expected_types_count == 1 && types[0] == TOKEN_REG) {
+    va_end(args);
+    if (expected_types_count == 1 && expected[0] == TOKEN_REG) {
         error_unknown_register(op.value, op.span);
     }
     if (op.type == TOKEN_UNKNOWN) {
         error_invalid_name(op.value, "identifier", op.span);
     }
+    vector(TokenType) types = NULL;
+    for (size_t i = 0; i < expected_types_count; i++) {
+        vector_push_back(types, expected[i]);
+    }
     error_invalid_operand_in_vec(op.type, op.span, types);
-    va_end(args);
 }
 
 void instr_check_ops(Instr instr) {
-    vector(Token) ops = instr.ops;
-
-    if (instropcode_in_args(instr.opcode, 4, INSTR_MOV, INSTR_LD, INSTR_ST, INSTR_CMP)) {
-        check_single_op(ops[0], 1, TOKEN_REG);
-        check_single_op(ops[1], 3, TOKEN_REG, TOKEN_NUMBER, TOKEN_IDENT);
-    }
-    if (instropcode_in_args(instr.opcode, 9, INSTR_ADD, INSTR_SUB, INSTR_MUL, INSTR_DIV, INSTR_AND,
-                                             INSTR_OR, INSTR_OR, INSTR_SHL, INSTR_SHR))
-    {
-        check_single_op(ops[0], 1, TOKEN_REG);
-        check_single_op(ops[1], 3, TOKEN_REG, TOKEN_NUMBER, TOKEN_IDENT);
-    }
-    if (instropcode_in_args(instr.opcode, 3, INSTR_NOT, INSTR_PUSH, INSTR_POP)) {
-        check_single_op(ops[0], 1, TOKEN_REG);
-    }
-    if (instropcode_in_args(instr.opcode, 2, INSTR_CALL, INSTR_JMP)) {
-        check_single_op(ops[0], 1, TOKEN_IDENT);
-    }
-    if (instr.opcode == INSTR_JIF) {
-        check_single_op(ops[0], 1, TOKEN_CMP);
-        check_single_op(ops[1], 1, TOKEN_IDENT);
-    }
-    if (instropcode_in_args(instr.opcode, 2, INSTR_OUT, INSTR_IN)) {
-        check_single_op(ops[0], 1, TOKEN_NUMBER);
-        check_single_op(ops[1], 3, TOKEN_NUMBER, TOKEN_IDENT, TOKEN_REG);
-        check_single_op(ops[2], 2, TOKEN_NUMBER, TOKEN_REG);
+    Token *ops = instr.ops;
+
+    switch (instr_shape(instr.opcode)) {
+        case SHAPE_REG_ANY:
+            check_single_op(ops[0], 1, TOKEN_REG);
+            check_single_op(ops[1], 3, TOKEN_REG, TOKEN_NUMBER, TOKEN_IDENT);
+            break;
+        case SHAPE_REG:
+            check_single_op(ops[0], 1, TOKEN_REG);
+            break;
+        case SHAPE_ADDR:
+            check_single_op(ops[0], 1, TOKEN_IDENT);
+            break;
+        case SHAPE_CMP_ADDR:
+            check_single_op(ops[0], 1, TOKEN_CMP);
+            check_single_op(ops[1], 1, TOKEN_IDENT);
+            break;
+        case SHAPE_PORT_IO:
+            check_single_op(ops[0], 1, TOKEN_NUMBER);
+            check_single_op(ops[1], 3, TOKEN_NUMBER, TOKEN_IDENT, TOKEN_REG);
+            check_single_op(ops[2], 2, TOKEN_NUMBER, TOKEN_REG);
+            break;
+        case SHAPE_PORT:
+            check_single_op(ops[0], 1, TOKEN_NUMBER);
+            break;
+        default:
+            // ret instruction doesn't need a check (it has no params ;-;)
+            break;
     }
-    // ret instruction doesn't need a check (it has no params ;-;)
 }
 
 Directive new_directive(DirOpcode opcode, vector(Token) params) {
@@ -90,19 +84,12 @@ void directive_check_params(Directive directive) {
     }
 }
 
-void free_directive(void *directive) {
-    Directive *dir = (Directive *)directive;
-    if (dir->opcode != DIR_COUNT) {
-        free_vector(&dir->params);
-    }
-}
-
 Label empty_label(void) {
     return (Label){ NULL, false, 0, (Span){0, 0, 0}, {NULL} };
 }
 
-void label_set_name(Label *label, const char *name) {
-    label->name = strdup(name);
+void label_set_name(Arena *arena, Label *label, const char *name) {
+    label->name = arena_strdup(arena, name);
 }
 
 void label_add_instr(Label *label, Instr instr) {
@@ -113,33 +100,20 @@ void label_add_decl(Label *label, Decl decl) {
     vector_push_back(label->declarations, decl);
 }
 
-void free_label(void *label) {
-    Label lbl = *(Label *)label;
-    if (lbl.name)
-        free((void *)lbl.name);
-    if (lbl.is_data) {
-        vector_set_destructor(lbl.declarations, free_decl);
-        free_vector(&lbl.declarations);
-    } else {
-        vector_set_destructor(lbl.instructions, free_instr);
-        free_vector(&lbl.instructions);
-    }
-}
-
 // ------------------------------------------------------------------------------------------------
 
-Parser new_parser(const char *filename) {
+Parser new_parser(const char *filename, Arena *arena) {
     vector(Token) tokens = NULL;
-    vector_set_destructor(tokens, free_token);
     Lexer lexer = new_lexer(filename);
     Token tok;
     do {
         tok = lexer_get_next_token(&lexer);
         vector_push_back(tokens, tok);
     } while (tok.type != TOKEN_EOF && tok.type != TOKEN_UNKNOWN);
-    free_lexer(&lexer);
 
     return (Parser) {
+        .lexer = lexer,
+        .arena = arena,
         .tokens = tokens,
         .idx = 0,
         .filename = filename,
@@ -169,18 +143,20 @@ Token parser_get_checked_token_in_list(Parser parser, size_t pos, size_t types_c
     va_list args;
     va_start(args, types_count);
     Token tok = parser.tokens[pos];
-    vector(TokenType) types = NULL;
+    TokenType expected[TOKEN_EOF + 1];
 
     for (size_t i = 0; i < types_count; i++) {
-        TokenType t = va_arg(args, TokenType);
-        if (tok.type == t) {
+        expected[i] = va_arg(args, TokenType);
+        if (tok.type == expected[i]) {
             va_end(args);
-            free_vector(&types);
             return tok;
         }
-        vector_push_back(types, t);
     }
     va_end(args);
+    vector(TokenType) types = NULL;
+    for (size_t i = 0; i < types_count; i++) {
+        vector_push_back(types, expected[i]);
+    }
     error_unexpected_token_in_vec(tok, types);
     return new_token(TOKEN_UNKNOWN, "", (Span){0, 0, 0});
 }
@@ -189,10 +165,10 @@ Directive parse_directive(Parser *parser) {
     Token dir_tok = parser_get_checked_token(*parser, parser->idx++, TOKEN_DIRECTIVE);
     size_t amount_of_params = get_dir_param_count(dir_tok.value);
     vector(Token) params = NULL;
-    vector_set_destructor(params, free_token);
+    vector_set_arena(params, parser->arena);
     for (size_t i = 0; i < amount_of_params; i++) {
         Token tok = parser->tokens[parser->idx++];
-        vector_push_back(params, copy_token(tok));
+        vector_push_back(params, copy_token(parser->arena, tok));
     }
     Directive dir = new_directive(diropcode_from_str(dir_tok.value), params);
     directive_check_params(dir);
@@ -203,13 +179,10 @@ Label parse_label(Parser *parser) {
     Label label = empty_label();
     Token lbl_tok = parser_get_checked_token(*parser, parser->idx++, TOKEN_LABEL);
     const char *label_name = lbl_tok.value;
-    char *new_name = NULL;
     if (parser->last_proper_label_name && lbl_tok.value[0] == '.') {
-        new_name = mangle_name(parser->last_proper_label_name, lbl_tok.value);
-        label_name = new_name;
+        label_name = mangle_name(parser->arena, parser->last_proper_label_name, lbl_tok.value);
     }
-    label_set_name(&label, label_name);
-    if (new_name) free((void *)new_name);
+    label_set_name(parser->arena, &label, label_name);
     if (lbl_tok.value[0] != '.') parser->last_proper_label_name = lbl_tok.value;
 
     label.span = lbl_tok.span;
@@ -225,6 +198,9 @@ Label parse_label(Parser *parser) {
     if (tok.type == TOKEN_DECL) {
         label.is_data = true;
         parser_func = &parse_declaration;
+        label.declarations = parser->decls_scratch;
+    } else {
+        label.instructions = parser->instrs_scratch;
     }
 
     do {
@@ -232,6 +208,16 @@ Label parse_label(Parser *parser) {
         tok = parser->tokens[parser->idx];
     } while (tok.type != TOKEN_LABEL && tok.type != TOKEN_EOF);
 
+    // The arena gets the items once their count is known
+    if (label.is_data) {
+        parser->decls_scratch = label.declarations;
+        vector_copy_to_arena(label.declarations, parser->decls_scratch, parser->arena);
+        vector_clean(parser->decls_scratch);
+    } else {
+        parser->instrs_scratch = label.instructions;
+        vector_copy_to_arena(label.instructions, parser->instrs_scratch, parser->arena);
+        vector_clean(parser->instrs_scratch);
+    }
     return label;
 }
 
@@ -257,34 +243,28 @@ void parse_declaration(Parser *parser, Label *label) {
     }
     Span decl_pos = kind.span;
     decl_pos.len = value.span.column - kind.span.column + value.span.len;
-    Decl decl = new_decl(copy_token(kind), copy_token(value), decl_pos);
+    Decl decl = new_decl(copy_token(parser->arena, kind), copy_token(parser->arena, value),
+                         decl_pos);
     label_add_decl(label, decl);
     label->data_size += size;
 }
 
 void parse_instruction(Parser *parser, Label *label) {
     Token instr_token = parser_get_checked_token(*parser, parser->idx++, TOKEN_INSTR);
-    int amount_of_ops = 0;
-    if (in_one_op_instruction_set(instr_token.value)) {
-        amount_of_ops = 1;
-    }
-    if (in_two_ops_instruction_set(instr_token.value)) {
-        amount_of_ops = 2;
-    }
-    if (in_three_ops_instruction_set(instr_token.value)) {
-        amount_of_ops = 3;
-    }
-    vector(Token) ops = NULL;
+    InstrOpcode opcode = instropcode_from_str(instr_token.value);
+    int amount_of_ops = instr_operand_count(opcode);
+    Token *ops = arena_alloc(parser->arena, amount_of_ops * sizeof(Token));
     for (int i = 0; i < amount_of_ops; i++) {
         Token tok = parser->tokens[parser->idx++];
         if (tok.type == TOKEN_COMMA) {
             error_unexpected_comma(tok.span);
         }
         if (tok.value[0] == '.') {
-            char *new_name = mangle_name(parser->last_proper_label_name, tok.value);
-            tok.value = new_name;
+            tok.value = mangle_name(parser->arena, parser->last_proper_label_name, tok.value);
+        } else {
+            tok = copy_token(parser->arena, tok);
         }
-        vector_push_back(ops, copy_token(tok));
+        ops[i] = tok;
         // Because ops are separeted by commas
         if (i != amount_of_ops - 1) {
             Token comma = parser->tokens[parser->idx++];
@@ -295,10 +275,10 @@ void parse_instruction(Parser *parser, Label *label) {
     }
     Span instr_pos = instr_token.span;
     if (amount_of_ops != 0) {
-        instr_pos.len = ops[amount_of_ops].span.column - instr_token.span.column
-                        + ops[amount_of_ops].span.len;
+        instr_pos.len = ops[amount_of_ops - 1].span.column - instr_token.span.column
+                        + ops[amount_of_ops - 1].span.len;
     }
-    Instr instr = new_instr(instropcode_from_str(instr_token.value), ops, instr_pos);
+    Instr instr = new_instr(opcode, ops, amount_of_ops, instr_pos);
     instr_check_ops(instr);
     label_add_instr(label, instr);
 }
@@ -306,10 +286,13 @@ void parse_instruction(Parser *parser, Label *label) {
 void free_parser(void *parser) {
     Parser p = *(Parser *)parser;
     free_vector(&p.tokens);
+    free_vector(&p.instrs_scratch);
+    free_vector(&p.decls_scratch);
+    free_lexer(&p.lexer);
 }
 
-char *mangle_name(const char *lbl_name, const char *other_name) {
-    char *new_name = malloc(strlen(lbl_name) + strlen(other_name));
+char *mangle_name(Arena *arena, const char *lbl_name, const char *other_name) {
+    char *new_name = arena_alloc(arena, strlen(lbl_name) + strlen(other_name) + 1);
     sprintf(new_name, "%s%s", lbl_name, other_name);
     return new_name;
 }
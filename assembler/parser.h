@@ -4,6 +4,7 @@
 #include <stdbool.h>
 #include "common/arch.h"
 #include "common/vector.h"
+#include "common/arena.h"
 #include "lexer.h"
 
 typedef struct {
@@ -13,16 +14,16 @@ typedef struct {
 } Decl;
 
 Decl new_decl(Token decl_kind, Token decl_value, Span span);
-void free_decl(void *decl);
 
 typedef struct {
     InstrOpcode opcode;
-    vector(Token) ops;
+    Token *ops;
+    size_t amount_of_ops;
     Span span;
+    byte size; // Chosen by branch relaxation, 0 gives the name it uses the long form
 } Instr;
 
-Instr new_instr(InstrOpcode opcode, vector(Token) ops, Span pos);
-void free_instr(void *instr);
+Instr new_instr(InstrOpcode opcode, Token *ops, size_t amount_of_ops, Span pos);
 void instr_check_ops(Instr instr);
 void check_single_op(Token op, size_t expected_types_count, ...);
 
@@ -33,7 +34,6 @@ typedef struct {
 
 Directive new_directive(DirOpcode opcode, vector(Token) params);
 void directive_check_params(Directive directive);
-void free_directive(void *directive);
 
 typedef struct {
     const char *name;
@@ -47,21 +47,25 @@ typedef struct {
 } Label;
 
 Label empty_label(void);
-void label_set_name(Label *label, const char *name);
+void label_set_name(Arena *arena, Label *label, const char *name);
 void label_add_instr(Label *label, Instr instr);
 void label_add_decl(Label *label, Decl decl);
-void free_label(void *label);
 
 // ------------------------------------------------------------------------------------------------
 
 typedef struct {
     const char *filename; // needed for errors
+    Lexer lexer; // Owns the source the tokens point into
+    Arena *arena; // Holds everything the parser makes for the program, outlives the parser
+    // Items of the label being parsed, they are copied to the arena at the end of the label
+    vector(Instr) instrs_scratch;
+    vector(Decl) decls_scratch;
     vector(Token) tokens;
     const char *last_proper_label_name;
     size_t idx;
 } Parser;
 
-Parser new_parser(const char *filename);
+Parser new_parser(const char *filename, Arena *arena);
 
 Token parser_get_checked_token(Parser parser, size_t pos, TokenType tok_type);
 Token parser_get_checked_token_in_list(Parser parser, size_t pos, size_t types_count, ...);
@@ -73,6 +77,6 @@ void parse_instruction(Parser *parser, Label *label);
 
 void free_parser(void *parser);
 
-char *mangle_name(const char *lbl_name, const char *other_name);
+char *mangle_name(Arena *arena, const char *lbl_name, const char *other_name);
 
 #endif
@@ -0,0 +1,163 @@
+#include "peephole.h"
+#include "common/utils.h"
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct {
+    size_t length; // Of the matched sequence
+    bool (*matches)(const Instr *instrs);
+    // Rewrites the matched sequence in place and returns its new length
+    size_t (*rewrite)(Instr *instrs);
+} PeepholeRule;
+
+// Numbers are decimal, as in program_compile_code
+static bool number_value(Token op, word *value) {
+    if (op.type != TOKEN_NUMBER) {
+        return false;
+    }
+    *value = (word)strtol(op.value, NULL, 10);
+    return true;
+}
+
+static bool is_same_register(Token a, Token b) {
+    return a.type == TOKEN_REG && b.type == TOKEN_REG && strcmp(a.value, b.value) == 0;
+}
+
+// Returns the power of two the number is, or 0
+static size_t log2_of(word value) {
+    if (value < 2 || (value & (value - 1)) != 0) {
+        return 0;
+    }
+    size_t power = 0;
+    while (value >>= 1) {
+        power++;
+    }
+    return power;
+}
+
+static const char *SHIFTS[] = {
+    "0", "1", "2", "3", "4", "5", "6", "7", "8", "9", "10", "11", "12", "13", "14", "15",
+};
+
+// ------------------------------------------------------------------------------------------------
+
+// mov rX, rX
+static bool is_self_move(const Instr *instrs) {
+    return instrs[0].opcode == INSTR_MOV && is_same_register(instrs[0].ops[0], instrs[0].ops[1]);
+}
+
+// add rX, 0 and everything else that leaves the register as it is
+static bool is_identity(const Instr *instrs) {
+    word value;
+    if (instrs[0].amount_of_ops != 2 || !number_value(instrs[0].ops[1], &value)) {
+        return false;
+    }
+    switch (instrs[0].opcode) {
+        case INSTR_ADD: case INSTR_SUB: case INSTR_OR: case INSTR_XOR:
+        case INSTR_SHL: case INSTR_SHR:
+            return value == 0;
+        case INSTR_MUL: case INSTR_DIV:
+            return value == 1;
+        case INSTR_AND:
+            return value == 0xFFFF;
+        default:
+            return false;
+    }
+}
+
+// mul rX, 2^n and div rX, 2^n: returns n, or 0 if the instruction is not one of them. The VM
+// divides by a signed short, so div by 0x8000 is left as it is
+static size_t scaling_shift(const Instr *instr) {
+    word value;
+    if ((instr->opcode != INSTR_MUL && instr->opcode != INSTR_DIV) ||
+        !number_value(instr->ops[1], &value)) {
+        return 0;
+    }
+    size_t shift = log2_of(value);
+    return instr->opcode == INSTR_DIV && shift > 14 ? 0 : shift;
+}
+
+static bool is_scaling_by_power_of_two(const Instr *instrs) {
+    return scaling_shift(&instrs[0]) != 0;
+}
+
+static size_t scaling_to_shift(Instr *instrs) {
+    instrs[0].ops[1].value = SHIFTS[scaling_shift(&instrs[0])];
+    instrs[0].opcode = instrs[0].opcode == INSTR_MUL ? INSTR_SHL : INSTR_SHR;
+    return 1;
+}
+
+// call f, ret: f returns where the ret would
+static bool is_tail_call(const Instr *instrs) {
+    return instrs[0].opcode == INSTR_CALL && instrs[1].opcode == INSTR_RET;
+}
+
+static size_t tail_call_to_jump(Instr *instrs) {
+    instrs[0].opcode = INSTR_JMP;
+    return 1;
+}
+
+// push rX, pop rX
+static bool is_push_pop(const Instr *instrs) {
+    return instrs[0].opcode == INSTR_PUSH && instrs[1].opcode == INSTR_POP &&
+           is_same_register(instrs[0].ops[0], instrs[1].ops[0]);
+}
+
+static size_t drop(Instr *instrs) {
+    UNUSED(instrs);
+    return 0;
+}
+
+static const PeepholeRule PEEPHOLE_RULES[] = {
+    { 1, is_self_move,               drop },
+    { 1, is_identity,                drop },
+    { 1, is_scaling_by_power_of_two, scaling_to_shift },
+    { 2, is_tail_call,               tail_call_to_jump },
+    { 2, is_push_pop,                drop },
+};
+
+// ------------------------------------------------------------------------------------------------
+
+static bool touches_ip(Label *lbl) {
+    foreach(Instr, instr, lbl->instructions) {
+        for (size_t i = 0; i < instr->amount_of_ops; i++) {
+            if (instr->ops[i].type == TOKEN_REG && strcmp(instr->ops[i].value, "ip") == 0) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+// Tries the rules on the end of the instructions, returns their new count
+static size_t apply_rules(Instr *instrs, size_t count) {
+    for (size_t i = 0; i < ARRAY_LEN(PEEPHOLE_RULES); i++) {
+        const PeepholeRule *rule = &PEEPHOLE_RULES[i];
+        if (rule->length > count) {
+            continue;
+        }
+        Instr *matched = instrs + count - rule->length;
+        if (rule->matches(matched)) {
+            return count - rule->length + rule->rewrite(matched);
+        }
+    }
+    return count;
+}
+
+void peephole_label(Label *lbl) {
+    if (lbl->is_data || vector_empty(lbl->instructions) || touches_ip(lbl)) {
+        return;
+    }
+    // Every instruction is moved to the end of the rewritten ones, then the rules are applied
+    // there until they change nothing, so that a rewrite exposes the next match
+    size_t count = 0;
+    for (size_t i = 0; i < vector_size(lbl->instructions); i++) {
+        lbl->instructions[count++] = lbl->instructions[i];
+        size_t previous;
+        do {
+            previous = count;
+            count = apply_rules(lbl->instructions, count);
+        } while (count != previous);
+    }
+    __vector_set_size(lbl->instructions, count);
+}
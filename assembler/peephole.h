@@ -0,0 +1,11 @@
+#ifndef __ASM_PEEPHOLE_H
+#define __ASM_PEEPHOLE_H
+
+#include "parser.h"
+
+// Rewrites the instructions of a code label with the rules of PEEPHOLE_RULES until none of them
+// applies. Labels are left in place, so everything that uses a label still gets the same code.
+// Labels that touch ip are left as they are, they may count on the size of their code
+void peephole_label(Label *lbl);
+
+#endif
@@ -0,0 +1,37 @@
+#include "phases.h"
+#include <stdio.h>
+#include <time.h>
+
+static double phase_times[PHASE_COUNT];
+
+static const char *phase_names[PHASE_COUNT] = {
+    [PHASE_NEW_PARSER]      = "new_parser",
+    [PHASE_PARSE_TOP_LEVEL] = "parse_top_level",
+    [PHASE_PROGRAM_COMPILE] = "program_compile",
+    [PHASE_RESOLVE_NAMES]   = "program_resolve_names",
+    [PHASE_EXECFILE_WRITE]  = "execfile_write",
+};
+
+double phase_begin(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+void phase_end(Phase phase, double begin) {
+    phase_times[phase] += phase_begin() - begin;
+}
+
+void phase_add(Phase phase, double time) {
+    phase_times[phase] += time;
+}
+
+void print_phase_times(void) {
+    for (Phase phase = 0; phase < PHASE_COUNT; phase++) {
+        double time = phase_times[phase];
+        if (phase == PHASE_PROGRAM_COMPILE) {
+            time -= phase_times[PHASE_RESOLVE_NAMES];
+        }
+        fprintf(stderr, "%s %.6f\n", phase_names[phase], time);
+    }
+}
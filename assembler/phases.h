@@ -0,0 +1,24 @@
+#ifndef __ASM_PHASES_H
+#define __ASM_PHASES_H
+
+// Phases of sasm that `-T` reports the time of
+typedef enum {
+    PHASE_NEW_PARSER,
+    PHASE_PARSE_TOP_LEVEL,
+    PHASE_PROGRAM_COMPILE, // Includes PHASE_RESOLVE_NAMES, which is subtracted when printed
+    PHASE_RESOLVE_NAMES,
+    PHASE_EXECFILE_WRITE,
+    PHASE_COUNT,
+} Phase;
+
+// Returns the timestamp to pass to phase_end
+double phase_begin(void);
+// Adds the time since begin to the phase. Phases run for every input file add up
+void phase_end(Phase phase, double begin);
+// Adds time measured elsewhere, the phases of files parsed on several threads add up past the wall
+// time
+void phase_add(Phase phase, double time);
+// Prints "<phase> <seconds>" for every phase to stderr
+void print_phase_times(void);
+
+#endif
@@ -3,6 +3,8 @@
 #include "common/vector.h"
 #include "common/utils.h"
 #include "io.h"
+#include "phases.h"
+#include "peephole.h"
 #include <assert.h>
 #include <stdint.h>
 #include <limits.h>
@@ -10,80 +12,94 @@
 #include <stdio.h>
 #include <string.h>
 
+extern bool OPTIMIZE;
+
 // ------------------------------------------------------------------------------------------------
 
-Symbol new_symbol(const char *name, bool is_resolved) {
+Symbol new_symbol(Arena *arena, const char *name, bool is_resolved) {
     vector(SymbolUsage) usgaes = NULL;
+    vector_set_arena(usgaes, arena);
 
     return (Symbol) {
-        .name = strdup(name),
+        .name = arena_strdup(arena, name),
         .address = 0,
         .unresolved_usages = usgaes,
         .is_resolved = is_resolved,
     };
 }
 
-void symbol_add_usage(Symbol *symbol, word usage, Span pos) {
-    SymbolUsage su = { usage, pos };
+void symbol_add_usage(Symbol *symbol, word usage, RelocKind kind, Span pos) {
+    SymbolUsage su = { usage, kind, pos };
     vector_push_back(symbol->unresolved_usages, su);
 }
 
-void free_symbol(void *entry) {
-    Symbol *s = (Symbol *)entry;
-    if (s->name) {
-        free(((Symbol *)entry)->name);
-    }
-    free_vector(&s->unresolved_usages);
-}
-
 // ------------------------------------------------------------------------------------------------
 
 Program new_program(void) {
     vector(Symbol) sym_table = NULL;
-    vector_set_destructor(sym_table, free_symbol);
     vector(Label) labels = NULL;
-    vector_set_destructor(labels, free_label);
     vector(Directive) dirs = NULL;
-    vector_set_destructor(dirs, free_directive);
 
     return (Program) {
+        .arena = new_arena(),
         .sym_table = sym_table,
         .labels = labels,
         .diresctives = dirs,
+        .symbol_index = new_hashmap(),
+        .label_index = new_hashmap(),
     };
 }
 
+static void program_push_symbol(Program *prog, Symbol symbol) {
+    vector_push_back(prog->sym_table, symbol);
+    hashmap_set(&prog->symbol_index, symbol.name, vector_size(prog->sym_table) - 1);
+}
+
 void program_add_label(Program *prog, Label lbl) {
     vector_push_back(prog->labels, lbl);
+    hashmap_set(&prog->label_index, lbl.name, vector_size(prog->labels) - 1);
     Symbol *symb = program_get_symbol(*prog, lbl.name);
     if (!symb) {
-        vector_push_back(prog->sym_table, new_symbol(lbl.name, false));
+        program_push_symbol(prog, new_symbol(prog->arena, lbl.name, false));
     } else {
         error_redefinition(lbl.name, lbl.span);
     }
 }
 
+void program_add_fragment(Program *prog, Fragment *fragment) {
+    foreach(Directive, dir, fragment->directives) {
+        program_add_directive(prog, *dir);
+    }
+    foreach(Label, lbl, fragment->labels) {
+        program_add_label(prog, *lbl);
+    }
+    arena_adopt(prog->arena, fragment->arena);
+    fragment->arena = NULL;
+}
+
 void program_add_directive(Program *prog, Directive dir) {
     vector_push_back(prog->diresctives, dir);
 }
 
-void program_add_usage(Program *prog, const char *name, Span name_pos, word usage_address) {
+void program_add_usage(Program *prog, const char *name, Span name_pos, word usage_address,
+                       RelocKind kind)
+{
     Symbol *definition = program_get_symbol(*prog, name);
     if (!definition) {
-        Symbol new = new_symbol(name, false);
-        symbol_add_usage(&new, usage_address, name_pos);
-        vector_push_back(prog->sym_table, new);
+        Symbol new = new_symbol(prog->arena, name, false);
+        symbol_add_usage(&new, usage_address, kind, name_pos);
+        program_push_symbol(prog, new);
     } else {
-        symbol_add_usage(definition, usage_address, name_pos);
+        symbol_add_usage(definition, usage_address, kind, name_pos);
     }
 }
 
 void program_add_definition(Program *prog, const char *name, word def_address) {
     Symbol *definition = program_get_symbol(*prog, name);
     if (!definition) {
-        Symbol new = new_symbol(name, true);
+        Symbol new = new_symbol(prog->arena, name, true);
         new.address = def_address;
-        vector_push_back(prog->sym_table, new);
+        program_push_symbol(prog, new);
     } else {
         definition->is_resolved = true;
         definition->address = def_address;
@@ -95,39 +111,186 @@ static void subst_address(vector(byte) buffer, word where, word what) {
     buffer[where + 1] = what & 0xFF;
 }
 
-ExecFile program_compile(Program *prog) {
-    ExecFile ef = new_execfile();
-    // Compile directives
+static void compile_directives(Program *prog, ExecFile *ef) {
     vector(byte) compiled_dirs = NULL;
     foreach(Directive, dir, prog->diresctives) {
         program_compile_directive(&compiled_dirs, *dir);
     }
     if (!vector_empty(compiled_dirs)) {
-        execfile_add_section(&ef, "directives", compiled_dirs);
+        execfile_add_section(ef, "directives", compiled_dirs);
         free_vector(&compiled_dirs);
     }
+}
 
-    // Compile program
-    vector(byte) compiled_program = NULL;
+// ------------------------------------------------------------------------------------------------
+// Branch relaxation
+
+// The operand that holds the name of the instruction, or NULL. Names of in/out keep the long form
+static Token *relaxed_operand(Instr *instr) {
+    switch (instr_shape(instr->opcode)) {
+        case SHAPE_REG_ANY:  return instr->ops[1].type == TOKEN_IDENT ? &instr->ops[1] : NULL;
+        case SHAPE_ADDR:     return &instr->ops[0];
+        case SHAPE_CMP_ADDR: return &instr->ops[1];
+        default:             return NULL;
+    }
+}
+
+static word number_token_value(Token number) {
+    return (word)strtol(number.value, NULL, 10);
+}
+
+// Size of the <reg>, <imm> form that holds the value
+static byte reg_imm_size(word value) {
+    if (fits_signed(value, IMM_SHORT_BITS)) return 2;
+    if (fits_signed(value, IMM_MEDIUM_BITS)) return 3;
+    return 4;
+}
+
+// Size of the instruction at address when the name it uses is at target, NULL for a name that is
+// not known. Numbers always take their shortest form
+static byte instr_size(Instr instr, word address, const word *target) {
+    switch (instr_shape(instr.opcode)) {
+        case SHAPE_REG: case SHAPE_PORT:
+            return 2;
+        case SHAPE_NONE:
+            return 1;
+        case SHAPE_ADDR:
+            return target && fits_signed(*target - address, JUMP_OFFSET_BITS) ? 2 : 3;
+        case SHAPE_CMP_ADDR:
+            return target && fits_signed(*target - address, JIF_OFFSET_BITS) ? 2 : 3;
+        case SHAPE_PORT_IO: {
+            size_t bits = OPCODE_BIT_SIZE + 8 + 2;
+            for (size_t i = 1; i <= 2; i++) {
+                Token op = instr.ops[i];
+                if (op.type == TOKEN_REG) {
+                    bits += REGISTER_BIT_SIZE;
+                } else if (op.type == TOKEN_NUMBER &&
+                           fits_signed(number_token_value(op), IO_IMM_SHORT_BITS)) {
+                    bits += 1 + IO_IMM_SHORT_BITS;
+                } else {
+                    bits += 1 + NUMBER_BIT_SIZE;
+                }
+            }
+            return (bits + 7) / 8;
+        }
+        default:
+            break;
+    }
+    // SHAPE_REG_ANY
+    switch (instr.ops[1].type) {
+        case TOKEN_REG:    return 2;
+        case TOKEN_NUMBER: return reg_imm_size(number_token_value(instr.ops[1]));
+        default:           return target ? reg_imm_size(*target) : 4;
+    }
+}
+
+// Picks the size of every code instruction. The ones with names start in their shortest form and
+// only grow until every name fits, so that the loop ends. Fills the address of every label and
+// returns the label that every code instruction uses, SIZE_MAX for none or a name that is no label
+static vector(size_t) relax_code(Program *prog, word data_size, word *addresses) {
+    size_t label_count = vector_size(prog->labels);
+    vector(Instr *) instrs = NULL;
+    vector(size_t) targets = NULL;
+    for (size_t i = 0; i < label_count; i++) {
+        Label *lbl = &prog->labels[i];
+        if (lbl->is_data) {
+            addresses[i] = program_get_symbol(*prog, lbl->name)->address;
+            continue;
+        }
+        foreach(Instr, instr, lbl->instructions) {
+            Token *name = relaxed_operand(instr);
+            size_t *index = name ? hashmap_get(prog->label_index, name->value) : NULL;
+            word lowest = 0;
+            instr->size = instr_size(*instr, 0, index ? &lowest : NULL);
+            vector_push_back(instrs, instr);
+            vector_push_back(targets, index ? *index : SIZE_MAX);
+        }
+    }
+
+    bool has_grown = true;
+    while (has_grown) {
+        has_grown = false;
+        word address = data_size;
+        for (size_t i = 0, j = 0; i < label_count; i++) {
+            Label *lbl = &prog->labels[i];
+            if (lbl->is_data) continue;
+            addresses[i] = address;
+            for (size_t k = 0; k < vector_size(lbl->instructions); k++) {
+                address += instrs[j++]->size;
+            }
+        }
+        address = data_size;
+        for (size_t i = 0; i < vector_size(instrs); i++) {
+            Instr *instr = instrs[i];
+            if (targets[i] == SIZE_MAX) {
+                address += instr->size;
+                continue;
+            }
+            byte size = instr_size(*instr, address, &addresses[targets[i]]);
+            if (size > instr->size) {
+                instr->size = size;
+                has_grown = true;
+            }
+            address += instr->size;
+        }
+    }
+    free_vector(&instrs);
+    return targets;
+}
+
+// ------------------------------------------------------------------------------------------------
+
+// The data labels, then the code labels. Returns the size of the data. A whole program knows
+// where all of its labels are, so its branches and names get their short forms
+static word compile_labels(Program *prog, vector(byte) *compiled_program, bool is_whole_program) {
     foreach(Label, lbl, prog->labels) {
         if (!lbl->is_data) continue;
-        program_add_definition(prog, lbl->name, vector_size(compiled_program));
+        program_add_definition(prog, lbl->name, vector_size(*compiled_program));
         foreach(Decl, decl, lbl->declarations) {
-            program_compile_data(prog, &compiled_program, *decl);
+            program_compile_data(prog, compiled_program, *decl);
         }
     }
+    word data_size = vector_size(*compiled_program);
+    if (OPTIMIZE) {
+        foreach(Label, lbl, prog->labels) {
+            peephole_label(lbl);
+        }
+    }
+    word *addresses = NULL;
+    vector(size_t) targets = NULL;
+    if (is_whole_program) {
+        addresses = calloc(vector_size(prog->labels), sizeof(word));
+        targets = relax_code(prog, data_size, addresses);
+    }
+    size_t index = 0;
     foreach(Label, lbl, prog->labels) {
         if (lbl->is_data) continue;
-        program_add_definition(prog, lbl->name, vector_size(compiled_program));
+        program_add_definition(prog, lbl->name, vector_size(*compiled_program));
         foreach(Instr, instr, lbl->instructions) {
-            program_compile_code(prog, &compiled_program, *instr);
+            size_t target = targets ? targets[index++] : SIZE_MAX;
+            program_compile_code(prog, compiled_program, *instr,
+                                 target == SIZE_MAX ? NULL : &addresses[target]);
         }
     }
+    free(addresses);
+    free_vector(&targets);
+    return data_size;
+}
+
+ExecFile program_compile(Program *prog) {
+    ExecFile ef = new_execfile();
+    compile_directives(prog, &ef);
+
+    vector(byte) compiled_program = NULL;
+    compile_labels(prog, &compiled_program, true);
     Symbol *entry_point = program_get_symbol(*prog, ENTRY_POINT_NAME);
     if (!entry_point || !entry_point->is_resolved) {
         error_no_entry();
     }
+    double begin = phase_begin();
     program_resolve_names(prog, &compiled_program);
+    phase_end(PHASE_RESOLVE_NAMES, begin);
+    ef.version = prog->uses_short_forms ? SEX_VERSION_SHORT_FORMS : SEX_VERSION;
     if (!vector_empty(compiled_program)) {
         execfile_add_section(&ef, "program", compiled_program);
         free_vector(&compiled_program);
@@ -144,13 +307,78 @@ ExecFile program_compile(Program *prog) {
     return ef;
 }
 
+// Data labels with words are aligned to words when the linker moves them
+static byte label_alignment(Label *lbl) {
+    foreach(Decl, decl, lbl->declarations) {
+        if (strcmp(decl->kind.value, ".word") == 0 || strcmp(decl->kind.value, ".sizeof") == 0) {
+            return 2;
+        }
+    }
+    return 1;
+}
+
+ExecFile program_compile_object(Program *prog) {
+    ExecFile ef = new_execfile();
+    compile_directives(prog, &ef);
+
+    vector(byte) compiled_program = NULL;
+    word data_size = compile_labels(prog, &compiled_program, false);
+    ef.version = prog->uses_short_forms ? SEX_VERSION_SHORT_FORMS : SEX_VERSION;
+    if (!vector_empty(compiled_program)) {
+        execfile_add_section(&ef, "program", compiled_program);
+        free_vector(&compiled_program);
+    }
+
+    // Every label got its symbol when it was added, so the labels are the first symbols and the
+    // names they use but do not define follow them
+    size_t label_count = vector_size(prog->labels);
+    vector(byte) symbols = NULL;
+    vector(byte) labels = NULL;
+    vector(byte) undefined = NULL;
+    vector(byte) relocs = NULL;
+    vector_push_word_back(labels, data_size);
+    for (size_t i = 0; i < vector_size(prog->sym_table); i++) {
+        Symbol *symb = &prog->sym_table[i];
+        size_t name_size = strlen(symb->name) + 1;
+        if (i < label_count) {
+            Label *lbl = &prog->labels[i];
+            for (size_t j = 0; j < name_size; j++) {
+                vector_push_back(symbols, symb->name[j]);
+            }
+            vector_push_word_back(symbols, symb->address);
+            vector_push_back(labels, lbl->is_data ? label_alignment(lbl) : 0);
+            vector_push_word_back(labels, lbl->is_data ? lbl->data_size : 0);
+        } else {
+            for (size_t j = 0; j < name_size; j++) {
+                vector_push_back(undefined, symb->name[j]);
+            }
+        }
+        foreach(SymbolUsage, usage, symb->unresolved_usages) {
+            object_push_reloc(&relocs, (Reloc) { usage->address, usage->kind, i });
+        }
+    }
+    // Freed through the array, so that the pushes above never write through an address-taken vector
+    const char *names[] = { "labels", "symbols", "undefined", "relocs" };
+    vector(byte) sections[] = { labels, symbols, undefined, relocs };
+    for (size_t i = 0; i < sizeof(sections) / sizeof(sections[0]); i++) {
+        if (!vector_empty(sections[i])) {
+            execfile_add_section(&ef, names[i], sections[i]);
+        }
+        free_vector(&sections[i]);
+    }
+    return ef;
+}
+
 void program_compile_symbol_table(Program prog, vector(byte) *buffer) {
+    // Pushed through a copy, since bytes stored through *buffer could change the pointer itself
+    vector(byte) table = *buffer;
     foreach(Symbol, symb, prog.sym_table) {
         for (size_t i = 0; i < strlen(symb->name) + 1; i++) {
-            vector_push_back(*buffer, symb->name[i]);
+            vector_push_back(table, symb->name[i]);
         }
-        vector_push_word_back(*buffer, symb->address);
+        vector_push_word_back(table, symb->address);
     }
+    *buffer = table;
 }
 
 void program_compile_directive(vector(byte) *buffer, Directive dir) {
@@ -169,34 +397,35 @@ void program_compile_directive(vector(byte) *buffer, Directive dir) {
 void program_compile_data(Program *prog, vector(byte) *buffer, Decl decl) {
     char *UNUSED;
     long value = strtol(decl.value.value, &UNUSED, 10);
+    vector(byte) data = *buffer;
     if (strcmp(decl.kind.value, ".align") == 0) {
         for (long i = 0; i < value; i++) {
-            vector_push_back(*buffer, 0);
+            vector_push_back(data, 0);
         }
     }
     if (strcmp(decl.kind.value, ".byte") == 0) {
-        vector_push_back(*buffer, (byte)value);
+        vector_push_back(data, (byte)value);
     }
     if (strcmp(decl.kind.value, ".word") == 0) {
-        vector_push_word_back(*buffer, value);
+        vector_push_word_back(data, value);
     }
     if (strcmp(decl.kind.value, ".ascii") == 0) {
         for (size_t i = 0; i < strlen(decl.value.value); i++) {
-            vector_push_back(*buffer, decl.value.value[i]);
+            vector_push_back(data, decl.value.value[i]);
         }
     }
     if (strcmp(decl.kind.value, ".sizeof") == 0) {
         Symbol *sym = program_get_symbol(*prog, decl.value.value);
+        size_t *index = hashmap_get(prog->label_index, decl.value.value);
         if (sym == NULL) {
-            program_add_usage(prog, decl.value.value, decl.value.span, vector_size(*buffer));
-            return;
-        }
-        foreach(Label, lbl, prog->labels) {
-            if (lbl->is_data && strcmp(lbl->name, decl.value.value) == 0) {
-                vector_push_word_back(*buffer, lbl->data_size);
-            }
+            program_add_usage(prog, decl.value.value, decl.value.span, vector_size(data),
+                              RELOC_SIZEOF);
+            vector_push_word_back(data, 0);
+        } else if (index && prog->labels[*index].is_data) {
+            vector_push_word_back(data, prog->labels[*index].data_size);
         }
     }
+    *buffer = data;
 }
 
 static void append_byte(unsigned long *buffer, size_t *buffer_size, Token number) {
@@ -217,6 +446,13 @@ static void append_number(unsigned long *buffer, size_t *buffer_size, Token numb
     *buffer_size += 16;
 }
 
+// The low bits of the value, read back as a signed number
+static void append_signed(unsigned long *buffer, size_t *buffer_size, word value, size_t bits) {
+    *buffer <<= bits;
+    *buffer |= value & ((1 << bits) - 1);
+    *buffer_size += bits;
+}
+
 static void append_bit(unsigned long *buffer, size_t *buffer_size, int bit) {
     *buffer <<= 1;
     *buffer |= bit;
@@ -229,10 +465,16 @@ static void append_register(unsigned long *buffer, size_t *buffer_size, Token re
     *buffer_size += REGISTER_BIT_SIZE;
 }
 
+// The address of a name when it is known, otherwise a usage that is resolved later
 static void append_ident(unsigned long *buffer, size_t *buffer_size, Program *prog,
-                         vector(byte) prog_buffer, Token ident)
+                         vector(byte) prog_buffer, Token ident, const word *target)
 {
-    program_add_usage(prog, ident.value, ident.span, vector_size(prog_buffer) + *buffer_size / 8);
+    if (target) {
+        append_signed(buffer, buffer_size, *target, NUMBER_BIT_SIZE);
+        return;
+    }
+    program_add_usage(prog, ident.value, ident.span, vector_size(prog_buffer) + *buffer_size / 8,
+                      RELOC_ADDRESS);
     *buffer <<= 16;
     *buffer_size += 16;
 }
@@ -249,80 +491,117 @@ static void append_cmp(unsigned long *buffer, size_t *buffer_size, Token cmp) {
     *buffer_size += 3;
 }
 
-void program_compile_code(Program *prog, vector(byte) *buffer, Instr instr) {
+// The immediate of <reg>, <imm>. Numbers take their shortest form, names the one relaxation chose
+static void append_reg_imm(unsigned long *buffer, size_t *buffer_size, Program *prog,
+                           vector(byte) prog_buffer, Instr instr, const word *target)
+{
+    Token op = instr.ops[1];
+    bool is_number = op.type == TOKEN_NUMBER;
+    word value = is_number ? number_token_value(op) : 0;
+    byte size = is_number ? reg_imm_size(value) : instr.size;
+    prog->uses_short_forms |= size == 2 || size == 3;
+    if (size == 2) {
+        append_bit(buffer, buffer_size, 1);
+        append_signed(buffer, buffer_size, is_number ? value : *target,
+                      IMM_SHORT_BITS);
+    } else if (size == 3) {
+        append_signed(buffer, buffer_size, 0b01, 2);
+        append_signed(buffer, buffer_size, is_number ? value : *target,
+                      IMM_MEDIUM_BITS);
+    } else if (is_number) {
+        append_alignment(buffer, buffer_size, 6);
+        append_number(buffer, buffer_size, op);
+    } else {
+        append_alignment(buffer, buffer_size, 6);
+        append_ident(buffer, buffer_size, prog, prog_buffer, op, target);
+    }
+}
+
+void program_compile_code(Program *prog, vector(byte) *buffer, Instr instr, const word *target) {
     size_t instr_bit_size = 0;
-    uint64_t instr_bin_repr = (uint64_t)instr.opcode;
+    // A jif that relaxation made short has its own opcode
+    bool is_near_jif = instr.opcode == INSTR_JIF && instr.size == 2;
+    uint64_t instr_bin_repr = is_near_jif ? OPCODE_JIF_NEAR : (uint64_t)instr.opcode;
     instr_bit_size += OPCODE_BIT_SIZE;
-
-    if (instropcode_in_args(instr.opcode, 4, INSTR_MOV, INSTR_LD, INSTR_ST, INSTR_CMP)) {
-        append_register(&instr_bin_repr, &instr_bit_size, instr.ops[0]);
-        if (instr.ops[1].type == TOKEN_REG) {
-            append_bit(&instr_bin_repr, &instr_bit_size, 0);
-            append_register(&instr_bin_repr, &instr_bit_size, instr.ops[1]);
-        } else {
-            append_bit(&instr_bin_repr, &instr_bit_size, 1);
-            append_alignment(&instr_bin_repr, &instr_bit_size, 6);
-            if (instr.ops[1].type == TOKEN_NUMBER) {
-                append_number(&instr_bin_repr, &instr_bit_size, instr.ops[1]);
+    word address = vector_size(*buffer);
+
+    switch (instr_shape(instr.opcode)) {
+        case SHAPE_REG_ANY:
+            append_register(&instr_bin_repr, &instr_bit_size, instr.ops[0]);
+            if (instr.ops[1].type == TOKEN_REG) {
+                append_bit(&instr_bin_repr, &instr_bit_size, 0);
+                append_register(&instr_bin_repr, &instr_bit_size, instr.ops[1]);
             } else {
-                append_ident(&instr_bin_repr, &instr_bit_size, prog, *buffer, instr.ops[1]);
+                append_bit(&instr_bin_repr, &instr_bit_size, 1);
+                append_reg_imm(&instr_bin_repr, &instr_bit_size, prog, *buffer, instr, target);
             }
-        }
-    }
-    if (instropcode_in_args(instr.opcode, 9, INSTR_ADD, INSTR_SUB, INSTR_MUL, INSTR_DIV, INSTR_AND,
-                                             INSTR_OR, INSTR_OR, INSTR_SHL, INSTR_SHR))
-    {
-        append_register(&instr_bin_repr, &instr_bit_size, instr.ops[0]);
-        if (instr.ops[1].type == TOKEN_REG) {
-            append_bit(&instr_bin_repr, &instr_bit_size, 0);
-            append_register(&instr_bin_repr, &instr_bit_size, instr.ops[1]);
-        } else {
-            append_bit(&instr_bin_repr, &instr_bit_size, 1);
-            append_alignment(&instr_bin_repr, &instr_bit_size, 6);
-            if (instr.ops[1].type == TOKEN_NUMBER) {
-                append_number(&instr_bin_repr, &instr_bit_size, instr.ops[1]);
+            break;
+        case SHAPE_REG:
+            append_register(&instr_bin_repr, &instr_bit_size, instr.ops[0]);
+            break;
+        case SHAPE_ADDR:
+            if (instr.size == 2) {
+                prog->uses_short_forms = true;
+                append_bit(&instr_bin_repr, &instr_bit_size, 1);
+                append_signed(&instr_bin_repr, &instr_bit_size,
+                              *target - address, JUMP_OFFSET_BITS);
             } else {
-                append_ident(&instr_bin_repr, &instr_bit_size, prog, *buffer, instr.ops[1]);
+                append_alignment(&instr_bin_repr, &instr_bit_size, 3);
+                append_ident(&instr_bin_repr, &instr_bit_size, prog, *buffer, instr.ops[0],
+                             target);
             }
-        }
-    }
-    if (instropcode_in_args(instr.opcode, 3, INSTR_NOT, INSTR_PUSH, INSTR_POP)) {
-        append_register(&instr_bin_repr, &instr_bit_size, instr.ops[0]);
-    }
-    if (instropcode_in_args(instr.opcode, 2, INSTR_CALL, INSTR_JMP)) {
-        append_alignment(&instr_bin_repr, &instr_bit_size, 3);
-        append_ident(&instr_bin_repr, &instr_bit_size, prog, *buffer, instr.ops[0]);
-    }
-    if (instr.opcode == INSTR_JIF) {
-        append_cmp(&instr_bin_repr, &instr_bit_size, instr.ops[0]);
-        append_ident(&instr_bin_repr, &instr_bit_size, prog, *buffer, instr.ops[1]);
-    }
-    if (instropcode_in_args(instr.opcode, 2, INSTR_OUT, INSTR_IN)) {
-        append_byte(&instr_bin_repr, &instr_bit_size, instr.ops[0]);
-
-        if (instr.ops[1].type == TOKEN_REG) append_bit(&instr_bin_repr, &instr_bit_size, 0);
-        else append_bit(&instr_bin_repr, &instr_bit_size, 1);
-        if (instr.ops[2].type == TOKEN_REG) append_bit(&instr_bin_repr, &instr_bit_size, 0);
-        else append_bit(&instr_bin_repr, &instr_bit_size, 1);
-
-        for (size_t i = 1; i <= 2; i++) {
-            Token op = instr.ops[i];
-            if (op.type == TOKEN_IDENT) {
-                append_alignment(&instr_bin_repr, &instr_bit_size, 1);
-                append_ident(&instr_bin_repr, &instr_bit_size, prog, *buffer, op);
-            } else if (op.type == TOKEN_NUMBER) {
-                append_alignment(&instr_bin_repr, &instr_bit_size, 1);
-                append_number(&instr_bin_repr, &instr_bit_size, op);
+            break;
+        case SHAPE_CMP_ADDR:
+            append_cmp(&instr_bin_repr, &instr_bit_size, instr.ops[0]);
+            if (is_near_jif) {
+                prog->uses_short_forms = true;
+                append_signed(&instr_bin_repr, &instr_bit_size,
+                              *target - address, JIF_OFFSET_BITS);
             } else {
-                append_register(&instr_bin_repr, &instr_bit_size, op);
+                append_ident(&instr_bin_repr, &instr_bit_size, prog, *buffer, instr.ops[1],
+                             target);
             }
-        }
+            break;
+        case SHAPE_PORT_IO:
+            append_byte(&instr_bin_repr, &instr_bit_size, instr.ops[0]);
+
+            if (instr.ops[1].type == TOKEN_REG) append_bit(&instr_bin_repr, &instr_bit_size, 0);
+            else append_bit(&instr_bin_repr, &instr_bit_size, 1);
+            if (instr.ops[2].type == TOKEN_REG) append_bit(&instr_bin_repr, &instr_bit_size, 0);
+            else append_bit(&instr_bin_repr, &instr_bit_size, 1);
+
+            for (size_t i = 1; i <= 2; i++) {
+                Token op = instr.ops[i];
+                if (op.type == TOKEN_IDENT) {
+                    append_alignment(&instr_bin_repr, &instr_bit_size, 1);
+                    append_ident(&instr_bin_repr, &instr_bit_size, prog, *buffer, op, NULL);
+                } else if (op.type == TOKEN_NUMBER &&
+                           fits_signed(number_token_value(op), IO_IMM_SHORT_BITS)) {
+                    prog->uses_short_forms = true;
+                    append_bit(&instr_bin_repr, &instr_bit_size, 1);
+                    append_signed(&instr_bin_repr, &instr_bit_size, number_token_value(op),
+                                  IO_IMM_SHORT_BITS);
+                } else if (op.type == TOKEN_NUMBER) {
+                    append_alignment(&instr_bin_repr, &instr_bit_size, 1);
+                    append_number(&instr_bin_repr, &instr_bit_size, op);
+                } else {
+                    append_register(&instr_bin_repr, &instr_bit_size, op);
+                }
+            }
+            break;
+        case SHAPE_PORT:
+            append_byte(&instr_bin_repr, &instr_bit_size, instr.ops[0]);
+            break;
+        default:
+            break;
     }
 
     size_t instr_byte_size = instr_bit_size / 8;
     if (instr_bit_size / 8.0 > (int)(instr_bit_size / 8.0)) {
         instr_byte_size += 1;
     }
+    // Relaxation placed the labels after this instruction by the size it picked
+    assert(instr.size == 0 || instr.size == instr_byte_size);
     instr_bin_repr <<= instr_byte_size * 8 - instr_bit_size;
     for (int i = instr_byte_size - 1; i >= 0; i--) {
         unsigned long mask = 0xff;
@@ -343,12 +622,8 @@ void program_resolve_names(Program *prog, vector(byte) *buffer) {
 }
 
 Symbol *program_get_symbol(Program prog, const char *name) {
-    foreach (Symbol, s, prog.sym_table) {
-        if (strcmp(s->name, name) == 0) {
-            return s;
-        }
-    }
-    return NULL;
+    size_t *index = hashmap_get(prog.symbol_index, name);
+    return index ? &prog.sym_table[*index] : NULL;
 }
 
 void program_check_unresolved_names(Program prog) {
@@ -364,4 +639,7 @@ void free_program(void *prog) {
     free_vector(&p.sym_table);
     free_vector(&p.labels);
     free_vector(&p.diresctives);
+    free_hashmap(&p.symbol_index);
+    free_hashmap(&p.label_index);
+    free_arena(p.arena);
 }
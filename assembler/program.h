@@ -4,10 +4,14 @@
 #include "common/arch.h"
 #include "common/vector.h"
 #include "common/sex.h"
+#include "common/hashmap.h"
+#include "common/object.h"
 #include "parser.h"
+#include "fragment.h"
 
 typedef struct {
     word address;
+    RelocKind kind;
     Span pos;
 } SymbolUsage;
 
@@ -18,29 +22,39 @@ typedef struct {
     bool is_resolved;
 } Symbol;
 
-Symbol new_symbol(const char *name, bool is_resolved);
-void symbol_add_usage(Symbol *symbol, word usage, Span pos);
-void free_symbol(void *entry);
+Symbol new_symbol(Arena *arena, const char *name, bool is_resolved);
+void symbol_add_usage(Symbol *symbol, word usage, RelocKind kind, Span pos);
 
 // Intermediate Representation of the program
 typedef struct {
+    Arena *arena; // Everything the vectors below point to
     vector(Symbol) sym_table;
     vector(Label) labels;
     vector(Directive) diresctives;
+    HashMap symbol_index; // Name -> index in sym_table
+    HashMap label_index;  // Name -> index in labels
+    bool uses_short_forms; // Some instruction got a short encoding, which needs SEX v3
 } Program;
 
 Program new_program(void);
 
 void program_add_label(Program *prog, Label lbl);
+// Adds the labels and directives of the fragment in their order and takes its arena
+void program_add_fragment(Program *prog, Fragment *fragment);
 void program_add_directive(Program *prog, Directive dir);
-void program_add_usage(Program *prog, const char *name, Span name_pos, word usage_address);
+void program_add_usage(Program *prog, const char *name, Span name_pos, word usage_address,
+                       RelocKind kind);
 void program_add_definition(Program *prog, const char *name, word def_address);
 
 ExecFile program_compile(Program *prog);
+// Leaves every use of a name to the link, see common/object.h
+ExecFile program_compile_object(Program *prog);
 void program_compile_symbol_table(Program prog, vector(byte) *buffer);
 void program_compile_directive(vector(byte) *buffer, Directive dir);
 void program_compile_data(Program *prog, vector(byte) *buffer, Decl decl);
-void program_compile_code(Program *prog, vector(byte) *buffer, Instr instr);
+// target is the address of the name the instruction uses when it is known, the ones that are not
+// known become usages
+void program_compile_code(Program *prog, vector(byte) *buffer, Instr instr, const word *target);
 void program_resolve_names(Program *prog, vector(byte) *buffer);
 
 Symbol *program_get_symbol(Program prog, const char *name);
@@ -0,0 +1,15 @@
+;; Tight arithmetic loop used to measure the dispatch overhead.
+;; Executes 1 + 1000 * (1 + 4 * 30000 + 3) + 1 = 120004002 instructions
+_main:
+    mov r3, 0
+.outer:
+    mov r1, 0
+.inner:
+    add r2, r1
+    add r1, 1
+    cmp r1, 30000
+    jif lt, .inner
+    add r3, 1
+    cmp r3, 1000
+    jif lt, .outer
+ret
@@ -0,0 +1,55 @@
+#!/bin/sh
+# Usage: asm_scaling.sh <sasm binary> <size>...
+# Assembles a generated source of every size (instructions, with size / 10 labels and size / 2
+# references, see gen_asm.sh) and prints the best time of REPS runs (3 by default) of every phase
+# that `sasm -T` reports. Below each size except the first go the growth exponents against the
+# previous size: about 1 for a phase that scales linearly, 2 for a quadratic one. Exponents above
+# MAX_EXPONENT (1.3 by default) are marked, times under 1 ms are too noisy to get one
+set -e
+
+SASM=$(realpath "$1")
+shift
+GEN_ASM=$(dirname "$(realpath "$0")")/gen_asm.sh
+REPS=${REPS:-3}
+MAX_EXPONENT=${MAX_EXPONENT:-1.3}
+
+WORK_DIR=$(mktemp -d)
+trap 'rm -rf "$WORK_DIR"' EXIT
+
+printf "%8s %12s %16s %16s %22s %15s %10s\n" size new_parser parse_top_level program_compile \
+    program_resolve_names execfile_write total
+previous=""
+for size in "$@"; do
+    "$GEN_ASM" $((size / 10)) "$size" $((size / 2)) > "$WORK_DIR/source.asm"
+    i=0
+    while [ $i -lt "$REPS" ]; do
+        "$SASM" -T "$WORK_DIR/source.asm" -o "$WORK_DIR/a.out" 2>> "$WORK_DIR/times"
+        i=$((i + 1))
+    done
+    # One line of best times in ms: size, then every phase and the total
+    current=$(awk -v size="$size" '
+        !($1 in best) || $2 < best[$1] { if (!($1 in best)) order[n++] = $1; best[$1] = $2 }
+        END {
+            printf "%d", size
+            for (i = 0; i < n; i++) { printf " %.3f", best[order[i]] * 1e3; total += best[order[i]] }
+            printf " %.3f\n", total * 1e3
+        }' "$WORK_DIR/times")
+    rm "$WORK_DIR/times"
+    echo "$current" | awk '{ printf "%8d %10.3f %16.3f %16.3f %22.3f %15.3f %10.3f   ms\n", $1, $2, $3, $4, $5, $6, $7 }'
+    if [ -n "$previous" ]; then
+        echo "$previous $current" | awk -v max="$MAX_EXPONENT" '{
+            printf "%8s", ""
+            for (i = 2; i <= 7; i++) {
+                width = i == 2 ? 10 : i == 5 ? 22 : i == 6 ? 15 : i == 7 ? 10 : 16
+                if ($i < 1 || $(i + 7) < 1) {
+                    printf " %" width "s", "-"
+                } else {
+                    exponent = log($(i + 7) / $i) / log($8 / $1)
+                    printf " %" width "s", sprintf("%s^%.2f", exponent > max ? "!" : "", exponent)
+                }
+            }
+            printf "   growth\n"
+        }'
+    fi
+    previous=$current
+done
@@ -0,0 +1,43 @@
+;; Branch-heavy state machine: a linear congruential generator picks one of five states on every
+;; step, so the branches are hard to predict. Runs 500 * 30000 steps
+_main:
+    mov r4, 1
+    mov r5, 0
+.outer:
+    mov r6, 0
+.step:
+    mul r4, 75
+    add r4, 74
+    mov r1, r4
+    shr r1, 13
+    cmp r1, 0
+    jif eq, .state0
+    cmp r1, 1
+    jif eq, .state1
+    cmp r1, 2
+    jif eq, .state2
+    cmp r1, 3
+    jif eq, .state3
+    jmp .state4
+.state0:
+    add r2, 1
+    jmp .next
+.state1:
+    sub r2, 3
+    jmp .next
+.state2:
+    or r2, r4
+    jmp .next
+.state3:
+    shl r2, 1
+    jmp .next
+.state4:
+    add r3, 1
+.next:
+    add r6, 1
+    cmp r6, 30000
+    jif lt, .step
+    add r5, 1
+    cmp r5, 500
+    jif lt, .outer
+ret
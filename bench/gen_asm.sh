@@ -0,0 +1,41 @@
+#!/bin/sh
+# Usage: gen_asm.sh <labels> <instructions> <references>
+# Prints a source with the given number of code labels, instructions and references to the labels.
+# The instructions are spread evenly over the labels, the references go to pseudo-random labels.
+# The program is only meant to be assembled
+set -e
+
+awk -v labels="$1" -v instructions="$2" -v references="$3" 'BEGIN {
+    if (labels < 1 || instructions < labels || references > instructions) {
+        print "gen_asm.sh: expected 1 <= labels <= instructions and references <= instructions" > "/dev/stderr"
+        exit 1
+    }
+    seed = 12345
+    emitted = 0
+    referenced = 0
+    for (l = 0; l < labels; l++) {
+        print (l == 0 ? "_main" : "label_" l) ":"
+        count = int(instructions * (l + 1) / labels) - emitted
+        for (i = 0; i < count; i++) {
+            # References are spread evenly over the instructions as well
+            if (int(references * (emitted + 1) / instructions) > referenced) {
+                seed = seed * 16807 % 2147483647
+                target = seed % labels
+                target = target == 0 ? "_main" : "label_" target
+                kind = referenced % 4
+                if (kind == 0) print "    jmp " target
+                if (kind == 1) print "    call " target
+                if (kind == 2) print "    mov r1, " target
+                if (kind == 3) print "    jif eq, " target
+                referenced++
+            } else if (emitted % 3 == 0) {
+                print "    add r" emitted % 8 ", " emitted % 1000
+            } else if (emitted % 3 == 1) {
+                print "    cmp r2, r3"
+            } else {
+                print "    push r4"
+            }
+            emitted++
+        }
+    }
+}'
@@ -0,0 +1,16 @@
+;; I/O throughput: 16-byte writes to the null device on port 1, waiting for the completions after
+;; every 64 of them. Runs with `-d build/null.so:1`
+_main:
+    mov r5, 0
+.batch:
+    mov r6, 0
+.write:
+    out 1, 16384, 16
+    add r6, 1
+    cmp r6, 64
+    jif lt, .write
+    wait 1
+    add r5, 1
+    cmp r5, 20000
+    jif lt, .batch
+ret
@@ -0,0 +1,17 @@
+;; Memory copy with `ld`/`str`: copies 4 KiB between two buffers above the program 5000 times
+_main:
+    mov r5, 0
+.again:
+    mov r1, 16384
+    mov r2, 24576
+.copy:
+    ld r3, r1
+    str r3, r2
+    add r1, 2
+    add r2, 2
+    cmp r1, 20480
+    jif lt, .copy
+    add r5, 1
+    cmp r5, 5000
+    jif lt, .again
+ret
@@ -0,0 +1,27 @@
+#!/bin/sh
+# Usage: mips.sh <program> <instruction count> <svm binary>...
+# Runs the program with every binary REPS times and prints the best time and MIPS
+set -e
+
+PROGRAM=$1
+INSTRUCTIONS=$2
+shift 2
+REPS=${REPS:-5}
+
+for SVM in "$@"; do
+    best=""
+    i=0
+    while [ $i -lt "$REPS" ]; do
+        start=$(date +%s%N)
+        "$SVM" "$PROGRAM" > /dev/null
+        end=$(date +%s%N)
+        elapsed=$((end - start))
+        if [ -z "$best" ] || [ $elapsed -lt "$best" ]; then
+            best=$elapsed
+        fi
+        i=$((i + 1))
+    done
+    awk -v name="$SVM" -v ns="$best" -v n="$INSTRUCTIONS" \
+        'BEGIN { printf "%-28s %8.3f s  %8.1f MIPS\n", name, ns / 1e9, n / (ns / 1e3) }'
+done
+rm -f vm.dump
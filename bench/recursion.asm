@@ -0,0 +1,30 @@
+;; Recursive `call`/`ret`: computes fib(18) 2000 times. The recursion is 18 calls deep, every level
+;; keeps 4 bytes on the stack
+_main:
+    mov r5, 0
+.again:
+    mov r1, 18
+    call fib
+    add r5, 1
+    cmp r5, 2000
+    jif lt, .again
+ret
+
+;; r2 = fib(r1), r1 is preserved
+fib:
+    cmp r1, 2
+    jif lt, .fib_base
+    push r1
+    sub r1, 1
+    call fib
+    pop r1
+    push r2
+    sub r1, 2
+    call fib
+    pop r3
+    add r2, r3
+    add r1, 2
+    ret
+.fib_base:
+    mov r2, r1
+    ret
@@ -0,0 +1,97 @@
+#!/bin/sh
+# Usage: run.sh <svm binary> <baseline.json> <program>...
+# Runs every program REPS times (5 by default) and prints the mean and the standard deviation of
+# ns per instruction and MIPS. Both come from --stats-json, so only the time spent in vm_run counts.
+# Programs that got more than TOLERANCE percent (10 by default) slower than the baseline are
+# reported. With CHECK=1 they make the script fail, and so does a baseline that was recorded on
+# another host or CPU, since the numbers only compare on the same machine. With UPDATE_BASELINE=1
+# the baseline is written instead. SVM_ARGS is passed to every run, e.g. to attach devices
+set -e
+
+SVM=$(realpath "$1")
+BASELINE=$(realpath -m "$2")
+shift 2
+REPS=${REPS:-5}
+TOLERANCE=${TOLERANCE:-10}
+
+# svm writes vm.dump to the working directory
+WORK_DIR=$(mktemp -d)
+trap 'rm -rf "$WORK_DIR"' EXIT
+
+json_number() {
+    sed -n "s/.*\"$1\": \([0-9.]*\).*/\1/p" "$2" | head -n 1
+}
+
+json_string() {
+    sed -n "s/.*\"$1\": \"\([^\"]*\)\".*/\1/p" "$2" | head -n 1
+}
+
+HOST=$(uname -n | tr -d '"\\%')
+CPU=$(sed -n 's/^model name[[:space:]]*: //p' /proc/cpuinfo 2>/dev/null | head -n 1 | tr -d '"\\%')
+CPU=${CPU:-$(uname -m)}
+same_host=""
+if [ -z "$UPDATE_BASELINE" ] && [ -f "$BASELINE" ] && [ "$(json_string host "$BASELINE")" = "$HOST" ] &&
+   [ "$(json_string cpu "$BASELINE")" = "$CPU" ]; then
+    same_host=1
+fi
+
+printf "%-12s %20s %22s %10s %8s\n" program ns/instr MIPS baseline change
+regressions=0
+baseline_lines="  \"host\": \"$HOST\",\n  \"cpu\": \"$CPU\",\n"
+for PROGRAM in "$@"; do
+    name=$(basename "$PROGRAM")
+    PROGRAM=$(realpath "$PROGRAM")
+    samples=""
+    i=0
+    while [ $i -lt "$REPS" ]; do
+        (cd "$WORK_DIR" && "$SVM" "$PROGRAM" $SVM_ARGS --stats-json stats.json > /dev/null)
+        samples="$samples $(json_number instructions "$WORK_DIR/stats.json"):$(json_number run_time "$WORK_DIR/stats.json")"
+        i=$((i + 1))
+    done
+    base=""
+    if [ -z "$UPDATE_BASELINE" ] && [ -f "$BASELINE" ]; then
+        base=$(sed -n "s/.*\"$name\": {\"ns_per_instr\": \([0-9.]*\).*/\1/p" "$BASELINE")
+    fi
+    # Prints the table row, then the mean ns/instr and whether it regressed
+    result=$(echo "$samples" | tr ' ' '\n' | awk -F: -v name="$name" -v base="$base" -v tolerance="$TOLERANCE" '
+        NF == 2 {
+            n++; ns[n] = $2 * 1e9 / $1; mips[n] = $1 / ($2 * 1e6)
+            ns_sum += ns[n]; mips_sum += mips[n]
+        }
+        END {
+            ns_mean = ns_sum / n; mips_mean = mips_sum / n
+            for (i = 1; i <= n; i++) {
+                ns_var += (ns[i] - ns_mean) ^ 2; mips_var += (mips[i] - mips_mean) ^ 2
+            }
+            ns_dev = n > 1 ? sqrt(ns_var / (n - 1)) : 0
+            mips_dev = n > 1 ? sqrt(mips_var / (n - 1)) : 0
+            printf "%-12s %10.3f +- %6.3f %10.1f +- %7.1f", name, ns_mean, ns_dev, mips_mean, mips_dev
+            regressed = 0
+            if (base != "") {
+                change = (ns_mean / base - 1) * 100
+                regressed = change > tolerance
+                printf " %10.3f %+7.1f%%%s", base, change, regressed ? "  REGRESSION" : ""
+            }
+            printf "\n%.4f %d\n", ns_mean, regressed
+        }')
+    echo "$result" | head -n 1
+    ns_mean=$(echo "$result" | tail -n 1 | cut -d" " -f1)
+    regressions=$((regressions + $(echo "$result" | tail -n 1 | cut -d" " -f2)))
+    mips=$(awk -v ns="$ns_mean" 'BEGIN { printf "%.1f", 1e3 / ns }')
+    baseline_lines="$baseline_lines  \"$name\": {\"ns_per_instr\": $ns_mean, \"mips\": $mips},\n"
+done
+
+if [ -n "$UPDATE_BASELINE" ]; then
+    printf "{\n$(printf "$baseline_lines" | sed '$ s/,$//')\n}\n" > "$BASELINE"
+    echo "Baseline written to $BASELINE"
+    exit 0
+fi
+if [ $regressions -gt 0 ]; then
+    echo "$regressions program(s) regressed by more than $TOLERANCE%"
+fi
+if [ -z "$same_host" ]; then
+    echo "The baseline was not recorded on $HOST ($CPU), write one with make bench-baseline"
+fi
+if [ -n "$CHECK" ] && { [ -z "$same_host" ] || [ $regressions -gt 0 ]; }; then
+    exit 1
+fi
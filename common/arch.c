@@ -4,18 +4,18 @@
 #include <stdint.h>
 #include <string.h>
 
-const InstrOpcode ZERO_OP_INSTRUCTIONS[] = { INSTR_RET };
-const InstrOpcode ONE_OP_INSTRUCTIONS[] = {
-    INSTR_PUSH, INSTR_POP, INSTR_CALL,
-    INSTR_NOT, INSTR_JMP
+static const char *MNEMONICS[INSTR_COUNT] = {
+#define X(name, mnemonic, opcode, shape) [opcode] = #mnemonic,
+    INSTRUCTION_SET(X)
+#undef X
 };
-const InstrOpcode TWO_OPS_INSTRUCTIONS[] = {
-    INSTR_LD, INSTR_ST, INSTR_MOV, INSTR_ADD,
-    INSTR_SUB, INSTR_MUL, INSTR_DIV, INSTR_AND,
-    INSTR_OR, INSTR_XOR, INSTR_SHL, INSTR_SHR,
-    INSTR_CMP, INSTR_JIF
+
+static const InstrShape SHAPES[INSTR_COUNT] = {
+    [0] = SHAPE_UNKNOWN,
+#define X(name, mnemonic, opcode, shape) [opcode] = shape,
+    INSTRUCTION_SET(X)
+#undef X
 };
-const InstrOpcode THREE_OPS_INSTRUCTIONS[] = { INSTR_IN, INSTR_OUT };
 
 const DirOpcode DIRECTIVES[] = { DIR_USE };
 const char *REGISTER_SET[] = { "r0", "r1", "r2", "r3", "r4", "r5", "r6", "r7", "r8", "r9", "r10",
@@ -32,59 +32,100 @@ Cmp cmp_from_string(const char *string) {
 }
 
 InstrOpcode instropcode_from_str(const char *string) {
-    if (strcmp(string, "mov") == 0)  return INSTR_MOV;
-    if (strcmp(string, "ld") == 0)   return INSTR_LD;
-    if (strcmp(string, "str") == 0)  return INSTR_ST;
-    if (strcmp(string, "add") == 0)  return INSTR_ADD;
-    if (strcmp(string, "sub") == 0)  return INSTR_SUB;
-    if (strcmp(string, "mul") == 0)  return INSTR_MUL;
-    if (strcmp(string, "div") == 0)  return INSTR_DIV;
-    if (strcmp(string, "not") == 0)  return INSTR_NOT;
-    if (strcmp(string, "push") == 0) return INSTR_PUSH;
-    if (strcmp(string, "pop") == 0)  return INSTR_POP;
-    if (strcmp(string, "call") == 0) return INSTR_CALL;
-    if (strcmp(string, "ret") == 0)  return INSTR_RET;
-    if (strcmp(string, "and") == 0)  return INSTR_AND;
-    if (strcmp(string, "or") == 0)   return INSTR_OR;
-    if (strcmp(string, "xor") == 0)  return INSTR_XOR;
-    if (strcmp(string, "shl") == 0)  return INSTR_SHL;
-    if (strcmp(string, "shr") == 0)  return INSTR_SHR;
-    if (strcmp(string, "jmp") == 0)  return INSTR_JMP;
-    if (strcmp(string, "cmp") == 0)  return INSTR_CMP;
-    if (strcmp(string, "jif") == 0)  return INSTR_JIF;
-    if (strcmp(string, "out") == 0)  return INSTR_OUT;
-    if (strcmp(string, "in") == 0)   return INSTR_IN;
+    for (size_t opcode = 1; opcode < INSTR_COUNT; opcode++) {
+        if (MNEMONICS[opcode][0] == string[0] && strcmp(MNEMONICS[opcode], string) == 0) {
+            return opcode;
+        }
+    }
     return INSTR_COUNT;
 }
 
-DirOpcode diropcode_from_str(const char *string) {
-    if (strcmp(string, "#use") == 0) return DIR_USE;
-    return DIR_COUNT;
+const char *instropcode_to_str(InstrOpcode opcode) {
+    return opcode < INSTR_COUNT ? MNEMONICS[opcode] : NULL;
 }
 
-bool in_instruction_set(const char *inst) {
-    return in_zero_op_instruction_set(inst) || in_one_op_instruction_set(inst)
-           || in_two_ops_instruction_set(inst) || in_three_ops_instruction_set(inst);
+InstrShape instr_shape(InstrOpcode opcode) {
+    return opcode < INSTR_COUNT ? SHAPES[opcode] : SHAPE_UNKNOWN;
 }
 
-bool in_zero_op_instruction_set(const char *inst) {
-    InstrOpcode opcode = instropcode_from_str(inst);
-    return instropcode_in_array(opcode, ZERO_OP_INSTRUCTIONS, ARRAY_LEN(ZERO_OP_INSTRUCTIONS));
+size_t instr_operand_count(InstrOpcode opcode) {
+    switch (instr_shape(opcode)) {
+        case SHAPE_REG: case SHAPE_ADDR: case SHAPE_PORT: return 1;
+        case SHAPE_REG_ANY: case SHAPE_CMP_ADDR:          return 2;
+        case SHAPE_PORT_IO:                               return 3;
+        default:                                          return 0;
+    }
 }
 
-bool in_one_op_instruction_set(const char *inst) {
-    InstrOpcode opcode = instropcode_from_str(inst);
-    return instropcode_in_array(opcode, ONE_OP_INSTRUCTIONS, ARRAY_LEN(ONE_OP_INSTRUCTIONS));
+static bool bit_at(const byte *code, size_t available, size_t bit) {
+    return bit / 8 < available && (code[bit / 8] >> (7 - bit % 8)) & 1;
 }
 
-bool in_two_ops_instruction_set(const char *inst) {
-    InstrOpcode opcode = instropcode_from_str(inst);
-    return instropcode_in_array(opcode, TWO_OPS_INSTRUCTIONS, ARRAY_LEN(TWO_OPS_INSTRUCTIONS));
+size_t instr_encoded_size(const byte *code, size_t available) {
+    if (available == 0) {
+        return 0;
+    }
+    size_t bits = OPCODE_BIT_SIZE;
+    byte opcode = code[0] >> (8 - OPCODE_BIT_SIZE);
+    if (opcode == OPCODE_JIF_NEAR) {
+        return available >= 2 ? 2 : 0;
+    }
+    switch (instr_shape(opcode)) {
+        case SHAPE_REG_ANY:
+            bits += REGISTER_BIT_SIZE;
+            if (!bit_at(code, available, bits++)) {
+                bits += REGISTER_BIT_SIZE;
+            } else if (bit_at(code, available, bits)) {
+                bits += 1 + IMM_SHORT_BITS;
+            } else if (bit_at(code, available, bits + 1)) {
+                bits += 2 + IMM_MEDIUM_BITS;
+            } else {
+                bits += 6 + NUMBER_BIT_SIZE;
+            }
+            break;
+        case SHAPE_REG:
+            bits += REGISTER_BIT_SIZE;
+            break;
+        case SHAPE_ADDR:
+            bits += bit_at(code, available, bits) ? 1 + JUMP_OFFSET_BITS : 3 + NUMBER_BIT_SIZE;
+            break;
+        case SHAPE_CMP_ADDR:
+            bits += 3 + NUMBER_BIT_SIZE;
+            break;
+        case SHAPE_NONE:
+            break;
+        case SHAPE_PORT_IO: {
+            bits += 8;
+            bool is_imm[2] = { bit_at(code, available, bits), bit_at(code, available, bits + 1) };
+            bits += 2;
+            for (size_t i = 0; i < 2; i++) {
+                if (!is_imm[i]) {
+                    bits += REGISTER_BIT_SIZE;
+                } else if (bit_at(code, available, bits)) {
+                    bits += 1 + IO_IMM_SHORT_BITS;
+                } else {
+                    bits += 1 + NUMBER_BIT_SIZE;
+                }
+            }
+        }; break;
+        case SHAPE_PORT:
+            bits += 8;
+            break;
+        default:
+            return 0;
+    }
+    size_t size = (bits + 7) / 8;
+    return size <= available ? size : 0;
 }
 
-bool in_three_ops_instruction_set(const char *inst) {
-    InstrOpcode opcode = instropcode_from_str(inst);
-    return instropcode_in_array(opcode, THREE_OPS_INSTRUCTIONS, ARRAY_LEN(THREE_OPS_INSTRUCTIONS));
+bool fits_signed(word value, size_t bits) {
+    int16_t number = (int16_t)value;
+    return number >= -(1 << (bits - 1)) && number < (1 << (bits - 1));
+}
+
+DirOpcode diropcode_from_str(const char *string) {
+    if (strcmp(string, "#use") == 0) return DIR_USE;
+    return DIR_COUNT;
 }
 
 bool in_register_set(const char *reg) {
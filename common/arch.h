@@ -29,32 +29,82 @@ typedef enum {
 } Cmp;
 Cmp cmp_from_string(const char *string);
 
+// How the operands of an instruction are written and encoded after its opcode
 typedef enum {
-    INSTR_MOV  = 0b00001,
-    INSTR_LD,
-    INSTR_ST,
-    INSTR_ADD,
-    INSTR_SUB,
-    INSTR_MUL,
-    INSTR_DIV,
-    INSTR_NOT,
-    INSTR_PUSH,
-    INSTR_POP,
-    INSTR_CALL,
-    INSTR_RET,
-    INSTR_AND,
-    INSTR_OR,
-    INSTR_XOR,
-    INSTR_SHL,
-    INSTR_SHR,
-    INSTR_JMP,
-    INSTR_CMP,
-    INSTR_JIF,
-    INSTR_OUT,
-    INSTR_IN,
+    SHAPE_NONE,      // ret
+    SHAPE_REG,       // <reg>
+    SHAPE_REG_ANY,   // <reg>, <reg/imm>: the register, a flag that is set for an immediate, then it
+    SHAPE_ADDR,      // <addr>
+    SHAPE_CMP_ADDR,  // <cmp>, <addr>: the 3-bit condition, then the address
+    SHAPE_PORT,      // <port>: 8 bits
+    SHAPE_PORT_IO,   // <port>, <reg/imm>, <reg/imm>: the port, a flag for each operand, then them
+    SHAPE_UNKNOWN,
+} InstrShape;
+
+// The instruction set, one X(name, mnemonic, opcode, shape) for every instruction in the order of
+// their opcodes. The opcodes, the mnemonics and the shapes are made from it, the assembler and the
+// VM encode and decode every instruction by its shape
+#define INSTRUCTION_SET(X) \
+    X(MOV,  mov,  0b00001, SHAPE_REG_ANY)  \
+    X(LD,   ld,   0b00010, SHAPE_REG_ANY)  \
+    X(ST,   str,  0b00011, SHAPE_REG_ANY)  \
+    X(ADD,  add,  0b00100, SHAPE_REG_ANY)  \
+    X(SUB,  sub,  0b00101, SHAPE_REG_ANY)  \
+    X(MUL,  mul,  0b00110, SHAPE_REG_ANY)  \
+    X(DIV,  div,  0b00111, SHAPE_REG_ANY)  \
+    X(NOT,  not,  0b01000, SHAPE_REG)      \
+    X(PUSH, push, 0b01001, SHAPE_REG)      \
+    X(POP,  pop,  0b01010, SHAPE_REG)      \
+    X(CALL, call, 0b01011, SHAPE_ADDR)     \
+    X(RET,  ret,  0b01100, SHAPE_NONE)     \
+    X(AND,  and,  0b01101, SHAPE_REG_ANY)  \
+    X(OR,   or,   0b01110, SHAPE_REG_ANY)  \
+    X(XOR,  xor,  0b01111, SHAPE_REG_ANY)  \
+    X(SHL,  shl,  0b10000, SHAPE_REG_ANY)  \
+    X(SHR,  shr,  0b10001, SHAPE_REG_ANY)  \
+    X(JMP,  jmp,  0b10010, SHAPE_ADDR)     \
+    X(CMP,  cmp,  0b10011, SHAPE_REG_ANY)  \
+    X(JIF,  jif,  0b10100, SHAPE_CMP_ADDR) \
+    X(OUT,  out,  0b10101, SHAPE_PORT_IO)  \
+    X(IN,   in,   0b10110, SHAPE_PORT_IO)  \
+    X(WAIT, wait, 0b10111, SHAPE_PORT)
+
+#define MNEMONIC_MAX_LEN 4 // Of the mnemonics in INSTRUCTION_SET
+
+typedef enum {
+#define X(name, mnemonic, opcode, shape) INSTR_##name = opcode,
+    INSTRUCTION_SET(X)
+#undef X
     INSTR_COUNT,
 } InstrOpcode;
+// Opcodes past the instructions that select a shorter encoding of one of them
+#define OPCODE_JIF_NEAR 0b11111 // jif <cmp>, <8-bit offset from the jif>
+
+// Widths of the short immediates and offsets. Every short form starts with a set bit where the
+// long form has a zero padding bit, so programs made before the short forms decode as they did
+//   <reg>, <imm>:        1 and 5 bits, 01 and 12 bits, or 000000 and 16 bits
+//   call and jmp:        1 and a 10-bit offset from the instruction, or 000 and 16 bits
+//   jif:                 OPCODE_JIF_NEAR with an 8-bit offset, or INSTR_JIF with 16 bits
+//   immediates of in/out: 1 and 8 bits, or 0 and 16 bits
+// Immediates are signed, offsets are added to the address of the instruction
+#define IMM_SHORT_BITS 5
+#define IMM_MEDIUM_BITS 12
+#define JUMP_OFFSET_BITS 10
+#define JIF_OFFSET_BITS 8
+#define IO_IMM_SHORT_BITS 8
+
+// Returns INSTR_COUNT for an unknown mnemonic
 InstrOpcode instropcode_from_str(const char *string);
+// Returns NULL for an unknown opcode
+const char *instropcode_to_str(InstrOpcode opcode);
+// Returns SHAPE_UNKNOWN for an unknown opcode
+InstrShape instr_shape(InstrOpcode opcode);
+size_t instr_operand_count(InstrOpcode opcode);
+// Size in bytes of the encoded instruction that starts at code, 0 for an unknown opcode or an
+// instruction that does not fit in the available bytes
+size_t instr_encoded_size(const byte *code, size_t available);
+// Whether the word, read as signed, fits in the given number of bits
+bool fits_signed(word value, size_t bits);
 
 typedef enum {
     DIR_USE = 0b001,
@@ -62,11 +112,6 @@ typedef enum {
 } DirOpcode;
 DirOpcode diropcode_from_str(const char *string);
 
-bool in_instruction_set(const char *inst);
-bool in_zero_op_instruction_set(const char *inst);
-bool in_one_op_instruction_set(const char *inst);
-bool in_two_ops_instruction_set(const char *inst);
-bool in_three_ops_instruction_set(const char *inst);
 bool in_register_set(const char *reg);
 bool in_directive_set(const char *dir);
 
@@ -0,0 +1,73 @@
+#include "arena.h"
+#include <stdlib.h>
+#include <string.h>
+
+static ArenaBlock *new_block(size_t size) {
+    ArenaBlock *block = malloc(sizeof(ArenaBlock) + size);
+    block->prev = NULL;
+    block->size = size;
+    block->used = 0;
+    return block;
+}
+
+Arena *new_arena(void) {
+    Arena *arena = malloc(sizeof(Arena));
+    arena->blocks = new_block(ARENA_BLOCK_SIZE);
+    arena->adopted = NULL;
+    arena->next_adopted = NULL;
+    return arena;
+}
+
+void free_arena(Arena *arena) {
+    if (!arena) {
+        return;
+    }
+    Arena *adopted = arena->adopted;
+    while (adopted) {
+        Arena *next = adopted->next_adopted;
+        free_arena(adopted);
+        adopted = next;
+    }
+    ArenaBlock *block = arena->blocks;
+    while (block) {
+        ArenaBlock *prev = block->prev;
+        free(block);
+        block = prev;
+    }
+    free(arena);
+}
+
+void arena_adopt(Arena *arena, Arena *other) {
+    other->next_adopted = arena->adopted;
+    arena->adopted = other;
+}
+
+void *arena_alloc(Arena *arena, size_t size) {
+    size = (size + sizeof(max_align_t) - 1) / sizeof(max_align_t) * sizeof(max_align_t);
+    ArenaBlock *current = arena->blocks;
+    if (size > ARENA_BLOCK_SIZE / 4) {
+        // Goes behind the current block, whose free space is still used
+        ArenaBlock *block = new_block(size);
+        block->used = size;
+        block->prev = current->prev;
+        current->prev = block;
+        return block->data;
+    }
+    if (current->size - current->used < size) {
+        current = new_block(ARENA_BLOCK_SIZE);
+        current->prev = arena->blocks;
+        arena->blocks = current;
+    }
+    void *ptr = (char *)current->data + current->used;
+    current->used += size;
+    return ptr;
+}
+
+char *arena_strdup(Arena *arena, const char *str) {
+    size_t size = strlen(str) + 1;
+    return memcpy(arena_alloc(arena, size), str, size);
+}
+
+void *arena_allocator(void *arena, size_t size) {
+    return arena_alloc(arena, size);
+}
@@ -0,0 +1,48 @@
+#ifndef __COMMON_ARENA_H
+#define __COMMON_ARENA_H
+
+#include <stddef.h>
+#include "vector.h"
+
+// Memory is taken from blocks of this size, larger allocations get a block of their own
+#define ARENA_BLOCK_SIZE (64 * 1024)
+
+typedef struct ArenaBlock {
+    struct ArenaBlock *prev;
+    size_t size;
+    size_t used;
+    max_align_t data[];
+} ArenaBlock;
+
+// Bump allocator for things that die together: there is no way to free a single allocation,
+// free_arena releases all of them
+typedef struct Arena {
+    ArenaBlock *blocks; // The one allocations are taken from, the others are behind it
+    struct Arena *adopted; // Freed together with this one
+    struct Arena *next_adopted;
+} Arena;
+
+Arena *new_arena(void);
+void free_arena(Arena *arena);
+// Makes arena free other when it is freed itself. Both can still be allocated from
+void arena_adopt(Arena *arena, Arena *other);
+
+// Aligned for any type
+void *arena_alloc(Arena *arena, size_t size);
+char *arena_strdup(Arena *arena, const char *str);
+
+// Makes an empty (NULL) vector keep its items in the arena. Such a vector is never freed by itself
+#define vector_set_arena(vec, arena) vector_set_allocator(vec, arena_allocator, arena)
+void *arena_allocator(void *arena, size_t size);
+
+// Makes dst a copy of src in the arena, without spare capacity
+#define vector_copy_to_arena(dst, src, arena) \
+    do { \
+        dst = NULL; \
+        vector_set_arena(dst, arena); \
+        vector_reserve(dst, vector_size(src)); \
+        memcpy(dst, src, vector_size(src) * sizeof(*(src))); \
+        __vector_set_size(dst, vector_size(src)); \
+    } while(0);
+
+#endif
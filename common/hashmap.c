@@ -0,0 +1,74 @@
+#include "hashmap.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define HASHMAP_INITIAL_CAPACITY 64
+
+HashMap new_hashmap(void) {
+    return (HashMap) {
+        .entries = calloc(HASHMAP_INITIAL_CAPACITY, sizeof(HashMapEntry)),
+        .capacity = HASHMAP_INITIAL_CAPACITY,
+        .size = 0,
+    };
+}
+
+void free_hashmap(HashMap *map) {
+    free(map->entries);
+    map->entries = NULL;
+    map->capacity = map->size = 0;
+}
+
+uint32_t hash_string(const char *str) {
+    uint32_t hash = 2166136261u; // FNV-1a
+    for (; *str; str++) {
+        hash = (hash ^ (unsigned char)*str) * 16777619u;
+    }
+    return hash;
+}
+
+static HashMapEntry *find_entry(HashMapEntry *entries, size_t capacity, const char *key, uint32_t hash) {
+    for (size_t i = hash & (capacity - 1);; i = (i + 1) & (capacity - 1)) {
+        HashMapEntry *e = &entries[i];
+        if (!e->key || (e->hash == hash && strcmp(e->key, key) == 0)) {
+            return e;
+        }
+    }
+}
+
+static void grow(HashMap *map) {
+    size_t capacity = map->capacity * 2;
+    HashMapEntry *entries = calloc(capacity, sizeof(HashMapEntry));
+    for (size_t i = 0; i < map->capacity; i++) {
+        HashMapEntry *e = &map->entries[i];
+        if (e->key) {
+            // Keys are unique, so the first free slot is the one
+            size_t j = e->hash & (capacity - 1);
+            while (entries[j].key) {
+                j = (j + 1) & (capacity - 1);
+            }
+            entries[j] = *e;
+        }
+    }
+    free(map->entries);
+    map->entries = entries;
+    map->capacity = capacity;
+}
+
+size_t *hashmap_get(HashMap map, const char *key) {
+    HashMapEntry *e = find_entry(map.entries, map.capacity, key, hash_string(key));
+    return e->key ? &e->value : NULL;
+}
+
+void hashmap_set(HashMap *map, const char *key, size_t value) {
+    // At most half full
+    if (2 * (map->size + 1) > map->capacity) {
+        grow(map);
+    }
+    uint32_t hash = hash_string(key);
+    HashMapEntry *e = find_entry(map->entries, map->capacity, key, hash);
+    if (!e->key) {
+        *e = (HashMapEntry) { key, hash, 0 };
+        map->size++;
+    }
+    e->value = value;
+}
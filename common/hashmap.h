@@ -0,0 +1,32 @@
+#ifndef __COMMON_HASHMAP_H
+#define __COMMON_HASHMAP_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Maps names to indices, usually of a vector that holds the named items in their original order.
+// Open addressing with linear probing. Every entry keeps the hash of its key, so probing compares
+// strings only when the hashes match and growing does not rehash them
+typedef struct {
+    const char *key; // NULL for an empty slot. Not owned, must outlive the map
+    uint32_t hash;
+    size_t value;
+} HashMapEntry;
+
+typedef struct {
+    HashMapEntry *entries;
+    size_t capacity; // Power of two
+    size_t size;
+} HashMap;
+
+HashMap new_hashmap(void);
+void free_hashmap(HashMap *map);
+
+uint32_t hash_string(const char *str);
+
+// Returns NULL if there is no such key
+size_t *hashmap_get(HashMap map, const char *key);
+// Inserts the key or replaces its value
+void hashmap_set(HashMap *map, const char *key, size_t value);
+
+#endif
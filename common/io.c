@@ -1,5 +1,9 @@
 #include "io.h"
+#include <fcntl.h>
 #include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 char *read_whole_file(const char *filename) {
     FILE *fp = fopen(filename, "rb");
@@ -19,6 +23,36 @@ char *read_whole_file(const char *filename) {
     return buffer;
 }
 
+// The file is mapped over anonymous memory that has room for the terminating zero, because touching
+// a page of the file mapping that is entirely past the end of the file raises SIGBUS
+static size_t mapping_size(size_t file_size) {
+    size_t page = sysconf(_SC_PAGESIZE);
+    return (file_size + 1 + page - 1) / page * page;
+}
+
+char *map_whole_file(const char *filename, size_t *size) {
+    int fd = open(filename, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        error_file_doesnot_exist(filename);
+    }
+    *size = st.st_size;
+    char *content = mmap(NULL, mapping_size(*size), PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (content == MAP_FAILED) {
+        error_file_doesnot_exist(filename);
+    }
+    if (*size > 0 && mmap(content, *size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED) {
+        error_file_doesnot_exist(filename);
+    }
+    close(fd);
+    return content;
+}
+
+void unmap_whole_file(char *content, size_t size) {
+    munmap(content, mapping_size(size));
+}
+
 size_t load_program(byte *memory, size_t memory_size, const char *filename) {
     FILE *fp = fopen(filename, "rb");
     if (!fp) {
@@ -33,7 +67,16 @@ size_t load_program(byte *memory, size_t memory_size, const char *filename) {
     return file_len;
 }
 
+_Thread_local jmp_buf *DIAGNOSTICS_TRAP = NULL;
+
+void begin_diagnostic(void) {
+    if (DIAGNOSTICS_TRAP) {
+        longjmp(*DIAGNOSTICS_TRAP, 1);
+    }
+}
+
 void error_invalid_file_format(const char *filename) {
+    begin_diagnostic();
     style(STYLE_BOLD);
     printf("%s: ", filename);
     printf_red("invalid file format\n");
@@ -41,11 +84,13 @@ void error_invalid_file_format(const char *filename) {
 }
 
 void error_file_doesnot_exist(const char *filename) {
+    begin_diagnostic();
     printf("File not found: %s\n", filename);
     exit(EXIT_FAILURE);
 }
 
 void error_couldnot_find_section(const char *section_name) {
+    begin_diagnostic();
     style(STYLE_BOLD);
     printf_red("cannot find section");
     style(STYLE_BOLD);
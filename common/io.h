@@ -1,6 +1,7 @@
 #ifndef __COMMON_IO_H
 #define __COMMON_IO_H
 
+#include <setjmp.h>
 #include <stdio.h>
 #include "arch.h"
 
@@ -32,10 +33,20 @@ typedef const char * Color;
 
 // Returns file content. Needs to be freed
 char *read_whole_file(const char *filename);
+// Maps the file privately, so the content can be changed in place without touching the file.
+// At least one zero byte follows the content. Needs to be unmapped with unmap_whole_file
+char *map_whole_file(const char *filename, size_t *size);
+void unmap_whole_file(char *content, size_t size);
 
 // Returns the size of the loaded program
 size_t load_program(byte *memory, size_t memory_size, const char *filename);
 
+// Set by a thread whose diagnostics are reported by another one: the first diagnostic jumps there
+// instead of being printed
+extern _Thread_local jmp_buf *DIAGNOSTICS_TRAP;
+// Called before a diagnostic is printed
+void begin_diagnostic(void);
+
 void error_invalid_file_format(const char *filename);
 void error_file_doesnot_exist(const char *filename);
 void error_couldnot_find_section(const char *section_name);
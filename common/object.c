@@ -0,0 +1,165 @@
+#include "object.h"
+#include "common/utils.h"
+#include <string.h>
+
+// Returns the name at cursor and moves past its zero, or NULL if the section ends before it
+static const char *take_name(const byte **cursor, const byte *end) {
+    const byte *zero = memchr(*cursor, 0, end - *cursor);
+    if (!zero) {
+        return NULL;
+    }
+    const char *name = (const char *)*cursor;
+    *cursor = zero + 1;
+    return name;
+}
+
+static word get_word(const byte *buffer) {
+    return buffer[0] << 8 | buffer[1];
+}
+
+static bool read_symbols(Object *object) {
+    SectionView symbols = execfile_view_section(object->file, "symbols");
+    SectionView labels = execfile_view_section(object->file, "labels");
+    const byte *cursor = symbols.data, *end = symbols.data + symbols.size;
+    const byte *label = labels.data, *labels_end = labels.data + labels.size;
+    if (labels.size < 2) {
+        return false; // An executable
+    }
+    object->data_size = get_word(label);
+    label += 2;
+    while (cursor < end) {
+        const char *name = take_name(&cursor, end);
+        if (!name || cursor + 2 > end || label + 3 > labels_end) {
+            return false;
+        }
+        ObjectSymbol symbol = {
+            name, get_word(cursor), get_word(label + 1), label[0] != 0, label[0]
+        };
+        vector_push_back(object->symbols, symbol);
+        cursor += 2;
+        label += 3;
+    }
+    return object->data_size <= object->program.size;
+}
+
+static bool read_undefined(Object *object) {
+    SectionView undefined = execfile_view_section(object->file, "undefined");
+    const byte *cursor = undefined.data, *end = undefined.data + undefined.size;
+    while (cursor < end) {
+        const char *name = take_name(&cursor, end);
+        if (!name) {
+            return false;
+        }
+        vector_push_back(object->undefined, name);
+    }
+    return true;
+}
+
+static bool read_relocs(Object *object) {
+    SectionView relocs = execfile_view_section(object->file, "relocs");
+    size_t names = vector_size(object->symbols) + vector_size(object->undefined);
+    for (size_t i = 0; i + 7 <= relocs.size; i += 7) {
+        const byte *r = relocs.data + i;
+        Reloc reloc = {
+            get_word(r), r[2], (uint32_t)r[3] << 24 | (uint32_t)r[4] << 16 | r[5] << 8 | r[6]
+        };
+        if ((size_t)reloc.address + 2 > object->program.size || reloc.kind > RELOC_SIZEOF ||
+            reloc.symbol >= names) {
+            return false;
+        }
+        vector_push_back(object->relocs, reloc);
+    }
+    return relocs.size % 7 == 0;
+}
+
+bool object_from_execfile(ExecFile file, const char *file_name, Object *object) {
+    *object = (Object) { .file_name = file_name, .file = file };
+    object->directives = execfile_view_section(file, "directives");
+    object->program = execfile_view_section(file, "program");
+    if (!read_symbols(object) || !read_undefined(object) || !read_relocs(object)) {
+        free_object(object);
+        return false;
+    }
+    return true;
+}
+
+bool object_read(const char *path, Object *object) {
+    ExecFile file;
+    if (!execfile_read(path, &file)) {
+        return false;
+    }
+    return object_from_execfile(file, path, object);
+}
+
+void free_object(void *object) {
+    Object *o = object;
+    free_vector(&o->symbols);
+    free_vector(&o->undefined);
+    free_vector(&o->relocs);
+    free_execfile(&o->file);
+}
+
+void object_push_reloc(vector(byte) *buffer, Reloc reloc) {
+    // Pushed through a copy, since bytes stored through *buffer could change the pointer itself
+    vector(byte) relocs = *buffer;
+    vector_push_word_back(relocs, reloc.address);
+    vector_push_back(relocs, reloc.kind);
+    vector_push_word_back(relocs, reloc.symbol >> 16);
+    vector_push_word_back(relocs, reloc.symbol & 0xFFFF);
+    *buffer = relocs;
+}
+
+// ------------------------------------------------------------------------------------------------
+// Linking
+
+ObjectSymbolTable new_object_symbol_table(void) {
+    return (ObjectSymbolTable) { .index = new_hashmap() };
+}
+
+void free_object_symbol_table(void *table) {
+    ObjectSymbolTable *t = table;
+    free_vector(&t->definitions);
+    free_hashmap(&t->index);
+}
+
+bool object_define_symbols(ObjectSymbolTable *table, const Object *object, size_t index,
+                           LinkError *error)
+{
+    foreach(ObjectSymbol, symbol, object->symbols) {
+        if (hashmap_get(table->index, symbol->name)) {
+            *error = (LinkError) { LINK_REDEFINITION, symbol->name, object->file_name };
+            return false;
+        }
+        hashmap_set(&table->index, symbol->name, vector_size(table->definitions));
+        vector_push_back(table->definitions, ((ObjectDefinition) { *symbol, index }));
+    }
+    return true;
+}
+
+bool object_bind_reloc(const ObjectSymbolTable *table, const Object *object, size_t first_symbol,
+                       Reloc reloc, size_t *symbol, LinkError *error)
+{
+    size_t label_count = vector_size(object->symbols);
+    *symbol = first_symbol + reloc.symbol;
+    if (reloc.symbol >= label_count) {
+        const char *name = object->undefined[reloc.symbol - label_count];
+        size_t *index = hashmap_get(table->index, name);
+        if (!index) {
+            *error = (LinkError) { LINK_UNRESOLVED, name, object->file_name };
+            return false;
+        }
+        *symbol = *index;
+    }
+    const ObjectSymbol *definition = &table->definitions[*symbol].symbol;
+    if (reloc.kind == RELOC_SIZEOF && !definition->is_data) {
+        *error = (LinkError) { LINK_SIZEOF_CODE, definition->name, object->file_name };
+        return false;
+    }
+    return true;
+}
+
+void object_patch_reloc(byte *where, RelocKind kind, word address, word size) {
+    word value = kind == RELOC_SIZEOF ? size : address;
+    where[0] = value >> 8;
+    where[1] = value & 0xFF;
+}
@@ -0,0 +1,103 @@
+#ifndef __COMMON_OBJECT_H
+#define __COMMON_OBJECT_H
+
+#include "common/arch.h"
+#include "common/hashmap.h"
+#include "common/sex.h"
+#include "common/vector.h"
+#include <stdint.h>
+
+// Relocatable object, what `sasm -c` makes. A SEX file with the sections:
+//   "directives" as in an executable
+//   "program"    the data labels, then the code labels, with zeros in place of the used names
+//   "symbols"    as in an executable: NUL-terminated name and word address of every label
+//   "labels"     word size of the data part of "program", then for every label in "symbols" a byte
+//                that is 0 for code labels and the alignment of data labels, and its word size
+//   "undefined"  NUL-terminated names that are used but not defined
+//   "relocs"     every use of a name: word address in "program", byte RelocKind and u32 index of
+//                the name in "symbols", or in "undefined" counting from the end of "symbols"
+// Sections other than "labels" are left out when empty. Every number is big-endian.
+// The version also goes up when the code in "program" is encoded differently, so that the objects
+// that `sasm -C` cached before are assembled again
+#define OBJECT_FORMAT_VERSION 2
+
+typedef enum {
+    RELOC_ADDRESS, // The word gets the address of the name
+    RELOC_SIZEOF,  // The word gets the size of the data label
+} RelocKind;
+
+typedef struct {
+    word address;
+    RelocKind kind;
+    uint32_t symbol;
+} Reloc;
+
+typedef struct {
+    const char *name; // Points into the file
+    word address;     // In "program"
+    word size;        // 0 for code labels
+    bool is_data;
+    byte alignment;   // 2 for data labels with words, so that they can be read in one go
+} ObjectSymbol;
+
+typedef struct {
+    const char *file_name; // For messages
+    ExecFile file;
+    SectionView directives;
+    SectionView program;
+    word data_size;
+    vector(ObjectSymbol) symbols;
+    vector(const char *) undefined; // Point into the file
+    vector(Reloc) relocs;
+} Object;
+
+// Takes the file, which is freed with the object. Returns false and frees the file if it is not an
+// object
+bool object_from_execfile(ExecFile file, const char *file_name, Object *object);
+// Returns false if the file cannot be read or is not an object
+bool object_read(const char *path, Object *object);
+void free_object(void *object);
+
+void object_push_reloc(vector(byte) *buffer, Reloc reloc);
+
+// ------------------------------------------------------------------------------------------------
+// Linking, the part that `sasm` and `slink` share
+
+typedef enum {
+    LINK_REDEFINITION,
+    LINK_UNRESOLVED,
+    LINK_NO_ENTRY,
+    LINK_SIZEOF_CODE, // .sizeof of a code label from another object
+} LinkErrorKind;
+
+typedef struct {
+    LinkErrorKind kind;
+    const char *name;
+    const char *file_name; // Of the object with the error
+} LinkError;
+
+typedef struct {
+    ObjectSymbol symbol;
+    size_t object; // Index of the object that defines it
+} ObjectDefinition;
+
+// Every label of the linked objects, in the order of the objects and of their "symbols"
+typedef struct {
+    vector(ObjectDefinition) definitions;
+    HashMap index; // Name -> index in definitions
+} ObjectSymbolTable;
+
+ObjectSymbolTable new_object_symbol_table(void);
+void free_object_symbol_table(void *table);
+
+// Defines the labels of the index-th object. Returns false if one of them is already defined
+bool object_define_symbols(ObjectSymbolTable *table, const Object *object, size_t index,
+                           LinkError *error);
+// The index in the table of the label that a reloc of the object uses, first_symbol is where the
+// labels of the object begin. Returns false if the name is not defined or .sizeof uses code
+bool object_bind_reloc(const ObjectSymbolTable *table, const Object *object, size_t first_symbol,
+                       Reloc reloc, size_t *symbol, LinkError *error);
+// Writes the word that a bound reloc puts in place of the name: the address or size of the label
+void object_patch_reloc(byte *where, RelocKind kind, word address, word size);
+
+#endif
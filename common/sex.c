@@ -1,9 +1,18 @@
 #include "sex.h"
 #include "common/str.h"
+#include "common/utils.h"
 #include "io.h"
+#include <fcntl.h>
 #include <stdio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
-SectionHeader new_section(const char *name, uint32_t offset, word size) {
+#define SEX_V1_MAGIC 0x00584553 // "SEX\0" read as a little-endian u32
+
+static const byte SEX_MAGIC[] = { 'S', 'E', 'X' }; // Followed by the version since v2
+
+SectionHeader new_section(const char *name, uint32_t offset, uint32_t size) {
     return (SectionHeader) { new_string(name), offset, size };
 }
 
@@ -15,71 +24,159 @@ void free_section(void *sec) {
 ExecFile new_execfile(void) {
     vector(SectionHeader) sections = NULL;
     vector_set_destructor(sections, free_section);
-    return (ExecFile) { sections, NULL };
+    return (ExecFile) { sections, NULL, NULL, 0, 0, SEX_VERSION };
 }
 
 void execfile_add_section(ExecFile *ef, const char *name, vector(byte) data) {
     size_t section_offset = vector_size(ef->content);
     size_t section_size = vector_size(data);
+    vector_reserve(ef->content, section_offset + section_size);
     foreach(byte, i, data) {
         vector_push_back(ef->content, *i);
     }
     vector_push_back(ef->sections, new_section(name, section_offset, section_size));
 }
 
+// ------------------------------------------------------------------------------------------------
+
+static void put_u32(byte *buffer, uint32_t value) {
+    buffer[0] = value >> 24;
+    buffer[1] = value >> 16;
+    buffer[2] = value >> 8;
+    buffer[3] = value;
+}
+
+static uint32_t get_u32(const byte *buffer) {
+    return (uint32_t)buffer[0] << 24 | (uint32_t)buffer[1] << 16 | (uint32_t)buffer[2] << 8 | buffer[3];
+}
+
+static size_t align_to_page(size_t offset) {
+    return (offset + SEX_PAGE_SIZE - 1) / SEX_PAGE_SIZE * SEX_PAGE_SIZE;
+}
+
 void execfile_write(ExecFile ef, const char *filepath) {
     FILE *fp = fopen(filepath, "w");
+    if (fp == NULL) {
+        error_file_doesnot_exist(filepath);
+    }
 
-    // Magic
-    byte magic[] = { 'S', 'E', 'X', 0 };
-    fwrite(magic, sizeof(magic), sizeof(byte), fp);
+    size_t section_count = vector_size(ef.sections);
+    size_t table_size = section_count * SEX_SECTION_ENTRY_SIZE;
+    size_t headers_size = SEX_HEADER_SIZE + table_size;
+    byte *headers = calloc(headers_size, sizeof(byte));
 
-    // Amount of sections
-    word section_count = (word)vector_size(ef.sections);
-    fwrite(&section_count, 1, sizeof(word), fp);
+    memcpy(headers, SEX_MAGIC, sizeof(SEX_MAGIC));
+    headers[3] = max(ef.version, SEX_VERSION); // v1 files are written as v2
+    put_u32(headers + 4, section_count);
+    put_u32(headers + 8, SEX_HEADER_SIZE);
+
+    size_t payload_offset = align_to_page(headers_size);
+    byte *entry = headers + SEX_HEADER_SIZE;
+    foreach(SectionHeader, header, ef.sections) {
+        strncpy((char *)entry, header->name, SEX_SECTION_NAME_SIZE - 1);
+        put_u32(entry + SEX_SECTION_NAME_SIZE, payload_offset);
+        put_u32(entry + SEX_SECTION_NAME_SIZE + 4, header->size);
+        payload_offset = align_to_page(payload_offset + header->size);
+        entry += SEX_SECTION_ENTRY_SIZE;
+    }
+    fwrite(headers, headers_size, sizeof(byte), fp);
+    free(headers);
 
-    // Section headers
+    size_t written = headers_size;
     foreach(SectionHeader, header, ef.sections) {
-        fwrite(header->name, strlen(header->name) + 1, sizeof(char), fp);
-        fwrite(&header->offset, 1, sizeof(header->offset), fp);
-        fwrite(&header->size, 1, sizeof(header->size), fp);
+        for (size_t padding = align_to_page(written) - written; padding > 0; padding--) {
+            fputc(0, fp);
+        }
+        fwrite(ef.content + header->offset, header->size, sizeof(byte), fp);
+        written = align_to_page(written) + header->size;
     }
-    fwrite(ef.content, vector_size(ef.content), vector_item_size(ef.content), fp);
     fclose(fp);
 }
 
-ExecFile execfile_read(const char *filepath) {
-    FILE *fp = fopen(filepath, "r");
-    ExecFile ef = new_execfile();
+// ------------------------------------------------------------------------------------------------
 
-    uint32_t magic;
-    fread(&magic, 1, sizeof(magic), fp);
-    if (magic != 0x00584553) {
-        error_invalid_file_format(filepath);
+static bool read_sections_v2(ExecFile *ef) {
+    if (ef->mapping_size < SEX_HEADER_SIZE) {
+        return false;
     }
-    word section_count;
-    fread(&section_count, 1, sizeof(word), fp);
+    uint32_t section_count = get_u32(ef->mapping + 4);
+    uint64_t table_offset = get_u32(ef->mapping + 8);
+    if (table_offset + (uint64_t)section_count * SEX_SECTION_ENTRY_SIZE > ef->mapping_size) {
+        return false;
+    }
+    char name[SEX_SECTION_NAME_SIZE + 1] = { 0 };
+    for (uint32_t i = 0; i < section_count; i++) {
+        const byte *entry = ef->mapping + table_offset + i * SEX_SECTION_ENTRY_SIZE;
+        memcpy(name, entry, SEX_SECTION_NAME_SIZE);
+        uint32_t offset = get_u32(entry + SEX_SECTION_NAME_SIZE);
+        uint32_t size = get_u32(entry + SEX_SECTION_NAME_SIZE + 4);
+        vector_push_back(ef->sections, new_section(name, offset, size));
+    }
+    ef->payloads_begin = 0;
+    return true;
+}
 
-    vector(SectionHeader) sections = NULL;
-    string name = NULL;
-    char c;
+static bool read_sections_v1(ExecFile *ef) {
+    const byte *cursor = ef->mapping + 4;
+    const byte *end = ef->mapping + ef->mapping_size;
+    word section_count;
+    if (cursor + sizeof(word) > end) {
+        return false;
+    }
+    memcpy(&section_count, cursor, sizeof(word));
+    cursor += sizeof(word);
     for (word i = 0; i < section_count; i++) {
-        while ( (c = fgetc(fp)) != '\0' ) string_push_char(&name, c);
+        const byte *name = cursor;
+        while (cursor < end && *cursor != 0) cursor++;
+        if (cursor + 1 + sizeof(uint32_t) + sizeof(word) > end) {
+            return false;
+        }
+        cursor++;
         uint32_t offset;
-        fread(&offset, 1, sizeof(offset), fp);
+        memcpy(&offset, cursor, sizeof(offset));
         word size;
-        fread(&size, 1, sizeof(size), fp);
-        vector_push_back(sections, new_section(name, offset, size));
-        vector_clean(name);
+        memcpy(&size, cursor + sizeof(offset), sizeof(size));
+        cursor += sizeof(offset) + sizeof(size);
+        vector_push_back(ef->sections, new_section((const char *)name, offset, size));
     }
-    free_string(&name);
-    vector(byte) content = NULL;
-    while (!feof(fp)) vector_push_back(content, fgetc(fp));
-    fclose(fp);
+    ef->payloads_begin = cursor - ef->mapping;
+    return true;
+}
 
-    ef.content = content;
-    ef.sections = sections;
-    return ef;
+bool execfile_read(const char *filepath, ExecFile *ef) {
+    int fd = open(filepath, O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < 4) {
+        close(fd);
+        return false;
+    }
+    byte *mapping = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        return false;
+    }
+
+    *ef = new_execfile();
+    ef->mapping = mapping;
+    ef->mapping_size = st.st_size;
+    uint32_t v1_magic;
+    memcpy(&v1_magic, mapping, sizeof(v1_magic));
+    bool ok = false;
+    if (v1_magic == SEX_V1_MAGIC) {
+        ef->version = 1;
+        ok = read_sections_v1(ef);
+    } else if (memcmp(mapping, SEX_MAGIC, sizeof(SEX_MAGIC)) == 0 &&
+               (mapping[3] == SEX_VERSION || mapping[3] == SEX_VERSION_SHORT_FORMS)) {
+        ef->version = mapping[3];
+        ok = read_sections_v2(ef); // v3 only differs in the program
+    }
+    if (!ok) {
+        free_execfile(ef);
+    }
+    return ok;
 }
 
 SectionHeader *execfile_get_section(ExecFile ef, const char *section_name) {
@@ -91,21 +188,29 @@ SectionHeader *execfile_get_section(ExecFile ef, const char *section_name) {
     return NULL;
 }
 
-vector(byte) execfile_get_section_content(ExecFile ef, const char *section_name) {
-    vector(byte) section_content = NULL;
+SectionView execfile_view_section(ExecFile ef, const char *section_name) {
+    SectionView view = { NULL, 0 };
     SectionHeader *section = execfile_get_section(ef, section_name);
     if (section == NULL) {
-        return section_content;
+        return view;
     }
-    vector_reserve(section_content, section->size);
-    for (size_t i = 0; i < section->size; i++) {
-        vector_push_back(section_content, ef.content[section->offset + i]);
+    const byte *payloads = ef.mapping ? ef.mapping + ef.payloads_begin : ef.content;
+    size_t payloads_size = ef.mapping ? ef.mapping_size - ef.payloads_begin : vector_size(ef.content);
+    // Truncated files are treated as if the section was missing
+    if ((uint64_t)section->offset + section->size > payloads_size) {
+        return view;
     }
-    return section_content;
+    view.data = payloads + section->offset;
+    view.size = section->size;
+    return view;
 }
 
 void free_execfile(void *exec_file) {
-    ExecFile ef = *(ExecFile *)exec_file;
-    free_vector(&ef.sections);
-    free_vector(&ef.content);
+    ExecFile *ef = (ExecFile *)exec_file;
+    free_vector(&ef->sections);
+    free_vector(&ef->content);
+    if (ef->mapping) {
+        munmap(ef->mapping, ef->mapping_size);
+    }
+    ef->mapping = NULL;
 }
@@ -7,26 +7,53 @@
 #include "common/vector.h"
 #include <stdint.h>
 
+// SEX v2 layout. Every number is big-endian.
+//   header:        magic "SEX\2", u32 section count, u32 section table offset, u32 reserved
+//   section table: SEX_SECTION_NAME_SIZE bytes of NUL-padded name, u32 offset, u32 size
+//   payloads:      every section starts at a SEX_PAGE_SIZE aligned file offset
+// v3 ("SEX\3") has the same layout, but its program uses the short encodings of common/arch.h,
+// so that readers that only know v2 reject it instead of running it wrong.
+// v1 ("SEX\0") has a host-endian header with packed names and 16-bit sizes, it is still readable
+#define SEX_VERSION 2
+#define SEX_VERSION_SHORT_FORMS 3
+#define SEX_HEADER_SIZE 16
+#define SEX_SECTION_NAME_SIZE 24
+#define SEX_SECTION_ENTRY_SIZE (SEX_SECTION_NAME_SIZE + 8)
+#define SEX_PAGE_SIZE 4096
+
 typedef struct {
     string name;
     uint32_t offset;
-    word size;
+    uint32_t size;
 } SectionHeader;
 
-SectionHeader new_section(const char *name, uint32_t offset, word size);
+SectionHeader new_section(const char *name, uint32_t offset, uint32_t size);
 void free_section(void *sec);
 
 typedef struct {
     vector(SectionHeader) sections;
-    vector(byte) content;
+    vector(byte) content;  // Payloads added with execfile_add_section
+    byte *mapping;         // The whole file if it was read with execfile_read, otherwise NULL
+    size_t mapping_size;
+    size_t payloads_begin; // Section offsets of a read file start here
+    byte version;          // SEX_VERSION unless the program needs SEX_VERSION_SHORT_FORMS
 } ExecFile;
 
+// Points into the ExecFile, so it is valid as long as the file is not freed
+typedef struct {
+    const byte *data; // NULL if there is no such section
+    size_t size;
+} SectionView;
+
 ExecFile new_execfile(void);
 void execfile_add_section(ExecFile *ef, const char *name, vector(byte) data);
+// Writes v2, or v3 if the version of the file says so
 void execfile_write(ExecFile ef, const char *filepath);
-ExecFile execfile_read(const char *filepath);
+// Maps the file. Returns false if the file cannot be opened, is not an executable or has a version
+// newer than v3
+bool execfile_read(const char *filepath, ExecFile *ef);
 SectionHeader *execfile_get_section(ExecFile ef, const char *section_name);
-vector(byte) execfile_get_section_content(ExecFile ef, const char *section_name);
+SectionView execfile_view_section(ExecFile ef, const char *section_name);
 void free_execfile(void *exec_file);
 
 #endif
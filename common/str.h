@@ -28,11 +28,13 @@ string new_string(const char *str) {
 }
 
 void string_push_char(string *s, char ch) {
-    if (*s != NULL && !vector_empty(*s)) {
-        vector_erase(*s, strlen(*s));
+    string str = *s; // Chars stored through s could change the pointer itself
+    if (str != NULL && !vector_empty(str)) {
+        vector_erase(str, strlen(str));
     }
-    vector_push_back(*s, ch);
-    vector_push_back(*s, 0);
+    vector_push_back(str, ch);
+    vector_push_back(str, 0);
+    *s = str;
 }
 
 #endif
@@ -7,12 +7,16 @@
 #include <stdarg.h>
 
 typedef void (*VecElementDestructor)(void *);
+// Returns memory that the vector does not free, see vector_set_allocator
+typedef void *(*VecAllocator)(void *context, size_t size);
 
 typedef struct {
     size_t size;
     size_t capacity;
     size_t item_size;
     VecElementDestructor destructor;
+    VecAllocator allocator;
+    void *allocator_context;
 } VecHeader;
 
 #define vector(type) type*
@@ -25,6 +29,8 @@ typedef struct {
             hdr->size = hdr->capacity = 0; \
             hdr->item_size = sizeof(*(vec)); \
             hdr->destructor = NULL; \
+            hdr->allocator = NULL; \
+            hdr->allocator_context = NULL; \
             vec = vector_header_to_base(vec); \
         } \
     } while(0);
@@ -35,10 +41,17 @@ typedef struct {
         if (!(vec) && vec_cap == 0) { \
             vector_create_header(vec); \
         } \
-        vec = (void *)vector_base_to_header(vec); \
-        vec = realloc(vec, sizeof(*(vec)) * new_cap + sizeof(VecHeader)); \
-        ((VecHeader *)vec)->capacity = new_cap; \
-        vec = vector_header_to_base(vec); \
+        VecHeader *vec_hdr = vector_base_to_header(vec); \
+        size_t vec_bytes = sizeof(*(vec)) * new_cap + sizeof(VecHeader); \
+        if (vec_hdr->allocator) { \
+            VecHeader *grown = vec_hdr->allocator(vec_hdr->allocator_context, vec_bytes); \
+            memcpy(grown, vec_hdr, sizeof(VecHeader) + sizeof(*(vec)) * vec_hdr->size); \
+            vec_hdr = grown; \
+        } else { \
+            vec_hdr = realloc(vec_hdr, vec_bytes); \
+        } \
+        vec_hdr->capacity = new_cap; \
+        vec = vector_header_to_base(vec_hdr); \
     } while(0);
 
 #define vector_base_to_header(vec) \
@@ -113,6 +126,17 @@ typedef struct {
         ((VecHeader *)vector_base_to_header(vec))->destructor = (d_tor); \
     } while(0);
 
+// Only for an empty (NULL) vector. Its memory is taken from allocator(context, size) from now on
+// and the vector is never freed by itself, only the destructor of its items is called
+#define vector_set_allocator(vec, alloc, context) \
+    do { \
+        if (!(vec)) { \
+            VecHeader *hdr = (alloc)((context), sizeof(VecHeader)); \
+            *hdr = (VecHeader){ 0, 0, sizeof(*(vec)), NULL, (alloc), (context) }; \
+            vec = vector_header_to_base(hdr); \
+        } \
+    } while(0);
+
 #define vector_erase(vec, idx) \
     do { \
         void *_vector = vec; \
@@ -124,8 +148,8 @@ typedef struct {
             __vector_set_size(vec, vector_size(vec) - 1); \
             break; \
         } \
-        memcpy((void *)&vec[idx], (void *)&vec[idx + 1], \
-                (vector_size(vec) - idx) * sizeof(*(vec))); \
+        memmove((void *)&vec[idx], (void *)&vec[idx + 1], \
+                (vector_size(vec) - idx - 1) * sizeof(*(vec))); \
         __vector_set_size(vec, vector_size(vec) - 1); \
     } while(0);
 
@@ -171,7 +195,9 @@ void free_vector(void *vector) {
         for (size_t __i = 0; __i < vector_size(vec); __i++) {
             __vector_free_item(vec, __i);
         }
-        free(vector_base_to_header(vec));
+        if (!vector_base_to_header(vec)->allocator) {
+            free(vector_base_to_header(vec));
+        }
 }
 #endif
 #endif
@@ -1,25 +1,242 @@
+// Console device. `out` only copies the buffer to a ring, a writer thread drains the ring to stdout
+// with large writev calls. Written bytes reach stdout at most SVM_CONSOLE_FLUSH_US microseconds
+// (DEFAULT_FLUSH_LATENCY_US by default) later, and all of them are written before fini returns.
+// `in` reads a line from a read-ahead buffer over stdin, printing the pending output first.
+// Since this library exports `read` and `write` itself, it must not call the ones of libc
 #include <common/arch.h>
 #include <common/utils.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/uio.h>
+#include <time.h>
+
+#define OUTPUT_RING_SIZE (1 << 16) // Power of two
+#define INPUT_BUFFER_SIZE (1 << 16)
+#define DEFAULT_FLUSH_LATENCY_US 5000
 
 static byte *memory = NULL;
 
+// Single producer (the VM thread) and single consumer (the writer). Positions grow forever
+static char output[OUTPUT_RING_SIZE];
+static _Atomic size_t output_head = 0; // Moved by the writer
+static _Atomic size_t output_tail = 0; // Moved by the VM
+static _Atomic bool writer_idle = false;
+static bool write_failed = false;
+
+// Guard the flags below and the sleeps of both threads
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wakeup;
+static pthread_cond_t drained = PTHREAD_COND_INITIALIZER;
+static bool urgent = false; // The VM waits for the ring to drain
+static bool stopping = false;
+
+static long flush_latency_us = DEFAULT_FLUSH_LATENCY_US;
+static pthread_t writer;
+
+static char input[INPUT_BUFFER_SIZE];
+static size_t input_begin = 0, input_end = 0;
+static bool input_eof = false;
+
+// ------------------------------------------------------------------------------------------------
+// Writer thread
+
+// Writes output[head; tail) to stdout, with two pieces if it wraps around
+static void write_output(size_t head, size_t tail) {
+    while (head != tail && !write_failed) {
+        size_t begin = head % OUTPUT_RING_SIZE;
+        size_t first = min(tail - head, OUTPUT_RING_SIZE - begin);
+        struct iovec iov[2] = {
+            { output + begin, first },
+            { output, tail - head - first },
+        };
+        ssize_t written = writev(1, iov, iov[1].iov_len ? 2 : 1);
+        if (written < 0 && errno != EINTR) {
+            write_failed = true; // The rest is dropped, fini reports it
+        } else if (written > 0) {
+            head += written;
+        }
+    }
+}
+
+static struct timespec deadline_after(long us) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    t.tv_sec += us / 1000000;
+    t.tv_nsec += (us % 1000000) * 1000;
+    if (t.tv_nsec >= 1000000000) {
+        t.tv_sec++;
+        t.tv_nsec -= 1000000000;
+    }
+    return t;
+}
+
+static size_t output_used(void) {
+    return atomic_load(&output_tail) - atomic_load(&output_head);
+}
+
+static void *drain_output(void *arg) {
+    (void)arg;
+    for (;;) {
+        size_t head = atomic_load_explicit(&output_head, memory_order_relaxed);
+        size_t tail = atomic_load_explicit(&output_tail, memory_order_acquire);
+        if (head != tail) {
+            write_output(head, tail);
+            atomic_store_explicit(&output_head, tail, memory_order_release);
+            pthread_mutex_lock(&lock);
+            pthread_cond_broadcast(&drained);
+            pthread_mutex_unlock(&lock);
+            continue;
+        }
+        pthread_mutex_lock(&lock);
+        // Sleep until the VM writes something. See console_push for the other side
+        atomic_store(&writer_idle, true);
+        if (atomic_load(&output_tail) == head) {
+            while (atomic_load(&writer_idle) && !stopping && !urgent) {
+                pthread_cond_wait(&wakeup, &lock);
+            }
+        }
+        atomic_store(&writer_idle, false);
+        // Then let the output pile up, so it is written with a few large calls
+        struct timespec deadline = deadline_after(flush_latency_us);
+        while (!urgent && !stopping && output_used() < OUTPUT_RING_SIZE / 2) {
+            if (pthread_cond_timedwait(&wakeup, &lock, &deadline) == ETIMEDOUT) {
+                break;
+            }
+        }
+        urgent = false;
+        bool stop = stopping && output_used() == 0;
+        pthread_mutex_unlock(&lock);
+        if (stop) {
+            return NULL;
+        }
+    }
+}
+
+// ------------------------------------------------------------------------------------------------
+// VM side
+
+static void wake_writer(bool is_urgent) {
+    pthread_mutex_lock(&lock);
+    atomic_store(&writer_idle, false);
+    urgent |= is_urgent;
+    pthread_cond_signal(&wakeup);
+    pthread_mutex_unlock(&lock);
+}
+
+// Blocks until the writer took at least `needed` bytes of the ring
+static void wait_for_space(size_t needed) {
+    pthread_mutex_lock(&lock);
+    while (OUTPUT_RING_SIZE - output_used() < needed) {
+        atomic_store(&writer_idle, false);
+        urgent = true;
+        pthread_cond_signal(&wakeup);
+        pthread_cond_wait(&drained, &lock);
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+static void console_push(const byte *data, size_t size) {
+    while (size > 0) {
+        size_t chunk = min(size, OUTPUT_RING_SIZE / 2);
+        if (OUTPUT_RING_SIZE - output_used() < chunk) {
+            wait_for_space(chunk);
+        }
+        size_t tail = atomic_load_explicit(&output_tail, memory_order_relaxed);
+        size_t used_before = tail - atomic_load(&output_head);
+        size_t begin = tail % OUTPUT_RING_SIZE;
+        size_t first = min(chunk, OUTPUT_RING_SIZE - begin);
+        memcpy(output + begin, data, first);
+        memcpy(output, data + first, chunk - first);
+        atomic_store(&output_tail, tail + chunk);
+        if (atomic_load(&writer_idle)) {
+            wake_writer(false);
+        } else if (used_before < OUTPUT_RING_SIZE / 2 && used_before + chunk >= OUTPUT_RING_SIZE / 2) {
+            wake_writer(true); // Do not wait for the deadline when the ring gets full
+        }
+        data += chunk;
+        size -= chunk;
+    }
+}
+
+static void console_flush(void) {
+    wait_for_space(OUTPUT_RING_SIZE);
+}
+
+// Fills the read-ahead buffer. Returns false at the end of the input
+static bool refill_input(void) {
+    if (input_eof) {
+        return false;
+    }
+    struct iovec iov = { input, INPUT_BUFFER_SIZE };
+    ssize_t count;
+    do {
+        count = readv(0, &iov, 1);
+    } while (count < 0 && errno == EINTR);
+    if (count <= 0) {
+        input_eof = true;
+        return false;
+    }
+    input_begin = 0;
+    input_end = count;
+    return true;
+}
+
+// ------------------------------------------------------------------------------------------------
+
 word init(byte *mem) {
     memory = mem;
-    return 0;
+    const char *latency = getenv("SVM_CONSOLE_FLUSH_US");
+    if (latency) {
+        flush_latency_us = atol(latency);
+    }
+    // Whatever the VM printed itself goes first
+    fflush(stdout);
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&wakeup, &attr);
+    pthread_condattr_destroy(&attr);
+    stopping = false;
+    return pthread_create(&writer, NULL, drain_output, NULL) == 0 ? 0 : 1;
 }
 
-word fini(void) { return 0; }
+word fini(void) {
+    pthread_mutex_lock(&lock);
+    stopping = true;
+    pthread_cond_signal(&wakeup);
+    pthread_mutex_unlock(&lock);
+    pthread_join(writer, NULL);
+    pthread_cond_destroy(&wakeup);
+    return write_failed ? 1 : 0;
+}
 
+// Reads a line (with its \n) or buffer_size - 1 bytes, whichever is shorter, and terminates it with 0
 word read(word buffer_addr, word buffer_size) {
-    char buff[buffer_size];
-    fgets(buff, buffer_size, stdin);
-    memcpy(memory + buffer_addr, buff, buffer_size);
-    return strlen(buff);
+    if (buffer_size == 0) {
+        return 0;
+    }
+    console_flush(); // The program may be waiting for an answer to what it printed
+    char *buffer = (char *)memory + buffer_addr;
+    word count = 0;
+    while (count < buffer_size - 1) {
+        if (input_begin == input_end && !refill_input()) {
+            break;
+        }
+        char c = input[input_begin++];
+        buffer[count++] = c;
+        if (c == '\n') {
+            break;
+        }
+    }
+    buffer[count] = '\0';
+    return count;
 }
 
 word write(word buffer_addr, word buffer_size) {
-    printf("%.*s", buffer_size, memory + buffer_addr);
+    console_push(memory + buffer_addr, buffer_size);
     return buffer_size;
 }
@@ -0,0 +1,67 @@
+// Asynchronous (ABI v2) device that discards writes and reads nothing. Every request takes
+// SVM_NULL_LATENCY_US microseconds (0 by default), which makes it handy to see how much of the
+// device latency a program hides behind its own work
+#include <common/arch.h>
+#include <vm/device.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+static DeviceRings *rings = NULL;
+static useconds_t latency = 0;
+static pthread_t worker;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wakeup = PTHREAD_COND_INITIALIZER;
+static bool notified = false;
+static bool stopping = false;
+
+static void *serve(void *arg) {
+    (void)arg;
+    for (;;) {
+        DeviceRequest request;
+        while (device_next_request(rings, &request)) {
+            if (latency) {
+                usleep(latency);
+            }
+            device_complete(rings, request, request.op == DEVICE_WRITE ? request.size : 0);
+        }
+        pthread_mutex_lock(&lock);
+        if (device_prepare_sleep(rings)) {
+            while (!notified && !stopping) {
+                pthread_cond_wait(&wakeup, &lock);
+            }
+        }
+        notified = false;
+        bool stop = stopping;
+        pthread_mutex_unlock(&lock);
+        if (stop) {
+            return NULL;
+        }
+    }
+}
+
+word init_async(byte *mem, DeviceRings *device_rings) {
+    (void)mem;
+    rings = device_rings;
+    const char *env = getenv("SVM_NULL_LATENCY_US");
+    latency = env ? atoi(env) : 0;
+    stopping = false;
+    return pthread_create(&worker, NULL, serve, NULL) == 0 ? 0 : 1;
+}
+
+void notify(void) {
+    pthread_mutex_lock(&lock);
+    notified = true;
+    pthread_cond_signal(&wakeup);
+    pthread_mutex_unlock(&lock);
+}
+
+// The VM collects every request before fini, so nothing is left in the rings
+word fini(void) {
+    pthread_mutex_lock(&lock);
+    stopping = true;
+    pthread_cond_signal(&wakeup);
+    pthread_mutex_unlock(&lock);
+    pthread_join(worker, NULL);
+    return 0;
+}
@@ -0,0 +1,100 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include "io.h"
+#include "common/utils.h"
+
+typedef struct {
+    size_t address;
+    size_t symbol;
+} PlacedSymbol;
+
+static int compare_by_address(const void *a, const void *b) {
+    const PlacedSymbol *x = a, *y = b;
+    if (x->address != y->address) return x->address > y->address ? 1 : -1;
+    return x->symbol > y->symbol ? 1 : -1;
+}
+
+void print_layout(Linker linker) {
+    vector(PlacedSymbol) kept = NULL;
+    for (size_t i = 0; i < vector_size(linker.symbols); i++) {
+        if (linker.units[linker.symbols[i].unit].is_kept) {
+            PlacedSymbol placed = { linker_symbol_address(linker, i), i };
+            vector_push_back(kept, placed);
+        }
+    }
+    qsort(kept, vector_size(kept), sizeof(PlacedSymbol), compare_by_address);
+    printf("Address  Kind  Name (object)\n");
+    foreach(PlacedSymbol, placed, kept) {
+        LinkSymbol *symbol = &linker.symbols[placed->symbol];
+        printf("0x%04zx   %-5s %s (%s)\n", placed->address, symbol->alignment ? "data" : "code",
+               symbol->name, linker.modules[symbol->module].object.file_name);
+    }
+    size_t dropped = 0, dropped_size = 0;
+    foreach(Unit, unit, linker.units) {
+        if (!unit->is_kept) {
+            dropped++;
+            dropped_size += unit->end - unit->begin;
+        }
+    }
+    printf("Size: %zu bytes, dropped %zu of %zu label groups (%zu bytes)\n", linker.size, dropped,
+           vector_size(linker.units), dropped_size);
+    free_vector(&kept);
+}
+
+// ------------------------------------------------------------------------------------------------
+
+void error_no_input_file(void) {
+    begin_diagnostic();
+    style(STYLE_BOLD);
+    printf_red("error: ");
+    printf("no input file\n");
+    exit(EXIT_FAILURE);
+}
+
+static void print_error_location(const char *file_name) {
+    begin_diagnostic();
+    style(STYLE_BOLD);
+    printf("%s: ", file_name);
+    printf_red("error: ");
+}
+
+void error_redefinition(const char *name, const char *file_name, const char *first_file_name) {
+    print_error_location(file_name);
+    printf("Redefinition of name `%s`, it is already defined in %s!\n", name, first_file_name);
+    exit(EXIT_FAILURE);
+}
+
+void error_unresolved_name(const char *name, const char *file_name) {
+    print_error_location(file_name);
+    printf("Cannot find definition of name `%s`!\n", name);
+    exit(EXIT_FAILURE);
+}
+
+void error_sizeof_code(const char *name, const char *file_name) {
+    print_error_location(file_name);
+    printf("Code label `%s` has no size!\n", name);
+    exit(EXIT_FAILURE);
+}
+
+void error_link(LinkError error) {
+    if (error.kind == LINK_UNRESOLVED) {
+        error_unresolved_name(error.name, error.file_name);
+    }
+    error_sizeof_code(error.name, error.file_name);
+}
+
+void error_no_entry(void) {
+    begin_diagnostic();
+    style(STYLE_BOLD);
+    printf_red("error: ");
+    printf("There's no "ENTRY_POINT_NAME" label in the objects!\n");
+    exit(EXIT_FAILURE);
+}
+
+void error_too_big_program(size_t size) {
+    begin_diagnostic();
+    style(STYLE_BOLD);
+    printf_red("error: ");
+    printf("The program takes %zu bytes, it does not fit in %d!\n", size, 1 << NUMBER_BIT_SIZE);
+    exit(EXIT_FAILURE);
+}
@@ -0,0 +1,20 @@
+#ifndef __LINK_IO_H
+#define __LINK_IO_H
+
+#include "linker.h"
+#include "common/io.h"
+
+void print_layout(Linker linker);
+
+// ------------------------------------------------------------------------------------------------
+
+void error_no_input_file(void);
+void error_redefinition(const char *name, const char *file_name, const char *first_file_name);
+void error_unresolved_name(const char *name, const char *file_name);
+void error_sizeof_code(const char *name, const char *file_name);
+// Unresolved names and .sizeof of code
+void error_link(LinkError error);
+void error_no_entry(void);
+void error_too_big_program(size_t size);
+
+#endif
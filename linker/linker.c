@@ -0,0 +1,362 @@
+#include "linker.h"
+#include "io.h"
+#include "common/utils.h"
+#include <stdlib.h>
+#include <string.h>
+
+static void free_module(void *module) {
+    free_object(&((Module *)module)->object);
+}
+
+Linker new_linker(vector(Object) objects) {
+    Linker linker = { .table = new_object_symbol_table() };
+    vector_set_destructor(linker.modules, free_module);
+    foreach(Object, object, objects) {
+        vector_push_back(linker.modules, ((Module) { .object = *object }));
+    }
+    return linker;
+}
+
+void free_linker(void *linker) {
+    Linker *l = linker;
+    free_vector(&l->modules);
+    free_vector(&l->symbols);
+    free_object_symbol_table(&l->table);
+    free_vector(&l->units);
+    free_vector(&l->relocs);
+    free_vector(&l->layout);
+}
+
+size_t linker_symbol_address(Linker linker, size_t symbol) {
+    LinkSymbol *s = &linker.symbols[symbol];
+    return linker.units[s->unit].address + s->offset;
+}
+
+// ------------------------------------------------------------------------------------------------
+// Resolving
+
+// Labels that end with a jump or a return do not fall through into the next one. Anything that
+// cannot be decoded is assumed to fall through, so that it stays where it was
+static bool falls_through(SectionView program, size_t begin, size_t end) {
+    byte last = 0;
+    for (size_t addr = begin; addr < end;) {
+        size_t size = instr_encoded_size(program.data + addr, end - addr);
+        if (size == 0) {
+            return true;
+        }
+        last = program.data[addr] >> (8 - OPCODE_BIT_SIZE);
+        addr += size;
+    }
+    return last != INSTR_JMP && last != INSTR_RET;
+}
+
+static const Object *SORTED_OBJECT; // qsort has no context
+
+static int compare_symbols(const void *a, const void *b) {
+    const ObjectSymbol *x = &SORTED_OBJECT->symbols[*(const size_t *)a];
+    const ObjectSymbol *y = &SORTED_OBJECT->symbols[*(const size_t *)b];
+    // Data comes first, an empty data label may share its address with the first code label
+    if (x->is_data != y->is_data) return y->is_data - x->is_data;
+    if (x->address != y->address) return x->address - y->address;
+    return *(const size_t *)a > *(const size_t *)b ? 1 : -1;
+}
+
+static void push_unit(Linker *linker, size_t module, size_t begin, size_t end, byte alignment) {
+    Unit unit = { .module = module, .begin = begin, .end = end, .alignment = alignment };
+    vector_push_back(linker->units, unit);
+}
+
+static void split_module(Linker *linker, size_t index) {
+    Module *module = &linker->modules[index];
+    Object *object = &module->object;
+    size_t count = vector_size(object->symbols);
+    size_t *sorted = malloc(max(count, 1) * sizeof(size_t));
+    for (size_t i = 0; i < count; i++) {
+        sorted[i] = i;
+    }
+    SORTED_OBJECT = object;
+    qsort(sorted, count, sizeof(size_t), compare_symbols);
+    // Addresses past the 16-bit space wrapped when the object was made
+    if (object->program.size > 1 << NUMBER_BIT_SIZE) {
+        error_too_big_program(object->program.size);
+    }
+
+    module->first_unit = vector_size(linker->units);
+    for (size_t i = 0; i < count; i++) {
+        ObjectSymbol *symbol = &object->symbols[sorted[i]];
+        LinkSymbol *link_symbol = &linker->symbols[module->first_symbol + sorted[i]];
+        if (symbol->is_data) {
+            if ((size_t)symbol->address + symbol->size > object->data_size) {
+                error_invalid_file_format(object->file_name);
+            }
+            link_symbol->unit = vector_size(linker->units);
+            push_unit(linker, index, symbol->address, symbol->address + symbol->size,
+                      symbol->alignment);
+            continue;
+        }
+        // The next code label, or the end of the program, ends the label
+        size_t end = i + 1 < count ? object->symbols[sorted[i + 1]].address : object->program.size;
+        if (symbol->address < object->data_size || end < symbol->address) {
+            error_invalid_file_format(object->file_name);
+        }
+        bool has_units = vector_size(linker->units) > module->first_unit;
+        Unit *last = has_units ? &linker->units[vector_size(linker->units) - 1] : NULL;
+        bool continues = last && last->alignment == 0 &&
+                         falls_through(object->program, last->begin, last->end);
+        if (continues) {
+            last->end = end;
+        } else {
+            push_unit(linker, index, symbol->address, end, 0);
+        }
+        link_symbol->unit = vector_size(linker->units) - 1;
+    }
+    module->unit_count = vector_size(linker->units) - module->first_unit;
+    for (size_t i = 0; i < count; i++) {
+        LinkSymbol *link_symbol = &linker->symbols[module->first_symbol + i];
+        link_symbol->offset = object->symbols[i].address - linker->units[link_symbol->unit].begin;
+    }
+    free(sorted);
+}
+
+static void define_symbols(Linker *linker) {
+    for (size_t i = 0; i < vector_size(linker->modules); i++) {
+        Module *module = &linker->modules[i];
+        module->first_symbol = vector_size(linker->symbols);
+        LinkError error;
+        if (!object_define_symbols(&linker->table, &module->object, i, &error)) {
+            size_t defined = *hashmap_get(linker->table.index, error.name);
+            Module *first = &linker->modules[linker->table.definitions[defined].object];
+            error_redefinition(error.name, error.file_name, first->object.file_name);
+        }
+        foreach(ObjectSymbol, symbol, module->object.symbols) {
+            LinkSymbol link_symbol = {
+                .name = symbol->name, .module = i, .size = symbol->size,
+                .alignment = symbol->is_data ? max(symbol->alignment, 1) : 0,
+            };
+            vector_push_back(linker->symbols, link_symbol);
+        }
+    }
+}
+
+// The unit that holds the word at address: the last one that begins before it
+static size_t find_unit(Linker *linker, Module *module, word address) {
+    size_t low = module->first_unit, high = module->first_unit + module->unit_count;
+    while (high - low > 1) {
+        size_t mid = low + (high - low) / 2;
+        if (linker->units[mid].begin <= address) {
+            low = mid;
+        } else {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+static int compare_relocs(const void *a, const void *b) {
+    const LinkReloc *x = a, *y = b;
+    if (x->unit != y->unit) return x->unit > y->unit ? 1 : -1;
+    return x->offset - y->offset;
+}
+
+static void bind_relocs(Linker *linker) {
+    for (size_t i = 0; i < vector_size(linker->modules); i++) {
+        Module *module = &linker->modules[i];
+        Object *object = &module->object;
+        foreach(Reloc, reloc, object->relocs) {
+            size_t symbol;
+            LinkError error;
+            if (!object_bind_reloc(&linker->table, object, module->first_symbol, *reloc, &symbol,
+                                   &error)) {
+                error_link(error);
+            }
+            if (module->unit_count == 0) {
+                error_invalid_file_format(object->file_name);
+            }
+            size_t unit = find_unit(linker, module, reloc->address);
+            Unit *u = &linker->units[unit];
+            if (reloc->address < u->begin || (size_t)reloc->address + 2 > u->end) {
+                error_invalid_file_format(object->file_name);
+            }
+            LinkReloc link_reloc = { reloc->address - u->begin, reloc->kind, unit, symbol };
+            vector_push_back(linker->relocs, link_reloc);
+        }
+    }
+    qsort(linker->relocs, vector_size(linker->relocs), sizeof(LinkReloc), compare_relocs);
+    for (size_t i = 0; i < vector_size(linker->relocs); i++) {
+        Unit *unit = &linker->units[linker->relocs[i].unit];
+        if (unit->reloc_count++ == 0) {
+            unit->first_reloc = i;
+        }
+    }
+}
+
+void linker_resolve(Linker *linker) {
+    define_symbols(linker);
+    for (size_t i = 0; i < vector_size(linker->modules); i++) {
+        split_module(linker, i);
+    }
+    bind_relocs(linker);
+}
+
+// ------------------------------------------------------------------------------------------------
+// Layout
+
+// Marks the units reachable from root and appends them to reached in depth-first order
+static void walk(Linker *linker, size_t root, vector(size_t) *reached) {
+    vector(size_t) stack = NULL;
+    vector_push_back(stack, root);
+    while (!vector_empty(stack)) {
+        size_t index = stack[vector_size(stack) - 1];
+        __vector_set_size(stack, vector_size(stack) - 1);
+        Unit *unit = &linker->units[index];
+        if (unit->is_kept) {
+            continue;
+        }
+        unit->is_kept = true;
+        vector_push_back(*reached, index);
+        // Reversed, so that the first name the unit uses is walked first
+        for (size_t i = unit->reloc_count; i-- > 0;) {
+            LinkReloc *reloc = &linker->relocs[unit->first_reloc + i];
+            size_t target = linker->symbols[reloc->symbol].unit;
+            if (reloc->kind == RELOC_ADDRESS && !linker->units[target].is_kept) {
+                vector_push_back(stack, target);
+            }
+        }
+    }
+    free_vector(&stack);
+}
+
+static void place(Linker *linker, size_t unit) {
+    Unit *u = &linker->units[unit];
+    u->address = linker->size;
+    linker->size += u->end - u->begin;
+    vector_push_back(linker->layout, unit);
+}
+
+// Words go to even addresses. A padding byte is taken by data of an odd size without words when
+// there is one, so the data hardly grows
+static void place_data(Linker *linker, vector(size_t) reached) {
+    vector(size_t) even_words = NULL;
+    vector(size_t) odd_words = NULL;
+    vector(size_t) odd_bytes = NULL;
+    vector(size_t) bytes = NULL;
+    foreach(size_t, index, reached) {
+        Unit *unit = &linker->units[*index];
+        bool is_odd = (unit->end - unit->begin) % 2;
+        if (unit->alignment == 2 && is_odd) {
+            vector_push_back(odd_words, *index);
+        } else if (unit->alignment == 2) {
+            vector_push_back(even_words, *index);
+        } else if (unit->alignment == 1 && is_odd) {
+            vector_push_back(odd_bytes, *index);
+        } else if (unit->alignment == 1) {
+            vector_push_back(bytes, *index);
+        }
+    }
+    size_t next_odd_byte = 0;
+    vector(size_t) word_units[] = { even_words, odd_words };
+    for (size_t i = 0; i < 2; i++) {
+        foreach(size_t, index, word_units[i]) {
+            if (linker->size % 2 && next_odd_byte < vector_size(odd_bytes)) {
+                place(linker, odd_bytes[next_odd_byte++]);
+            }
+            linker->size += linker->size % 2;
+            place(linker, *index);
+        }
+    }
+    for (size_t i = next_odd_byte; i < vector_size(odd_bytes); i++) {
+        place(linker, odd_bytes[i]);
+    }
+    foreach(size_t, index, bytes) {
+        place(linker, *index);
+    }
+    free_vector(&even_words);
+    free_vector(&odd_words);
+    free_vector(&odd_bytes);
+    free_vector(&bytes);
+}
+
+void linker_layout(Linker *linker, bool keep_all) {
+    size_t *entry = hashmap_get(linker->table.index, ENTRY_POINT_NAME);
+    if (!entry) {
+        error_no_entry();
+    }
+    vector(size_t) reached = NULL;
+    walk(linker, linker->symbols[*entry].unit, &reached);
+    if (keep_all) {
+        for (size_t i = 0; i < vector_size(linker->units); i++) {
+            walk(linker, i, &reached);
+        }
+    }
+    place_data(linker, reached);
+    foreach(size_t, index, reached) {
+        if (linker->units[*index].alignment == 0) {
+            place(linker, *index);
+        }
+    }
+    free_vector(&reached);
+    if (linker->size > 1 << NUMBER_BIT_SIZE) {
+        error_too_big_program(linker->size);
+    }
+}
+
+// ------------------------------------------------------------------------------------------------
+// Emitting
+
+// Takes the section by value, so the vector it was built in never has its address taken
+static void add_section(ExecFile *ef, const char *name, vector(byte) section) {
+    if (!vector_empty(section)) {
+        execfile_add_section(ef, name, section);
+    }
+    free_vector(&section);
+}
+
+static void compile_program(Linker *linker, ExecFile *ef) {
+    vector(byte) image = NULL;
+    vector_reserve(image, max(linker->size, 1));
+    __vector_set_size(image, linker->size);
+    memset(image, 0, linker->size);
+    foreach(size_t, index, linker->layout) {
+        Unit *unit = &linker->units[*index];
+        const byte *program = linker->modules[unit->module].object.program.data;
+        memcpy(image + unit->address, program + unit->begin, unit->end - unit->begin);
+        for (size_t i = unit->first_reloc; i < unit->first_reloc + unit->reloc_count; i++) {
+            LinkReloc *reloc = &linker->relocs[i];
+            object_patch_reloc(image + unit->address + reloc->offset, reloc->kind,
+                               linker_symbol_address(*linker, reloc->symbol),
+                               linker->symbols[reloc->symbol].size);
+        }
+    }
+    add_section(ef, "program", image);
+}
+
+static void compile_symbol_table(Linker *linker, ExecFile *ef) {
+    vector(byte) symbols = NULL;
+    for (size_t i = 0; i < vector_size(linker->symbols); i++) {
+        LinkSymbol *symbol = &linker->symbols[i];
+        if (!linker->units[symbol->unit].is_kept) {
+            continue;
+        }
+        for (size_t j = 0; j < strlen(symbol->name) + 1; j++) {
+            vector_push_back(symbols, symbol->name[j]);
+        }
+        vector_push_word_back(symbols, linker_symbol_address(*linker, i));
+    }
+    add_section(ef, "symbols", symbols);
+}
+
+ExecFile linker_emit(Linker *linker) {
+    ExecFile ef = new_execfile();
+    vector(byte) directives = NULL;
+    foreach(Module, module, linker->modules) {
+        ef.version = max(ef.version, module->object.file.version);
+        SectionView view = module->object.directives;
+        for (size_t i = 0; i < view.size; i++) {
+            vector_push_back(directives, view.data[i]);
+        }
+    }
+    add_section(&ef, "directives", directives);
+    compile_program(linker, &ef);
+    compile_symbol_table(linker, &ef);
+    return ef;
+}
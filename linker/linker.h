@@ -0,0 +1,66 @@
+#ifndef __LINK_LINKER_H
+#define __LINK_LINKER_H
+
+#include "common/object.h"
+#include "common/sex.h"
+#include "common/vector.h"
+
+// What the layout moves and drops as a whole: a data label, or code labels that fall through into
+// each other. Code reaches a label only through its name, so nothing else has to stay together
+typedef struct {
+    size_t module;
+    size_t begin, end; // In the "program" of the object
+    byte alignment;   // 0 for code
+    size_t first_reloc, reloc_count; // In Linker.relocs, ordered by address
+    bool is_kept;     // Reachable from the entry point
+    size_t address;   // In the image
+} Unit;
+
+typedef struct {
+    const char *name;
+    size_t module;
+    size_t unit;
+    word offset;      // From the beginning of the unit
+    word size;        // Of data labels
+    byte alignment;   // 0 for code
+} LinkSymbol;
+
+typedef struct {
+    word offset;      // From the beginning of the unit
+    RelocKind kind;
+    size_t unit;
+    size_t symbol;    // In Linker.symbols
+} LinkReloc;
+
+typedef struct {
+    Object object;
+    size_t first_symbol; // Its labels are the symbols that follow in Linker.symbols
+    size_t first_unit, unit_count;
+} Module;
+
+typedef struct {
+    vector(Module) modules;
+    vector(LinkSymbol) symbols;
+    ObjectSymbolTable table; // In the order of symbols
+    vector(Unit) units;
+    vector(LinkReloc) relocs;
+    vector(size_t) layout; // Kept units, in the order they are placed
+    size_t size;           // Of the image
+} Linker;
+
+// Takes the objects
+Linker new_linker(vector(Object) objects);
+void free_linker(void *linker);
+
+// Splits the objects into units and binds every used name to its definition
+void linker_resolve(Linker *linker);
+// Keeps the units reachable from the entry point, or all of them if keep_all is set. The data goes
+// first, with its words at even addresses, then the code in the order a depth-first walk of the
+// call graph from the entry point meets it, so that callees follow their first caller
+void linker_layout(Linker *linker, bool keep_all);
+// The executable, the same as the one sasm makes of the same sources but for the layout
+ExecFile linker_emit(Linker *linker);
+
+size_t linker_symbol_address(Linker linker, size_t symbol);
+
+#endif
@@ -0,0 +1,86 @@
+#define VECTOR_IMPLEMENTATION
+#define STR_IMPLEMENTATION
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "io.h"
+#include "linker.h"
+#include "common/vector.h"
+#include "common/sex.h"
+#include "common/object.h"
+
+char *OUTPUT_FILE_NAME = "a.out";
+bool SHOW_LAYOUT = false;
+bool KEEP_ALL = false;
+bool ENABLE_COLORS = true;
+
+void print_help(const char *name);
+
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+        print_help(argv[0]);
+        return 0;
+    }
+    vector(const char *) input_files = NULL;
+
+    int res = 0;
+    while ( (res = getopt(argc, argv, "hikno:")) != -1 ) {
+        switch (res) {
+            case 'h': print_help(argv[0]); return 0;
+            case 'i': SHOW_LAYOUT = true; break;
+            case 'k': KEEP_ALL = true; break;
+            case 'n': ENABLE_COLORS = false; break;
+            case 'o': OUTPUT_FILE_NAME = optarg; break;
+            case '?': return 1;
+        }
+    }
+    while (optind < argc)
+        vector_push_back(input_files, argv[optind++]);
+
+    if (vector_size(input_files) == 0) {
+        error_no_input_file();
+    }
+
+    vector(Object) objects = NULL;
+    foreach(const char *, filename, input_files) {
+        if (access(*filename, R_OK) != 0) {
+            error_file_doesnot_exist(*filename);
+        }
+        Object object;
+        if (!object_read(*filename, &object)) {
+            error_invalid_file_format(*filename);
+        }
+        vector_push_back(objects, object);
+    }
+
+    Linker linker = new_linker(objects);
+    linker_resolve(&linker);
+    linker_layout(&linker, KEEP_ALL);
+    ExecFile output = linker_emit(&linker);
+    if (SHOW_LAYOUT) {
+        print_layout(linker);
+    }
+    execfile_write(output, OUTPUT_FILE_NAME);
+
+    free_execfile(&output);
+    free_linker(&linker);
+    free_vector(&objects);
+    free_vector(&input_files);
+
+    return 0;
+}
+
+void print_help(const char *name) {
+    printf("%s - a linker for objects made with `sasm -c`.\n", name);
+    printf("Usage: %s [options] object...\n", name);
+    printf("Only the labels that the entry point reaches are kept. The data is packed so that its\n");
+    printf("words are at even addresses, the code follows the call graph from the entry point.\n");
+    printf("Options:\n");
+    printf("  -h          Prints this message and exit\n");
+    printf("  -o <file>   Places output to <file>\n");
+    printf("  -i          Prints where every label is placed\n");
+    printf("  -k          Keeps the labels the entry point does not reach\n");
+    printf("  -n          Disables colors in output\n");
+}
@@ -0,0 +1,397 @@
+#include "batch.h"
+#include "machine.h"
+#include "io.h"
+#include "common/io.h"
+#include "common/sex.h"
+#include "common/utils.h"
+#include <limits.h>
+#include <pthread.h>
+#include <setjmp.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define CACHE_LINE_SIZE 64
+
+// ------------------------------------------------------------------------------------------------
+// Work-stealing deque (Chase-Lev). The owner pops from the bottom, other workers steal from the top.
+// Every job is pushed before the workers are started, so the buffer never grows and an empty deque
+// stays empty
+
+typedef struct {
+    _Alignas(CACHE_LINE_SIZE) _Atomic int64_t top;
+    _Alignas(CACHE_LINE_SIZE) _Atomic int64_t bottom;
+    size_t *jobs;
+} Deque;
+
+typedef enum {
+    STEAL_SUCCESS,
+    STEAL_EMPTY,
+    STEAL_LOST, // Another worker took the job first, the deque may still have some
+} StealResult;
+
+static void deque_push(Deque *d, size_t job) {
+    int64_t b = atomic_load_explicit(&d->bottom, memory_order_relaxed);
+    d->jobs[b] = job;
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+}
+
+static bool deque_pop(Deque *d, size_t *job) {
+    int64_t b = atomic_load_explicit(&d->bottom, memory_order_relaxed) - 1;
+    atomic_store_explicit(&d->bottom, b, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    int64_t t = atomic_load_explicit(&d->top, memory_order_relaxed);
+    if (t > b) {
+        atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+        return false;
+    }
+    *job = d->jobs[b];
+    if (t == b) {
+        // The last job, thieves may be after it too
+        bool won = atomic_compare_exchange_strong_explicit(&d->top, &t, t + 1,
+                                                           memory_order_seq_cst, memory_order_relaxed);
+        atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+        return won;
+    }
+    return true;
+}
+
+static StealResult deque_steal(Deque *d, size_t *job) {
+    int64_t t = atomic_load_explicit(&d->top, memory_order_acquire);
+    atomic_thread_fence(memory_order_seq_cst);
+    int64_t b = atomic_load_explicit(&d->bottom, memory_order_acquire);
+    if (t >= b) {
+        return STEAL_EMPTY;
+    }
+    size_t stolen = d->jobs[t];
+    if (!atomic_compare_exchange_strong_explicit(&d->top, &t, t + 1,
+                                                 memory_order_seq_cst, memory_order_relaxed)) {
+        return STEAL_LOST;
+    }
+    *job = stolen;
+    return STEAL_SUCCESS;
+}
+
+// ------------------------------------------------------------------------------------------------
+
+typedef struct {
+    string program;
+    ExecFile exec_file;
+} CachedProgram;
+
+static void free_cached_program(void *cached) {
+    CachedProgram *p = (CachedProgram *)cached;
+    free_string(&p->program);
+    free_execfile(&p->exec_file);
+}
+
+typedef struct Batch Batch;
+
+typedef struct {
+    Deque deque;
+    VM vm;
+    vector(CachedProgram) cache;
+    Batch *batch;
+    size_t id;
+    size_t succeeded;
+    VMStats stats; // Of every job this worker ran
+    pthread_t thread;
+} Worker;
+
+struct Batch {
+    const char *jobs_file;
+    vector(BatchJob) jobs;
+    BatchOptions options;
+    Worker *workers;
+    size_t worker_count;
+};
+
+static void free_batch_job(void *job) {
+    BatchJob *j = (BatchJob *)job;
+    free_string(&j->program);
+    if (j->dump_file) {
+        free_string(&j->dump_file);
+    }
+}
+
+static vector(BatchJob) read_jobs(const char *jobs_file) {
+    vector(BatchJob) jobs = NULL;
+    vector_set_destructor(jobs, free_batch_job);
+    char *content = read_whole_file(jobs_file);
+    char *save_line;
+    for (char *line = strtok_r(content, "\n", &save_line); line; line = strtok_r(NULL, "\n", &save_line)) {
+        char *save_word;
+        char *program = strtok_r(line, " \t\r", &save_word);
+        if (!program || *program == '#') {
+            continue;
+        }
+        char *dump_file = strtok_r(NULL, " \t\r", &save_word);
+        BatchJob job = { new_string(program), dump_file ? new_string(dump_file) : NULL };
+        vector_push_back(jobs, job);
+    }
+    free(content);
+    return jobs;
+}
+
+static ExecFile *cached_program(Worker *w, const char *program) {
+    foreach(CachedProgram, p, w->cache) {
+        if (strcmp(p->program, program) == 0) {
+            return &p->exec_file;
+        }
+    }
+    ExecFile exec_file;
+    if (!execfile_read(program, &exec_file)) {
+        error_invalid_program(&w->vm);
+    }
+    if (vector_size(w->cache) >= BATCH_CACHE_SIZE) {
+        vector_erase(w->cache, 0);
+    }
+    CachedProgram p = { new_string(program), exec_file };
+    vector_push_back(w->cache, p);
+    return &w->cache[vector_size(w->cache) - 1].exec_file;
+}
+
+static bool next_job(Worker *w, size_t *job) {
+    if (deque_pop(&w->deque, job)) {
+        return true;
+    }
+    Batch *batch = w->batch;
+    bool lost;
+    do {
+        lost = false;
+        for (size_t i = 1; i < batch->worker_count; i++) {
+            Worker *victim = &batch->workers[(w->id + i) % batch->worker_count];
+            StealResult res = deque_steal(&victim->deque, job);
+            if (res == STEAL_SUCCESS) {
+                return true;
+            }
+            lost |= res == STEAL_LOST;
+        }
+    } while (lost);
+    return false;
+}
+
+static void *worker_run(void *arg) {
+    Worker *w = (Worker *)arg;
+    Batch *batch = w->batch;
+    jmp_buf on_error;
+
+    w->vm = new_vm();
+    w->vm.input_file = batch->jobs_file;
+    w->vm.on_error = &on_error;
+    w->vm.private_devices = true;
+    if (batch->options.enable_jit) {
+        w->vm.jit = new_jit();
+    }
+    // A worker without its devices cannot run anything, so it leaves its jobs to the others
+    if (setjmp(on_error) != 0) {
+        free_vm(&w->vm);
+        free_vector(&w->cache);
+        return NULL;
+    }
+    foreach(DeviceFileAndPort, dev, batch->options.devices) {
+        vm_load_device(&w->vm, dev->device_file, dev->port_id);
+    }
+
+    size_t job;
+    volatile bool last_succeeded = false; // Survives the longjmp of a failed job
+    while (next_job(w, &job)) {
+        BatchJob *j = &batch->jobs[job];
+        last_succeeded = false;
+        w->vm.input_file = j->program;
+        w->vm.dump_file = j->dump_file;
+        if (setjmp(on_error) == 0) {
+            vm_load_execfile(&w->vm, *cached_program(w, j->program));
+            vm_run(&w->vm);
+            vm_stats_add(&w->stats, &w->vm.stats);
+            if (j->dump_file) {
+                dump_vm(w->vm, j->dump_file);
+            }
+            // Devices that failed to close only mark the VM, as in a single run
+            if (!w->vm.failed) {
+                w->succeeded++;
+                last_succeeded = true;
+            }
+        }
+    }
+    free_vm(&w->vm);
+    // The devices of the command line are closed after the last job, which fails if one of them
+    // cannot be closed
+    if (w->vm.failed && last_succeeded) {
+        w->succeeded--;
+    }
+    free_vector(&w->cache);
+    return NULL;
+}
+
+static double seconds_since(struct timespec start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start.tv_sec) + (now.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+size_t run_batch(const char *jobs_file, BatchOptions options) {
+    Batch batch = { jobs_file, read_jobs(jobs_file), options, NULL, options.workers };
+    size_t job_count = vector_size(batch.jobs);
+    if (batch.worker_count == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        batch.worker_count = cpus > 0 ? cpus : 1;
+    }
+    batch.worker_count = max(1, min(batch.worker_count, job_count));
+
+    size_t jobs_per_worker = (job_count + batch.worker_count - 1) / batch.worker_count;
+    batch.workers = aligned_alloc(CACHE_LINE_SIZE, batch.worker_count * sizeof(Worker));
+    memset(batch.workers, 0, batch.worker_count * sizeof(Worker));
+    for (size_t i = 0; i < batch.worker_count; i++) {
+        Worker *w = &batch.workers[i];
+        w->batch = &batch;
+        w->id = i;
+        w->deque.jobs = malloc(max(1, jobs_per_worker) * sizeof(size_t));
+        vector_set_destructor(w->cache, free_cached_program);
+    }
+    for (size_t job = 0; job < job_count; job++) {
+        deque_push(&batch.workers[job % batch.worker_count].deque, job);
+    }
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (size_t i = 0; i < batch.worker_count; i++) {
+        pthread_create(&batch.workers[i].thread, NULL, worker_run, &batch.workers[i]);
+    }
+    size_t succeeded = 0;
+    VMStats stats = { 0 };
+    for (size_t i = 0; i < batch.worker_count; i++) {
+        pthread_join(batch.workers[i].thread, NULL);
+        succeeded += batch.workers[i].succeeded;
+        vm_stats_add(&stats, &batch.workers[i].stats);
+    }
+    double elapsed = seconds_since(start);
+
+    size_t failed = job_count - succeeded;
+    fprintf(stderr, "%zu jobs, %zu failed, %zu workers, %.3f s (%.1f jobs/s)\n",
+            job_count, failed, batch.worker_count, elapsed, elapsed > 0 ? job_count / elapsed : 0.0);
+    if (options.show_stats) {
+        print_vm_stats(&stats);
+    }
+
+    for (size_t i = 0; i < batch.worker_count; i++) {
+        free(batch.workers[i].deque.jobs);
+    }
+    free(batch.workers);
+    free_vector(&batch.jobs);
+    return failed;
+}
+
+// ------------------------------------------------------------------------------------------------
+// Forks of one snapshot
+
+typedef struct {
+    const VMSnapshot *snapshot;
+    _Atomic size_t next; // The next fork to run
+    size_t count;
+} Forks;
+
+typedef struct {
+    _Alignas(CACHE_LINE_SIZE) Forks *forks;
+    pthread_t thread;
+    VM vm;
+    size_t succeeded;
+    double spawn_time; // Spent in vm_fork
+    VMStats stats;
+} ForkWorker;
+
+static void *fork_worker_run(void *arg) {
+    ForkWorker *w = (ForkWorker *)arg;
+    Forks *forks = w->forks;
+    jmp_buf on_error;
+    char dump_file[PATH_MAX];
+
+    size_t fork;
+    while ((fork = atomic_fetch_add(&forks->next, 1)) < forks->count) {
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        w->vm.on_error = &on_error;
+        volatile bool ran = false;
+        if (setjmp(on_error) == 0) {
+            vm_fork(forks->snapshot, &w->vm);
+            w->spawn_time += seconds_since(start);
+            // Forks of one program fail at the same time, so every one of them gets its own dump
+            snprintf(dump_file, sizeof(dump_file), "%s.%zu.dump", forks->snapshot->input_file, fork);
+            w->vm.dump_file = dump_file;
+            vm_run(&w->vm);
+            vm_stats_add(&w->stats, &w->vm.stats);
+            ran = true;
+        }
+        // The JIT goes to the next fork
+        Jit *jit = w->vm.jit;
+        w->vm.jit = NULL;
+        free_vm(&w->vm);
+        w->vm.jit = jit;
+        // Its devices are closed by free_vm, which marks the VM if one of them fails
+        if (ran && !w->vm.failed) {
+            w->succeeded++;
+        }
+    }
+    free_jit(w->vm.jit);
+    return NULL;
+}
+
+size_t run_forks(const char *program, size_t count, BatchOptions options) {
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    VM vm = new_vm();
+    if (options.enable_jit) {
+        vm.jit = new_jit();
+    }
+    vm_load(&vm, program);
+    foreach(DeviceFileAndPort, dev, options.devices) {
+        vm_load_device(&vm, dev->device_file, dev->port_id);
+    }
+    double load_time = seconds_since(start);
+    VMSnapshot snapshot = vm_snapshot(&vm);
+    free_vm(&vm);
+
+    Forks forks = { &snapshot, 0, count };
+    size_t worker_count = options.workers;
+    if (worker_count == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        worker_count = cpus > 0 ? cpus : 1;
+    }
+    worker_count = max(1, min(worker_count, count));
+    ForkWorker *workers = aligned_alloc(CACHE_LINE_SIZE, worker_count * sizeof(ForkWorker));
+    memset(workers, 0, worker_count * sizeof(ForkWorker));
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (size_t i = 0; i < worker_count; i++) {
+        workers[i].forks = &forks;
+        pthread_create(&workers[i].thread, NULL, fork_worker_run, &workers[i]);
+    }
+    size_t succeeded = 0;
+    double spawn_time = 0;
+    VMStats stats = { 0 };
+    for (size_t i = 0; i < worker_count; i++) {
+        pthread_join(workers[i].thread, NULL);
+        succeeded += workers[i].succeeded;
+        spawn_time += workers[i].spawn_time;
+        vm_stats_add(&stats, &workers[i].stats);
+    }
+    double elapsed = seconds_since(start);
+
+    size_t failed = count - succeeded;
+    fprintf(stderr, "%zu forks, %zu failed, %zu workers, %.3f s (%.1f forks/s)\n",
+            count, failed, worker_count, elapsed, elapsed > 0 ? count / elapsed : 0.0);
+    fprintf(stderr, "Load: %.1f us, fork: %.1f us on average\n", load_time * 1e6,
+            count > 0 ? spawn_time / count * 1e6 : 0.0);
+    if (options.show_stats) {
+        print_vm_stats(&stats);
+    }
+
+    free(workers);
+    free_snapshot(&snapshot);
+    return failed;
+}
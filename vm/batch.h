@@ -0,0 +1,34 @@
+#ifndef __VM_BATCH_H
+#define __VM_BATCH_H
+
+#include "common/str.h"
+#include "common/vector.h"
+#include "vm/device.h"
+#include <stddef.h>
+
+// Programs that were loaded by a worker recently are not read from the disk again
+#define BATCH_CACHE_SIZE 16
+
+// One line of the jobs file: `program [dump_file]`. Empty lines and lines starting with # are skipped
+typedef struct {
+    string program;
+    string dump_file; // NULL if the VM is not dumped
+} BatchJob;
+
+typedef struct {
+    vector(DeviceFileAndPort) devices; // Attached to the VM of every worker
+    bool enable_jit;
+    size_t workers; // 0 means one per CPU
+    bool show_stats; // Print the stats of all jobs together
+} BatchOptions;
+
+// Runs every job of jobs_file on a pool of workers, each of them reusing its VM between jobs.
+// Returns the number of jobs that failed
+size_t run_batch(const char *jobs_file, BatchOptions options);
+
+// Loads the program and attaches the devices once, snapshots the VM and runs count forks of the
+// snapshot on the workers. Prints how long the load and a fork took. Returns the number of forks
+// that failed
+size_t run_forks(const char *program, size_t count, BatchOptions options);
+
+#endif
@@ -0,0 +1,111 @@
+#include "machine.h"
+#include "callgraph.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+CallGraph *new_callgraph(const VM *vm) {
+    CallGraph *graph = calloc(1, sizeof(CallGraph));
+    graph->self = calloc(MEMORY_SIZE, sizeof(unsigned long));
+    graph->edge_index_capacity = 64;
+    graph->edge_index = calloc(graph->edge_index_capacity, sizeof(size_t));
+    graph->stack[0] = (CallFrame) { vm->registers[REG_IP], 0, 0, 0, 0 };
+    graph->depth = 1;
+    return graph;
+}
+
+void free_callgraph(CallGraph *graph) {
+    if (!graph) {
+        return;
+    }
+    free(graph->self);
+    free(graph->edge_index);
+    free_vector(&graph->edges);
+    free(graph);
+}
+
+static size_t hash_edge(word caller, word site, word callee) {
+    uint32_t key = ((uint32_t)caller * 31 + site) * 31 + callee;
+    return key * 2654435761u;
+}
+
+static size_t *find_edge_slot(CallGraph *graph, word caller, word site, word callee) {
+    size_t mask = graph->edge_index_capacity - 1;
+    for (size_t i = hash_edge(caller, site, callee) & mask;; i = (i + 1) & mask) {
+        size_t *slot = &graph->edge_index[i];
+        if (*slot == 0) {
+            return slot;
+        }
+        CallEdge *e = &graph->edges[*slot - 1];
+        if (e->caller == caller && e->site == site && e->callee == callee) {
+            return slot;
+        }
+    }
+}
+
+static size_t get_edge(CallGraph *graph, word caller, word site, word callee) {
+    size_t *slot = find_edge_slot(graph, caller, site, callee);
+    if (*slot != 0) {
+        return *slot - 1;
+    }
+    if (2 * (vector_size(graph->edges) + 1) > graph->edge_index_capacity) {
+        free(graph->edge_index);
+        graph->edge_index_capacity *= 2;
+        graph->edge_index = calloc(graph->edge_index_capacity, sizeof(size_t));
+        for (size_t i = 0; i < vector_size(graph->edges); i++) {
+            CallEdge *e = &graph->edges[i];
+            *find_edge_slot(graph, e->caller, e->site, e->callee) = i + 1;
+        }
+        slot = find_edge_slot(graph, caller, site, callee);
+    }
+    CallEdge edge = { caller, site, callee, 0, 0 };
+    vector_push_back(graph->edges, edge);
+    *slot = vector_size(graph->edges);
+    return *slot - 1;
+}
+
+// Gives the instructions since the last switch to the function on top of the stack
+static void charge_top(CallGraph *graph) {
+    CallFrame *top = &graph->stack[graph->depth - 1];
+    graph->self[top->function] += graph->cost - top->mark;
+    top->mark = graph->cost;
+}
+
+static void pop_frame(CallGraph *graph) {
+    charge_top(graph);
+    CallFrame *frame = &graph->stack[--graph->depth];
+    graph->edges[frame->edge].inclusive += graph->cost - frame->entry_cost;
+    graph->stack[graph->depth - 1].mark = graph->cost;
+}
+
+void callgraph_call(CallGraph *graph, word site, word callee, word return_addr) {
+    if (graph->depth == CALLGRAPH_MAX_DEPTH) {
+        return; // The stack overflows right after this
+    }
+    charge_top(graph);
+    size_t edge = get_edge(graph, graph->stack[graph->depth - 1].function, site, callee);
+    graph->edges[edge].calls++;
+    graph->stack[graph->depth++] = (CallFrame) { callee, return_addr, edge, graph->cost, graph->cost };
+}
+
+void callgraph_ret(CallGraph *graph, word return_addr) {
+    // A program may drop return addresses from its stack, so frames that cannot be returned to
+    // are closed as well
+    size_t depth = graph->depth;
+    while (depth > 1 && graph->stack[depth - 1].return_addr != return_addr) {
+        depth--;
+    }
+    if (depth == 1) {
+        depth = graph->depth; // Not a return from a known call, close a single frame
+    }
+    while (graph->depth > 1 && graph->depth >= depth) {
+        pop_frame(graph);
+    }
+}
+
+void callgraph_finish(CallGraph *graph) {
+    while (graph->depth > 1) {
+        pop_frame(graph);
+    }
+    charge_top(graph);
+}
@@ -0,0 +1,50 @@
+#ifndef __VM_CALLGRAPH_H
+#define __VM_CALLGRAPH_H
+
+#include "common/arch.h"
+#include "common/vector.h"
+#include <stddef.h>
+
+// More than the stack of a program can hold return addresses
+#define CALLGRAPH_MAX_DEPTH 256
+
+// Calls from one call site to one function
+typedef struct {
+    word caller; // Address of the calling function
+    word site;   // Address of the `call`
+    word callee;
+    unsigned long calls;
+    unsigned long inclusive; // Instructions executed until the calls returned
+} CallEdge;
+
+typedef struct {
+    word function;
+    word return_addr;
+    size_t edge;              // Index in CallGraph.edges, unused by the entry frame
+    unsigned long entry_cost; // CallGraph.cost when the function was called
+    unsigned long mark;       // CallGraph.cost when the function got the control last time
+} CallFrame;
+
+typedef struct {
+    unsigned long cost; // Instructions executed so far
+    unsigned long *self; // Instructions executed by every function, indexed by its address
+    vector(CallEdge) edges;
+    size_t *edge_index; // Open addressing over edges, holds index + 1
+    size_t edge_index_capacity;
+    CallFrame stack[CALLGRAPH_MAX_DEPTH];
+    size_t depth;
+} CallGraph;
+
+struct VM;
+
+// Starts with the function at the current ip of vm
+CallGraph *new_callgraph(const struct VM *vm);
+void free_callgraph(CallGraph *graph);
+
+// Called by `call` and `ret`, after cost is incremented for them
+void callgraph_call(CallGraph *graph, word site, word callee, word return_addr);
+void callgraph_ret(CallGraph *graph, word return_addr);
+// Closes every frame as if the functions returned now
+void callgraph_finish(CallGraph *graph);
+
+#endif
@@ -0,0 +1,187 @@
+#include "decoder.h"
+#include "machine.h"
+#include <stdint.h>
+#include <string.h>
+
+static uint64_t read_ulong_as_big_endian(const byte *memory, size_t available) {
+    uint64_t buffer = 0;
+    for (size_t i = 0; i < sizeof(uint64_t); i++) {
+        buffer <<= 8;
+        if (i < available) {
+            buffer |= memory[i];
+        }
+    }
+    return buffer;
+}
+
+static word read_bits(uint64_t *buffer, size_t *read_bits_count, size_t size) {
+    word data = (*buffer >> (sizeof(uint64_t) - sizeof(word)) * 8);
+    data >>= sizeof(word) * 8 - size;
+    *buffer <<= size;
+    *read_bits_count += size;
+    return data;
+}
+#define read_register(buffer, read_count)  read_bits(buffer, read_count, REGISTER_BIT_SIZE)
+#define read_flag(buffer, read_count)      read_bits(buffer, read_count, 1)
+#define read_number(buffer, read_count)    read_bits(buffer, read_count, NUMBER_BIT_SIZE)
+#define read_byte(buffer, read_count)      read_bits(buffer, read_count, 8)
+#define skip_alignment(buffer, read_count, alignment)  read_bits(buffer, read_count, alignment)
+
+static word sign_extend(word value, size_t bits) {
+    word sign = 1 << (bits - 1);
+    return (value ^ sign) - sign;
+}
+#define read_signed(buffer, read_count, size) \
+    sign_extend(read_bits(buffer, read_count, size), size)
+
+// The immediate of <reg>, <imm>, see common/arch.h for its forms
+static word read_reg_imm(uint64_t *buffer, size_t *read_bits_count) {
+    if (read_flag(buffer, read_bits_count)) {
+        return read_signed(buffer, read_bits_count, IMM_SHORT_BITS);
+    }
+    if (read_flag(buffer, read_bits_count)) {
+        return read_signed(buffer, read_bits_count, IMM_MEDIUM_BITS);
+    }
+    skip_alignment(buffer, read_bits_count, 4);
+    return read_number(buffer, read_bits_count);
+}
+
+// An immediate of in/out
+static word read_io_imm(uint64_t *buffer, size_t *read_bits_count) {
+    if (read_flag(buffer, read_bits_count)) {
+        return read_signed(buffer, read_bits_count, IO_IMM_SHORT_BITS);
+    }
+    return read_number(buffer, read_bits_count);
+}
+
+// Reads <reg/imm> operand with index idx, read_imm reads the immediate in all of its forms
+static void decode_operand(DecodedInstr *instr, uint64_t *buffer, size_t *read_bits_count,
+                           bool is_imm, size_t idx, word (*read_imm)(uint64_t *, size_t *))
+{
+    if (is_imm) {
+        instr->kinds |= OPERAND_IMM(idx);
+        instr->imm[idx - 1] = read_imm(buffer, read_bits_count);
+    } else {
+        instr->reg[idx] = read_register(buffer, read_bits_count);
+    }
+}
+
+static byte decode_handler(DecodedInstr instr) {
+    byte used_regs = 0;
+    switch (instr_shape(instr.opcode)) {
+        case SHAPE_REG_ANY:
+            used_regs = 1 | (instr.kinds & OPERAND_IMM(1) ? 0 : 2);
+            break;
+        case SHAPE_REG:
+            used_regs = 1;
+            break;
+        case SHAPE_PORT_IO:
+            used_regs = (instr.kinds & OPERAND_IMM(1) ? 0 : 2) | (instr.kinds & OPERAND_IMM(2) ? 0 : 4);
+            break;
+        case SHAPE_NONE: case SHAPE_ADDR: case SHAPE_CMP_ADDR: case SHAPE_PORT:
+            break;
+        default:
+            return HANDLER_GENERIC;
+    }
+    // Fast paths keep ip outside of the register file, so everything that touches it goes the slow way
+    for (size_t i = 0; i < 3; i++) {
+        if ((used_regs & (1 << i)) && instr.reg[i] == REG_IP) {
+            return HANDLER_GENERIC;
+        }
+    }
+    return instr.opcode;
+}
+
+DecodedInstr decode_instr(const byte *memory, size_t memory_size, word addr) {
+    DecodedInstr instr;
+    memset(&instr, 0, sizeof(instr));
+    size_t available = addr < memory_size ? memory_size - addr : 0;
+    uint64_t buffer = read_ulong_as_big_endian(memory + addr, available);
+    size_t read_bits_count = 0;
+    instr.opcode = read_bits(&buffer, &read_bits_count, OPCODE_BIT_SIZE);
+
+    // <cmp>, <offset>, decodes to jif
+    if (instr.opcode == OPCODE_JIF_NEAR) {
+        instr.opcode = INSTR_JIF;
+        instr.aux = read_bits(&buffer, &read_bits_count, 3);
+        instr.imm[0] = addr + read_signed(&buffer, &read_bits_count, JIF_OFFSET_BITS);
+    } else switch (instr_shape(instr.opcode)) {
+        case SHAPE_REG_ANY: {
+            instr.reg[0] = read_register(&buffer, &read_bits_count);
+            bool flag = read_flag(&buffer, &read_bits_count);
+            decode_operand(&instr, &buffer, &read_bits_count, flag, 1, read_reg_imm);
+        }; break;
+
+        case SHAPE_REG:
+            instr.reg[0] = read_register(&buffer, &read_bits_count);
+            break;
+
+        // <addr>, or an offset from the instruction
+        case SHAPE_ADDR:
+            if (read_flag(&buffer, &read_bits_count)) {
+                instr.imm[0] = addr + read_signed(&buffer, &read_bits_count, JUMP_OFFSET_BITS);
+                break;
+            }
+            skip_alignment(&buffer, &read_bits_count, 2);
+            instr.imm[0] = read_number(&buffer, &read_bits_count);
+            break;
+
+        case SHAPE_CMP_ADDR:
+            instr.aux = read_bits(&buffer, &read_bits_count, 3);
+            instr.imm[0] = read_number(&buffer, &read_bits_count);
+            break;
+
+        case SHAPE_PORT_IO: {
+            instr.aux = read_byte(&buffer, &read_bits_count);
+            bool is_first_num = read_flag(&buffer, &read_bits_count);
+            bool is_second_num = read_flag(&buffer, &read_bits_count);
+            decode_operand(&instr, &buffer, &read_bits_count, is_first_num, 1, read_io_imm);
+            decode_operand(&instr, &buffer, &read_bits_count, is_second_num, 2, read_io_imm);
+        }; break;
+
+        case SHAPE_PORT:
+            instr.aux = read_byte(&buffer, &read_bits_count);
+            break;
+
+        default:
+            break;
+    }
+    instr.size = (read_bits_count + 7) / 8;
+    instr.handler = decode_handler(instr);
+    return instr;
+}
+
+byte fuse_instrs(DecodedInstr first, DecodedInstr second) {
+    // Both have to be on the fast path
+    if (first.handler != first.opcode || second.handler != second.opcode) {
+        return first.handler;
+    }
+    if (first.opcode == INSTR_CMP && second.opcode == INSTR_JIF)   return HANDLER_CMP_JIF;
+    if (first.opcode == INSTR_LD && second.opcode == INSTR_ADD)    return HANDLER_LD_ADD;
+    if (first.opcode == INSTR_PUSH && second.opcode == INSTR_PUSH) return HANDLER_PUSH_PUSH;
+    if (first.opcode == INSTR_PUSH && second.opcode == INSTR_CALL) return HANDLER_PUSH_CALL;
+    if (first.opcode == INSTR_POP && second.opcode == INSTR_POP)   return HANDLER_POP_POP;
+    return first.handler;
+}
+
+void fused_handler_opcodes(byte handler, byte *first, byte *second) {
+    switch (handler) {
+        case HANDLER_CMP_JIF:   *first = INSTR_CMP;  *second = INSTR_JIF;  break;
+        case HANDLER_LD_ADD:    *first = INSTR_LD;   *second = INSTR_ADD;  break;
+        case HANDLER_PUSH_PUSH: *first = INSTR_PUSH; *second = INSTR_PUSH; break;
+        case HANDLER_PUSH_CALL: *first = INSTR_PUSH; *second = INSTR_CALL; break;
+        case HANDLER_POP_POP:   *first = INSTR_POP;  *second = INSTR_POP;  break;
+        default:                *first = *second = 0; break;
+    }
+}
+
+const char *fused_handler_name(byte handler) {
+    switch (handler) {
+        case HANDLER_CMP_JIF:   return "cmp + jif";
+        case HANDLER_LD_ADD:    return "ld + add";
+        case HANDLER_PUSH_PUSH: return "push + push";
+        case HANDLER_PUSH_CALL: return "push + call";
+        case HANDLER_POP_POP:   return "pop + pop";
+        default:                return "[undefined]";
+    }
+}
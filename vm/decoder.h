@@ -0,0 +1,55 @@
+#ifndef __VM_DECODER_H
+#define __VM_DECODER_H
+
+#include "common/arch.h"
+
+// The longest instruction is `out`/`in` with two immediates (49 bits)
+#define INSTR_MAX_SIZE 7
+
+// Set in DecodedInstr.kinds when the operand with the given index is an immediate
+#define OPERAND_IMM(idx) (1 << (idx))
+
+// DecodedInstr.handler is either an opcode or one of these
+#define HANDLER_DECODE 0              // The record is not decoded yet
+#define HANDLER_GENERIC INSTR_COUNT   // Instructions the fast paths do not handle (e.g. `mov ip, r1`)
+#define HANDLER_HALT (INSTR_COUNT + 1) // Placed past the end of the program
+
+// Superinstructions. The record of the first instruction of a pair gets one of these,
+// the second instruction is read from its own record that follows
+#define HANDLER_CMP_JIF   (INSTR_COUNT + 2)
+#define HANDLER_LD_ADD    (INSTR_COUNT + 3)
+#define HANDLER_PUSH_PUSH (INSTR_COUNT + 4)
+#define HANDLER_PUSH_CALL (INSTR_COUNT + 5)
+#define HANDLER_POP_POP   (INSTR_COUNT + 6)
+#define HANDLER_COUNT     (INSTR_COUNT + 7)
+
+#define FUSED_FIRST HANDLER_CMP_JIF
+#define FUSED_COUNT (HANDLER_COUNT - FUSED_FIRST)
+
+// The most bytes a single record may cover (a fused pair)
+#define RECORD_MAX_SIZE (2 * INSTR_MAX_SIZE)
+
+// Fixed-size record produced from the raw instruction bytes at load time.
+// Operand 0 is always a register (if any), operands 1 and 2 are either a register or an immediate.
+// call, jmp and jif keep their address in imm[0].
+typedef struct {
+    byte opcode;
+    byte size;   // Length of the encoded instruction in bytes. 0 means "not decoded yet"
+    byte kinds;  // OPERAND_IMM bits
+    byte aux;    // Port id for in/out/wait, condition for jif
+    byte reg[3];
+    byte handler; // See HANDLER_*
+    word imm[2];
+} DecodedInstr;
+
+// Decodes the instruction at memory[addr]. Never reads past memory_size.
+// Unknown opcodes are decoded as 1-byte instructions, so it is up to the caller to report them.
+DecodedInstr decode_instr(const byte *memory, size_t memory_size, word addr);
+
+// Returns the superinstruction handler for the pair, or first.handler if they cannot be fused
+byte fuse_instrs(DecodedInstr first, DecodedInstr second);
+const char *fused_handler_name(byte handler);
+// Opcodes of the pair a superinstruction handler executes
+void fused_handler_opcodes(byte handler, byte *first, byte *second);
+
+#endif
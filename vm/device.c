@@ -1,31 +1,96 @@
 #include "device.h"
-#include "io.h"
 #include <dlfcn.h>
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
-static void check_dl_error(void *dl) {
-    const char *msg = dlerror();
-    if (msg) {
-        error_dl(dl, msg);
+// dlopen returns the same handle for the same file, so the copy gets a unique name.
+// The file is removed right after loading, the mapping stays alive
+static void *dlopen_private_copy(const char *filename) {
+    int src = open(filename, O_RDONLY);
+    if (src < 0) {
+        return dlopen(filename, RTLD_NOW); // Let dlopen report the error
     }
+    char path[] = "/tmp/svm-device-XXXXXX";
+    int dst = mkstemp(path);
+    if (dst < 0) {
+        close(src);
+        return NULL;
+    }
+    byte buffer[4096];
+    ssize_t count;
+    while ((count = read(src, buffer, sizeof(buffer))) > 0) {
+        if (write(dst, buffer, count) != count) {
+            count = -1;
+            break;
+        }
+    }
+    close(src);
+    close(dst);
+    void *dl = count == 0 ? dlopen(path, RTLD_NOW | RTLD_LOCAL) : NULL;
+    unlink(path);
+    return dl;
+}
+
+const char *new_device(const char *filename, bool private_copy, Device *dev) {
+    void *dl = private_copy ? dlopen_private_copy(filename) : dlopen(filename, RTLD_NOW);
+    if (!dl) {
+        const char *msg = dlerror();
+        return msg ? msg : "cannot copy the device";
+    }
+    *dev = (Device) { 0 };
+    dev->dl = dl;
+    dev->filename = strdup(filename);
+    dev->refs = malloc(sizeof(unsigned));
+    atomic_init(dev->refs, 1);
+    // v2 devices replace init, read and write with init_async and notify
+    dev->init_async = dlsym(dl, "init_async");
+    dlerror();
+    bool is_async = dev->init_async != NULL;
+    struct { const char *name; void **func; bool required; } symbols[] = {
+        { "fini",   (void **)&dev->fini,   true },
+        { "init",   (void **)&dev->init,   !is_async },
+        { "read",   (void **)&dev->read,   !is_async },
+        { "write",  (void **)&dev->write,  !is_async },
+        { "notify", (void **)&dev->notify, is_async },
+        { "share",  (void **)&dev->share,  false },
+    };
+    for (size_t i = 0; i < sizeof(symbols) / sizeof(symbols[0]); i++) {
+        *symbols[i].func = dlsym(dl, symbols[i].name);
+        const char *msg = dlerror();
+        if (msg && symbols[i].required) {
+            // The message does not survive dlclose
+            static _Thread_local char error[256];
+            snprintf(error, sizeof(error), "%s", msg);
+            free_device(dev);
+            return error;
+        }
+    }
+    return NULL;
 }
 
-Device new_device(const char *filename) {
-    void *dl = dlopen(filename, RTLD_NOW);
-    if (!dl)
-        error_dl(dl, dlerror());
-    InitFunc *init = dlsym(dl, "init");
-    check_dl_error(dl);
-    FiniFunc *fini = dlsym(dl, "fini");
-    check_dl_error(dl);
-    ReadFunc *read = dlsym(dl, "read");
-    check_dl_error(dl);
-    WriteFunc *write = dlsym(dl, "write");
-    check_dl_error(dl);
-    return (Device) { dl, filename, init, fini, read, write };
+Device device_ref(Device dev) {
+    atomic_fetch_add(dev.refs, 1);
+    return dev;
+}
+
+bool device_unref(Device *dev) {
+    return atomic_fetch_sub(dev->refs, 1) == 1;
+}
+
+void close_device(Device *dev) {
+    dlclose(dev->dl);
+    free(dev->filename);
+    free((void *)dev->refs);
 }
 
 void free_device(void *dev) {
-    dlclose(((Device *)dev)->dl);
+    Device *d = (Device *)dev;
+    if (device_unref(d)) {
+        close_device(d);
+    }
     memset(dev, 0, sizeof(Device));
 }
@@ -2,27 +2,138 @@
 #define __VM_LOADER_H
 
 #include "common/arch.h"
+#include <linux/futex.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// ------------------------------------------------------------------------------------------------
+// Device ABI v2 (optional). A device that exports `init_async` and `notify` instead of init, read and
+// write does not block the guest: in/out push a request to the submission ring and return its tag,
+// the device pushes the result to the completion ring whenever it is done. `wait` collects them.
+// Both rings are single-producer single-consumer. The device sets need_wakeup before it goes to sleep
+// and only then the VM calls notify(), so a batch of requests costs one notification.
+// The VM never has more than DEVICE_RING_SIZE uncollected requests, so the completion ring cannot
+// overflow. Devices use the device_* helpers below and never touch the indices directly
+
+#define DEVICE_RING_SIZE 256 // Power of two
+
+typedef enum {
+    DEVICE_READ,  // `in`
+    DEVICE_WRITE, // `out`
+} DeviceOp;
+
+typedef struct {
+    byte op; // DeviceOp
+    word addr;
+    word size;
+    word tag; // Returned to the guest in r0 by in/out
+} DeviceRequest;
+
+typedef struct {
+    DeviceRequest request;
+    word result; // What a synchronous read/write would return
+} DeviceCompletion;
+
+typedef struct {
+    _Alignas(64) _Atomic uint32_t sq_head; // Moved by the device
+    _Atomic bool need_wakeup;
+    _Alignas(64) _Atomic uint32_t sq_tail; // Moved by the VM
+    _Alignas(64) _Atomic uint32_t cq_head; // Moved by the VM
+    _Atomic bool vm_waiting;               // The VM sleeps on cq_tail
+    _Alignas(64) _Atomic uint32_t cq_tail; // Moved by the device
+    DeviceRequest sq[DEVICE_RING_SIZE];
+    DeviceCompletion cq[DEVICE_RING_SIZE];
+} DeviceRings;
+
+typedef word(AsyncInitFunc)(byte *, DeviceRings *);
+typedef void(NotifyFunc)(void);
+
+static inline bool device_next_request(DeviceRings *rings, DeviceRequest *request) {
+    uint32_t head = atomic_load_explicit(&rings->sq_head, memory_order_relaxed);
+    if (head == atomic_load_explicit(&rings->sq_tail, memory_order_acquire)) {
+        return false;
+    }
+    *request = rings->sq[head % DEVICE_RING_SIZE];
+    atomic_store_explicit(&rings->sq_head, head + 1, memory_order_release);
+    return true;
+}
+
+static inline void device_complete(DeviceRings *rings, DeviceRequest request, word result) {
+    uint32_t tail = atomic_load_explicit(&rings->cq_tail, memory_order_relaxed);
+    rings->cq[tail % DEVICE_RING_SIZE] = (DeviceCompletion) { request, result };
+    atomic_store(&rings->cq_tail, tail + 1);
+    if (atomic_exchange(&rings->vm_waiting, false)) {
+        syscall(SYS_futex, &rings->cq_tail, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+    }
+}
+
+// Returns true if the device may sleep until notify(), false if there are new requests after all
+static inline bool device_prepare_sleep(DeviceRings *rings) {
+    atomic_store(&rings->need_wakeup, true);
+    if (atomic_load(&rings->sq_head) != atomic_load(&rings->sq_tail)) {
+        atomic_store(&rings->need_wakeup, false);
+        return false;
+    }
+    return true;
+}
+
+// ------------------------------------------------------------------------------------------------
 
 typedef word(InitFunc)(byte *);
 typedef word(FiniFunc)(void);
 typedef word(ReadFunc)(word, word);
 typedef word(WriteFunc)(word, word);
+typedef word(ShareFunc)(byte *);
 
 typedef struct {
     void *dl;
-    const char *filename;
+    char *filename;
     InitFunc *init;
     FiniFunc *fini;
     ReadFunc *read;
     WriteFunc *write;
+    ShareFunc *share; // Optional, see vm_fork
+    AsyncInitFunc *init_async; // ABI v2, NULL for synchronous devices
+    NotifyFunc *notify;
+    _Atomic unsigned *refs; // The instance is closed when the last reference is freed
 } Device;
 
-Device new_device(const char *filename);
+// Returns NULL on success, otherwise the reason of the failure.
+// A device keeps its state in globals, so VMs running in the same process need their own instance:
+// if private_copy is set, a copy of the file is loaded instead of the file itself
+const char *new_device(const char *filename, bool private_copy, Device *dev);
+// Returns one more reference to the same instance
+Device device_ref(Device dev);
+// Drops the reference and returns true if it was the last one. Only the last owner learns that,
+// so it is the one that calls fini and then close_device
+bool device_unref(Device *dev);
+void close_device(Device *dev);
+// Drops the reference without fini, for instances that were never started
 void free_device(void *dev);
 
+#define PORT_COUNT 256
+
 typedef struct {
     byte id;
-    Device device;
+    bool attached;
+    Device device;     // Its functions are resolved once, when the device is attached
+    DeviceRings *rings; // NULL for synchronous devices
+    word next_tag;
+    word async_result; // Sum of the results collected since the last `wait`
+    bool from_program; // Attached by a directive of the loaded program
+    bool stale;        // Requested by the previous program, but not (yet) by the current one
+    unsigned long in_calls;  // How many times `in` used the port
+    unsigned long out_calls; // How many times `out` used the port
+    unsigned long in_bytes;  // Sum of the buffer sizes of those calls
+    unsigned long out_bytes;
 } Port;
 
+// I don't know how to name it better, so it is what it is
+typedef struct {
+    const char *device_file;
+    int port_id; // May be negative. -1 means free port
+} DeviceFileAndPort;
+
 #endif
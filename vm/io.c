@@ -1,72 +1,129 @@
 #include "io.h"
-#include <dlfcn.h>
+#include "common/utils.h"
+#include <errno.h>
+#include <limits.h>
+#include <stdarg.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
-extern const char *INPUT_FILE_NAME;
-
-static void print_error(const char *msg, ...) {
+// Several VMs may report errors at the same time, so every message is printed at once
+static void print_error(VM *vm, const char *msg, ...) {
     va_list args;
     va_start(args, msg);
 
+    flockfile(stdout);
     style(STYLE_BOLD);
-    printf("%s", INPUT_FILE_NAME);
+    printf("%s", vm->input_file);
     printf(": ");
     printf_red("error: ");
     vprintf(msg, args);
     printf("\n");
+    funlockfile(stdout);
 
     va_end(args);
 }
 
-void error_dl(void *dl, const char *msg) {
-    print_error("Error while loading a device: \"%s\"", msg);
-    if (dl)
-        dlclose(dl);
-    exit(EXIT_FAILURE);
+void error_dl(VM *vm, const char *msg) {
+    print_error(vm, "Error while loading a device: \"%s\"", msg);
+    vm_abort(vm);
+}
+
+void error_dev_open(VM *vm, const char *device_file, word code) {
+    print_error(vm, "while opening %s (code: %d)", device_file, code);
+    vm_abort(vm);
+}
+
+void error_dev_close(VM *vm, const char *device_file, word code) {
+    print_error(vm, "while closing %s (code: %d)", device_file, code);
+    vm->failed = true;
+}
+
+void error_no_device_attached(VM *vm, word port_id) {
+    print_error(vm, "no device connected to the port with id %d", port_id);
+    vm_abort(vm);
+}
+
+void error_no_free_ports(VM *vm) {
+    print_error(vm, "cannot attach the device: no free ports");
+    vm_abort(vm);
+}
+
+void error_using_preserve_port(VM *vm) {
+    print_error(vm, "port 0 is reserved");
+    vm_abort(vm);
+}
+
+void error_too_big_program(VM *vm) {
+    print_error(vm, "program cannot be placed into memory (which is %d bytes)", MEMORY_SIZE);
+    vm_abort(vm);
+}
+
+void error_invalid_program(VM *vm) {
+    print_error(vm, "file does not exist or has invalid format");
+    vm_abort(vm);
 }
 
-void error_dev_open(const char *device_file, word code) {
-    print_error("while opening %s (code: %d)", device_file, code);
-    exit(EXIT_FAILURE);
+void error_unlinked_object(VM *vm) {
+    print_error(vm, "file is a relocatable object, link it with slink first");
+    vm_abort(vm);
 }
 
-void error_dev_close(const char *device_file, word code) {
-    print_error("while closing %s (code: %d)", device_file, code);
-    exit(EXIT_FAILURE);
+void error_no_section(VM *vm, const char *section_name) {
+    print_error(vm, "cannot find section \"%s\"", section_name);
+    vm_abort(vm);
 }
 
-void error_no_device_attached(word port_id) {
-    print_error("no device connected to the port with id %d", port_id);
-    exit(EXIT_FAILURE);
+void error_snapshot(VM *vm) {
+    print_error(vm, "cannot snapshot the VM: %s", strerror(errno));
+    vm_abort(vm);
 }
 
-void error_no_free_ports(void) {
-    print_error("cannot attach the device: no free ports");
-    exit(EXIT_FAILURE);
+// Errors of the program dump the VM to the dump file of the job, or next to the program, so that
+// VMs failing at the same time do not write the same file
+static void report_failed_program(VM *vm, const char *kind, const char *msg) {
+    char path[PATH_MAX];
+    if (vm->dump_file) {
+        snprintf(path, sizeof(path), "%s", vm->dump_file);
+    } else {
+        snprintf(path, sizeof(path), "%s.%s.dump", vm->input_file, kind);
+    }
+    print_error(vm, "%s (vm dumped to %s)", msg, path);
+    dump_vm(*vm, path);
+    vm_abort(vm);
 }
 
-void error_using_preserve_port(void) {
-    print_error("port 0 is reserved");
-    exit(EXIT_FAILURE);
+void error_unknown_instruction(VM *vm, byte opcode) {
+    char msg[64];
+    snprintf(msg, sizeof(msg), "reached unknown instruction with opcode 0x%02x", opcode);
+    report_failed_program(vm, "instr_unknown", msg);
 }
 
-void error_too_big_program(void) {
-    print_error("program cannot be placed into memory (which is %d bytes)", MEMORY_SIZE);
-    exit(EXIT_FAILURE);
+void error_stack_overflow(VM *vm) {
+    report_failed_program(vm, "stackoverflow", "stack overflow");
+}
+
+void error_stack_empty(VM *vm) {
+    report_failed_program(vm, "stackisempty", "stack is empty");
 }
 
 void dump_vm(VM vm, const char *filename) {
     FILE *fp = fopen(filename, "w");
     if (fp == NULL) {
-        error_file_doesnot_exist(filename);
+        print_error(&vm, "cannot write the dump to %s", filename);
+        vm_abort(&vm);
     }
 
     fprintf(fp, "Devices:\n");
-    if (vector_size(vm.ports) == 0) {
-        fprintf(fp, "No connected devices\n");
+    bool any_device = false;
+    for (size_t id = 0; id < PORT_COUNT; id++) {
+        if (vm.ports[id].attached) {
+            fprintf(fp, "%s -> %lu\n", vm.ports[id].device.filename, id);
+            any_device = true;
+        }
     }
-    foreach(Port, port, vm.ports) {
-        fprintf(fp, "%s -> %d\n", port->device.filename, port->id);
+    if (!any_device) {
+        fprintf(fp, "No connected devices\n");
     }
 
     fprintf(fp, "\nRegisters:\n");
@@ -112,3 +169,183 @@ void dump_vm(VM vm, const char *filename) {
 
     fclose(fp);
 }
+
+void print_vm_stats(const VMStats *stats) {
+    unsigned long total = vm_stats_total_retired(stats);
+    fprintf(stderr, "Instructions: %lu in %.3f s (%.1f MIPS)\n", total, stats->run_time,
+            stats->run_time > 0 ? total / stats->run_time / 1e6 : 0.0);
+    for (byte opcode = 1; opcode < INSTR_COUNT; opcode++) {
+        unsigned long count = vm_stats_retired(stats, opcode);
+        if (count > 0) {
+            fprintf(stderr, "  %-12s %lu\n", instropcode_to_str(opcode), count);
+        }
+    }
+    fprintf(stderr, "Branches: %lu taken, %lu not taken\n", stats->jif_taken, stats->jif_not_taken);
+    fprintf(stderr, "Max call depth: %lu\n", stats->max_call_depth);
+    fprintf(stderr, "Max stack size: %d of %d bytes\n", stats->max_stack_size, STACK_MAX_SIZE);
+    fprintf(stderr, "Superinstructions:\n");
+    for (size_t i = 0; i < FUSED_COUNT; i++) {
+        fprintf(stderr, "  %-12s %lu\n", fused_handler_name(FUSED_FIRST + i), stats->dispatched[FUSED_FIRST + i]);
+    }
+}
+
+void print_stats(const VM *vm) {
+    print_vm_stats(&vm->stats);
+    fprintf(stderr, "Ports:\n");
+    for (size_t id = 0; id < PORT_COUNT; id++) {
+        const Port *port = &vm->ports[id];
+        if (port->attached) {
+            fprintf(stderr, "  %3lu %-20s in: %lu (%lu bytes), out: %lu (%lu bytes)\n", id,
+                    port->device.filename, port->in_calls, port->in_bytes, port->out_calls, port->out_bytes);
+        }
+    }
+}
+
+static void write_json_string(FILE *fp, const char *s) {
+    fputc('"', fp);
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\') {
+            fprintf(fp, "\\%c", *s);
+        } else if ((unsigned char)*s < 0x20) {
+            fprintf(fp, "\\u%04x", *s);
+        } else {
+            fputc(*s, fp);
+        }
+    }
+    fputc('"', fp);
+}
+
+void write_stats_json(VM *vm, const char *filename) {
+    FILE *fp = fopen(filename, "w");
+    if (fp == NULL) {
+        print_error(vm, "cannot write the stats to %s", filename);
+        vm_abort(vm);
+    }
+    const VMStats *stats = &vm->stats;
+    unsigned long total = vm_stats_total_retired(stats);
+    fprintf(fp, "{\n  \"instructions\": %lu,\n  \"run_time\": %.6f,\n  \"mips\": %.3f,\n", total,
+            stats->run_time, stats->run_time > 0 ? total / stats->run_time / 1e6 : 0.0);
+    fprintf(fp, "  \"retired\": {");
+    for (byte opcode = 1; opcode < INSTR_COUNT; opcode++) {
+        fprintf(fp, "%s\"%s\": %lu", opcode > 1 ? ", " : "", instropcode_to_str(opcode),
+                vm_stats_retired(stats, opcode));
+    }
+    fprintf(fp, "},\n  \"jif_taken\": %lu,\n  \"jif_not_taken\": %lu,\n", stats->jif_taken,
+            stats->jif_not_taken);
+    fprintf(fp, "  \"max_call_depth\": %lu,\n  \"max_stack_size\": %d,\n  \"stack_max_size\": %d,\n",
+            stats->max_call_depth, stats->max_stack_size, STACK_MAX_SIZE);
+    fprintf(fp, "  \"superinstructions\": {");
+    for (size_t i = 0; i < FUSED_COUNT; i++) {
+        fprintf(fp, "%s\"%s\": %lu", i ? ", " : "", fused_handler_name(FUSED_FIRST + i),
+                stats->dispatched[FUSED_FIRST + i]);
+    }
+    fprintf(fp, "},\n  \"ports\": [");
+    bool first = true;
+    for (size_t id = 0; id < PORT_COUNT; id++) {
+        const Port *port = &vm->ports[id];
+        if (!port->attached) {
+            continue;
+        }
+        fprintf(fp, "%s\n    {\"id\": %zu, \"device\": ", first ? "" : ",", id);
+        write_json_string(fp, port->device.filename);
+        fprintf(fp, ", \"in_calls\": %lu, \"in_bytes\": %lu, \"out_calls\": %lu, \"out_bytes\": %lu}",
+                port->in_calls, port->in_bytes, port->out_calls, port->out_bytes);
+        first = false;
+    }
+    fprintf(fp, "%s]\n}\n", first ? "" : "\n  ");
+    fclose(fp);
+}
+
+void write_profile(VM *vm, const char *filename) {
+    FILE *fp = fopen(filename, "w");
+    if (fp == NULL) {
+        print_error(vm, "cannot write the profile to %s", filename);
+        vm_abort(vm);
+    }
+    const Profiler *profiler = vm->profiler;
+    for (size_t i = 0; i < profiler->stacks_capacity; i++) {
+        const ProfileStack *s = &profiler->stacks[i];
+        if (s->depth == 0) {
+            continue;
+        }
+        for (size_t j = 0; j < s->depth; j++) {
+            fprintf(fp, "%s%s", j ? ";" : "", profiler->symbols[s->frames[j]].name);
+        }
+        fprintf(fp, " %lu\n", s->count);
+    }
+    fclose(fp);
+}
+
+static int compare_self_samples(const void *a, const void *b) {
+    const ProfileSymbol *x = *(const ProfileSymbol **)a, *y = *(const ProfileSymbol **)b;
+    if (x->self != y->self) {
+        return x->self > y->self ? -1 : 1;
+    }
+    return x->total > y->total ? -1 : x->total < y->total;
+}
+
+void print_profile(const VM *vm) {
+    const Profiler *profiler = vm->profiler;
+    size_t count = vector_size(profiler->symbols);
+    const ProfileSymbol **sorted = malloc(count * sizeof(ProfileSymbol *));
+    for (size_t i = 0; i < count; i++) {
+        sorted[i] = &profiler->symbols[i];
+    }
+    qsort(sorted, count, sizeof(ProfileSymbol *), compare_self_samples);
+
+    unsigned long samples = profiler->samples ? profiler->samples : 1;
+    fprintf(stderr, "Profile: %lu samples, one every %d instructions\n", profiler->samples, PROFILE_INTERVAL);
+    fprintf(stderr, "  %7s %7s  %s\n", "self", "total", "symbol");
+    for (size_t i = 0; i < min(count, PROFILE_TOP_COUNT) && sorted[i]->total > 0; i++) {
+        fprintf(stderr, "  %6.2f%% %6.2f%%  %s\n", 100.0 * sorted[i]->self / samples,
+                100.0 * sorted[i]->total / samples, sorted[i]->name);
+    }
+    free(sorted);
+}
+
+// Name of the symbol at addr, or the address itself
+static const char *function_name(const VM *vm, word addr, char *buffer, size_t size) {
+    foreach(Symbol, s, vm->symbol_table) {
+        if (s->declaration_address == addr) {
+            return s->name;
+        }
+    }
+    snprintf(buffer, size, "0x%04x", addr);
+    return buffer;
+}
+
+static int compare_edge_callers(const void *a, const void *b) {
+    const CallEdge *x = a, *y = b;
+    return (x->caller > y->caller) - (x->caller < y->caller);
+}
+
+void write_callgraph(VM *vm, const char *filename) {
+    FILE *fp = fopen(filename, "w");
+    if (fp == NULL) {
+        print_error(vm, "cannot write the call graph to %s", filename);
+        vm_abort(vm);
+    }
+    CallGraph *graph = vm->callgraph;
+    qsort(graph->edges, vector_size(graph->edges), sizeof(CallEdge), compare_edge_callers);
+    fprintf(fp, "version: 1\ncreator: svm\ncmd: %s\npositions: instr\nevents: Instructions\n",
+            vm->input_file);
+    fprintf(fp, "summary: %lu\n", graph->cost);
+
+    char buffer[8];
+    size_t edge = 0, edge_count = vector_size(graph->edges);
+    for (size_t addr = 0; addr < MEMORY_SIZE; addr++) {
+        bool has_calls = edge < edge_count && graph->edges[edge].caller == addr;
+        if (graph->self[addr] == 0 && !has_calls) {
+            continue;
+        }
+        fprintf(fp, "\nfn=%s\n", function_name(vm, addr, buffer, sizeof(buffer)));
+        fprintf(fp, "0x%04zx %lu\n", addr, graph->self[addr]);
+        for (; edge < edge_count && graph->edges[edge].caller == addr; edge++) {
+            const CallEdge *e = &graph->edges[edge];
+            fprintf(fp, "cfn=%s\n", function_name(vm, e->callee, buffer, sizeof(buffer)));
+            fprintf(fp, "calls=%lu 0x%04x\n", e->calls, e->callee);
+            fprintf(fp, "0x%04x %lu\n", e->site, e->inclusive);
+        }
+    }
+    fclose(fp);
+}
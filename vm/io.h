@@ -4,14 +4,33 @@
 #include "common/io.h"
 #include "machine.h"
 
-void error_dl(void *dl, const char *msg);
-void error_dev_open(const char *device_file, word status);
-void error_dev_close(const char *device_file, word status);
-void error_no_device_attached(word port_id);
-void error_no_free_ports(void);
-void error_using_preserve_port(void);
-void error_too_big_program(void);
+// Every error_* function reports the error and calls vm_abort, except error_dev_close,
+// which only marks the VM as failed
+void error_dl(VM *vm, const char *msg);
+void error_dev_open(VM *vm, const char *device_file, word status);
+void error_dev_close(VM *vm, const char *device_file, word status);
+void error_no_device_attached(VM *vm, word port_id);
+void error_no_free_ports(VM *vm);
+void error_using_preserve_port(VM *vm);
+void error_too_big_program(VM *vm);
+void error_invalid_program(VM *vm);
+void error_unlinked_object(VM *vm);
+void error_no_section(VM *vm, const char *section_name);
+void error_snapshot(VM *vm);
+void error_unknown_instruction(VM *vm, byte opcode);
+void error_stack_overflow(VM *vm);
+void error_stack_empty(VM *vm);
 
 void dump_vm(VM vm, const char *filename);
+void print_stats(const VM *vm);
+// The counters without the ports, to stderr
+void print_vm_stats(const VMStats *stats);
+void write_stats_json(VM *vm, const char *filename);
+// Folded stacks (`outer;inner count` per line), the input of flamegraph.pl and similar tools
+void write_profile(VM *vm, const char *filename);
+// The PROFILE_TOP_COUNT symbols with the most samples
+void print_profile(const VM *vm);
+// Call graph in the callgrind format, for KCachegrind and callgrind_annotate
+void write_callgraph(VM *vm, const char *filename);
 
 #endif
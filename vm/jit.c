@@ -0,0 +1,489 @@
+#include "jit.h"
+#include "machine.h"
+#include "decoder.h"
+#include "common/utils.h"
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#ifdef VM_JIT
+
+#ifndef __x86_64__
+#error "The JIT only supports x86-64, build with JIT=false"
+#endif
+
+// Generated code follows the System V ABI: rdi points to the register file, rsi to the memory,
+// eax holds the next ip on return. The exit counters are moved from rdx to r9 by the prologue,
+// sampled blocks keep Jit.countdown in r10. Other than that only caller-saved registers are used
+#define RAX 0
+#define RCX 1
+#define RDX 2
+#define RSI 6
+#define RDI 7
+
+#define JIT_MAX_BLOCK_SIZE 4096
+// More than any instruction emits together with its exits and the exit that ends the block
+#define JIT_MAX_INSTR_CODE 160
+#define JIT_MAX_BLOCK_BYTES (JIT_MAX_BLOCK_INSTRS * INSTR_MAX_SIZE)
+
+// x86 condition codes
+#define CC_E  0x4
+#define CC_NE 0x5
+#define CC_L  0xc
+
+typedef struct {
+    byte buffer[JIT_MAX_BLOCK_SIZE];
+    size_t size;
+    Jit *jit;
+    uint32_t block;      // Index of the block in Jit.block_opcodes
+    byte executed;       // Instructions of the block before the one being emitted
+    bool out_of_exits;
+    bool is_sampled;     // Every exit counts down Jit.countdown
+} Emitter;
+
+static void emit(Emitter *e, size_t count, ...) {
+    va_list args;
+    va_start(args, count);
+    for (size_t i = 0; i < count; i++) {
+        e->buffer[e->size++] = (byte)va_arg(args, int);
+    }
+    va_end(args);
+}
+
+static void emit_u32(Emitter *e, uint32_t value) {
+    for (size_t i = 0; i < 4; i++) {
+        e->buffer[e->size++] = (value >> (i * 8)) & 0xff;
+    }
+}
+
+#define reg_disp(reg) ((byte)((reg) * sizeof(word)))
+
+// movzx r32, word [rdi + reg]
+static void emit_load_reg(Emitter *e, byte host_reg, byte reg) {
+    emit(e, 4, 0x0f, 0xb7, 0x40 | host_reg << 3 | RDI, reg_disp(reg));
+}
+
+// movsx r32, word [rdi + reg]
+static void emit_load_reg_signed(Emitter *e, byte host_reg, byte reg) {
+    emit(e, 4, 0x0f, 0xbf, 0x40 | host_reg << 3 | RDI, reg_disp(reg));
+}
+
+// mov word [rdi + reg], r16
+static void emit_store_reg(Emitter *e, byte reg, byte host_reg) {
+    emit(e, 4, 0x66, 0x89, 0x40 | host_reg << 3 | RDI, reg_disp(reg));
+}
+
+// mov r32, imm32
+static void emit_load_imm(Emitter *e, byte host_reg, uint32_t imm) {
+    emit(e, 1, 0xb8 + host_reg);
+    emit_u32(e, imm);
+}
+
+// inc qword [r9 + exit * 8], for a new exit reached after `executed` instructions
+static void emit_count_exit(Emitter *e, byte executed, byte jif) {
+    Jit *jit = e->jit;
+    size_t exit = jit->exits_used;
+    if (exit == JIT_MAX_EXITS) {
+        e->out_of_exits = true;
+        exit = 0; // The block is thrown away
+    } else {
+        jit->exits[jit->exits_used++] = (JitExit) { e->block, executed, jif };
+    }
+    emit(e, 3, 0x49, 0xff, 0x81);
+    emit_u32(e, exit * sizeof(uint64_t));
+    if (e->is_sampled) {
+        emit(e, 4, 0x49, 0x83, 0xea, executed); // sub r10, executed
+    }
+}
+
+// mov [r9 + countdown], r10
+static void emit_store_countdown(Emitter *e) {
+    emit(e, 3, 0x4d, 0x89, 0x91);
+    emit_u32(e, JIT_MAX_EXITS * sizeof(uint64_t));
+}
+
+// The sizes of emit_count_exit and emit_exit, for jumps over them
+#define COUNT_EXIT_SIZE(e) ((e)->is_sampled ? 11 : 7)
+#define EXIT_SIZE(e) (COUNT_EXIT_SIZE(e) + ((e)->is_sampled ? 7 : 0) + 6)
+
+// Counts the exit, then mov eax, ip; ret
+static void emit_exit(Emitter *e, size_t ip, byte executed, byte jif) {
+    emit_count_exit(e, executed, jif);
+    if (e->is_sampled) {
+        emit_store_countdown(e);
+    }
+    emit_load_imm(e, RAX, ip);
+    emit(e, 1, 0xc3);
+}
+
+// Loads operand 1 into ecx, sign-extended like `short value` in exec_instr, or zero-extended
+static void emit_load_operand(Emitter *e, DecodedInstr *instr, bool is_signed) {
+    if (instr->kinds & OPERAND_IMM(1)) {
+        uint32_t imm = is_signed ? (uint32_t)(int32_t)(short)instr->imm[0] : instr->imm[0];
+        emit_load_imm(e, RCX, imm);
+    } else if (is_signed) {
+        emit_load_reg_signed(e, RCX, instr->reg[1]);
+    } else {
+        emit_load_reg(e, RCX, instr->reg[1]);
+    }
+}
+
+// mov r9, rdx, and mov r10, [r9 + countdown] when sampled. Loops jump right past it, since rdx is
+// a scratch register
+static void emit_prologue(Emitter *e) {
+    emit(e, 3, 0x49, 0x89, 0xd1);
+    if (e->is_sampled) {
+        emit(e, 3, 0x4d, 0x8b, 0x91);
+        emit_u32(e, JIT_MAX_EXITS * sizeof(uint64_t));
+    }
+}
+#define PROLOGUE_SIZE(e) ((e)->is_sampled ? 10 : 3)
+
+// Jumps to the beginning of the block if the condition is met, cc < 0 means "always". A sampled
+// block leaves to its beginning instead when the countdown runs out
+static void emit_loop(Emitter *e, int cc, byte executed, byte jif, size_t block_begin) {
+    if (cc >= 0) {
+        // j!cc over the counter and the jump (and the exit)
+        emit(e, 2, 0x70 | (cc ^ 1), COUNT_EXIT_SIZE(e) + (e->is_sampled ? 19 : 5));
+    }
+    emit_count_exit(e, executed, jif);
+    if (!e->is_sampled) {
+        emit(e, 1, 0xe9);
+        emit_u32(e, (uint32_t)(PROLOGUE_SIZE(e) - (int32_t)(e->size + 4)));
+        return;
+    }
+    emit(e, 2, 0x0f, 0x8f); // jg
+    emit_u32(e, (uint32_t)(PROLOGUE_SIZE(e) - (int32_t)(e->size + 4)));
+    emit_store_countdown(e);
+    emit_load_imm(e, RAX, block_begin);
+    emit(e, 1, 0xc3);
+}
+
+// Exits to target (or loops) if the condition is met, cc < 0 means "always"
+static void emit_branch(Emitter *e, int cc, size_t target, size_t block_begin, byte jif) {
+    byte executed = e->executed + 1;
+    if (target == block_begin) {
+        emit_loop(e, cc, executed, jif, block_begin);
+        return;
+    }
+    if (cc >= 0) {
+        emit(e, 2, 0x70 | (cc ^ 1), EXIT_SIZE(e));
+    }
+    emit_exit(e, target, executed, jif);
+}
+
+static bool is_supported(DecodedInstr *instr) {
+    // Everything that touches ip has HANDLER_GENERIC
+    if (instr->handler == HANDLER_GENERIC) {
+        return false;
+    }
+    switch (instr->opcode) {
+        case INSTR_MOV: case INSTR_LD: case INSTR_ST: case INSTR_NOT:
+        case INSTR_ADD: case INSTR_SUB: case INSTR_MUL: case INSTR_DIV:
+        case INSTR_AND: case INSTR_OR: case INSTR_XOR: case INSTR_SHL: case INSTR_SHR:
+        case INSTR_CMP: case INSTR_JMP: case INSTR_JIF:
+            return true;
+        default:
+            return false;
+    }
+}
+
+static void emit_instr(Emitter *e, DecodedInstr *instr, size_t addr, size_t block_begin,
+                       size_t program_size)
+{
+    byte dest = instr->reg[0];
+    switch (instr->opcode) {
+        case INSTR_MOV:
+            if (instr->kinds & OPERAND_IMM(1)) {
+                // mov word [rdi + dest], imm16
+                emit(e, 6, 0x66, 0xc7, 0x40 | RDI, reg_disp(dest),
+                     instr->imm[0] & 0xff, instr->imm[0] >> 8);
+            } else {
+                emit_load_reg(e, RAX, instr->reg[1]);
+                emit_store_reg(e, dest, RAX);
+            }
+            break;
+
+        case INSTR_LD:
+            emit_load_operand(e, instr, false);
+            emit(e, 4, 0x0f, 0xb6, 0x04, 0x0e);       // movzx eax, byte [rsi + rcx]
+            // The second byte of 0xffff is the first one of the memory
+            emit(e, 3, 0x8d, 0x51, 0x01);             // lea edx, [rcx + 1]
+            emit(e, 3, 0x0f, 0xb7, 0xd2);             // movzx edx, dx
+            emit(e, 4, 0x0f, 0xb6, 0x14, 0x16);       // movzx edx, byte [rsi + rdx]
+            emit(e, 3, 0xc1, 0xe0, 0x08);             // shl eax, 8
+            emit(e, 2, 0x09, 0xd0);                   // or eax, edx
+            emit_store_reg(e, dest, RAX);
+            break;
+
+        case INSTR_ST:
+            emit_load_operand(e, instr, false);
+            // Stores into the program section (and the one wrapping around) are left to
+            // the interpreter, which invalidates the decoded code
+            emit(e, 2, 0x81, 0xf9);                   // cmp ecx, program_size
+            emit_u32(e, program_size);
+            emit(e, 2, 0x73, EXIT_SIZE(e));           // jae over the exit
+            emit_exit(e, addr, e->executed, 0);
+            emit(e, 2, 0x81, 0xf9);                   // cmp ecx, 0xffff
+            emit_u32(e, 0xffff);
+            emit(e, 2, 0x75, EXIT_SIZE(e));           // jne over the exit
+            emit_exit(e, addr, e->executed, 0);
+            emit_load_reg(e, RAX, dest);
+            emit(e, 2, 0x89, 0xc2);                   // mov edx, eax
+            emit(e, 3, 0xc1, 0xea, 0x08);             // shr edx, 8
+            emit(e, 3, 0x88, 0x14, 0x0e);             // mov [rsi + rcx], dl
+            emit(e, 4, 0x88, 0x44, 0x0e, 0x01);       // mov [rsi + rcx + 1], al
+            break;
+
+        case INSTR_NOT:
+            emit(e, 4, 0x66, 0xf7, 0x50 | RDI, reg_disp(dest)); // not word [rdi + dest]
+            break;
+
+        case INSTR_ADD: case INSTR_SUB: case INSTR_MUL: case INSTR_DIV:
+        case INSTR_AND: case INSTR_OR: case INSTR_XOR: case INSTR_SHL: case INSTR_SHR:
+            // The same promotions as `word op= short`
+            emit_load_reg(e, RAX, dest);
+            emit_load_operand(e, instr, true);
+            switch (instr->opcode) {
+                case INSTR_ADD: emit(e, 2, 0x01, 0xc8); break;       // add eax, ecx
+                case INSTR_SUB: emit(e, 2, 0x29, 0xc8); break;       // sub eax, ecx
+                case INSTR_MUL: emit(e, 3, 0x0f, 0xaf, 0xc1); break; // imul eax, ecx
+                case INSTR_DIV: emit(e, 3, 0x99, 0xf7, 0xf9); break; // cdq; idiv ecx
+                case INSTR_AND: emit(e, 2, 0x21, 0xc8); break;       // and eax, ecx
+                case INSTR_OR:  emit(e, 2, 0x09, 0xc8); break;       // or eax, ecx
+                case INSTR_XOR: emit(e, 2, 0x31, 0xc8); break;       // xor eax, ecx
+                case INSTR_SHL: emit(e, 2, 0xd3, 0xe0); break;       // shl eax, cl
+                case INSTR_SHR: emit(e, 2, 0xd3, 0xf8); break;       // sar eax, cl
+            }
+            emit_store_reg(e, dest, RAX);
+            break;
+
+        case INSTR_CMP:
+            emit_load_reg(e, RAX, dest);
+            emit_load_operand(e, instr, true);
+            emit(e, 2, 0x39, 0xc8);                   // cmp eax, ecx
+            emit_load_imm(e, RDX, CMP_GT);
+            emit(e, 6, 0x41, 0xb8, CMP_LT, 0, 0, 0);  // mov r8d, CMP_LT
+            emit(e, 4, 0x41, 0x0f, 0x40 | CC_L, 0xd0); // cmovl edx, r8d
+            emit(e, 6, 0x41, 0xb8, CMP_EQ, 0, 0, 0);  // mov r8d, CMP_EQ
+            emit(e, 4, 0x41, 0x0f, 0x40 | CC_E, 0xd0); // cmove edx, r8d
+            emit_store_reg(e, REG_CF, RDX);
+            break;
+
+        case INSTR_JMP:
+            emit_branch(e, -1, instr->imm[0], block_begin, 0);
+            break;
+
+        case INSTR_JIF: {
+            // cmp word [rdi + cf], cond
+            emit(e, 5, 0x66, 0x83, 0x78 | RDI, reg_disp(REG_CF), instr->aux == CMP_NQ ? CMP_EQ : instr->aux);
+            emit_branch(e, instr->aux == CMP_NQ ? CC_NE : CC_E, instr->imm[0], block_begin, JIT_JIF_TAKEN);
+            emit_exit(e, addr + instr->size, e->executed + 1, JIT_JIF_NOT_TAKEN);
+        }; break;
+    }
+}
+
+static bool code_cache_write(Jit *jit, Emitter *e, JitBlock *block) {
+    if (jit->code_cache_used + e->size > JIT_CODE_CACHE_SIZE) {
+        return false;
+    }
+    if (mprotect(jit->code_cache, JIT_CODE_CACHE_SIZE, PROT_READ | PROT_WRITE) != 0) {
+        return false;
+    }
+    byte *code = jit->code_cache + jit->code_cache_used;
+    memcpy(code, e->buffer, e->size);
+    jit->code_cache_used += e->size;
+    // Keep blocks 16-byte aligned
+    jit->code_cache_used = (jit->code_cache_used + 15) & ~(size_t)15;
+    if (mprotect(jit->code_cache, JIT_CODE_CACHE_SIZE, PROT_READ | PROT_EXEC) != 0) {
+        return false;
+    }
+    *block = (JitBlock)(void *)code;
+    return true;
+}
+
+static JitBlock jit_compile(Jit *jit, VM *vm, size_t begin) {
+    static _Thread_local Emitter e;
+    if (jit->blocks_used == JIT_MAX_EXITS) {
+        return NULL;
+    }
+    size_t exits_used = jit->exits_used;
+    e.size = 0;
+    e.jit = jit;
+    e.block = jit->blocks_used;
+    e.out_of_exits = false;
+    e.is_sampled = vm->profiler != NULL;
+    emit_prologue(&e);
+    size_t addr = begin;
+    size_t instr_count = 0;
+    bool terminated = false;
+    while (addr < vm->program_size && instr_count < JIT_MAX_BLOCK_INSTRS && !terminated &&
+           e.size + JIT_MAX_INSTR_CODE <= JIT_MAX_BLOCK_SIZE) {
+        DecodedInstr *instr = &vm->code[addr];
+        if (instr->size == 0) {
+            *instr = decode_instr(vm->memory, MEMORY_SIZE, addr);
+        }
+        if (!is_supported(instr)) {
+            break;
+        }
+        e.executed = instr_count;
+        jit->block_opcodes[e.block][instr_count] = instr->opcode;
+        emit_instr(&e, instr, addr, begin, vm->program_size);
+        terminated = instr->opcode == INSTR_JMP || instr->opcode == INSTR_JIF;
+        addr += instr->size;
+        instr_count++;
+    }
+    if (instr_count == 0) {
+        return NULL;
+    }
+    if (!terminated) {
+        emit_exit(&e, addr, instr_count, 0);
+    }
+    JitBlock block;
+    if (e.out_of_exits || !code_cache_write(jit, &e, &block)) {
+        jit->exits_used = exits_used;
+        return NULL;
+    }
+    jit->blocks_used++;
+    jit->blocks[begin] = block;
+    jit->block_ends[begin] = addr;
+    return block;
+}
+
+Jit *new_jit(void) {
+    byte *code_cache = mmap(NULL, JIT_CODE_CACHE_SIZE, PROT_READ | PROT_EXEC,
+                            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (code_cache == MAP_FAILED) {
+        return NULL;
+    }
+    Jit *jit = calloc(1, sizeof(Jit));
+    jit->code_cache = code_cache;
+    // Only the part that is used gets touched
+    jit->exit_counts = calloc(JIT_MAX_EXITS + 1, sizeof(uint64_t));
+    jit->countdown = (int64_t *)&jit->exit_counts[JIT_MAX_EXITS];
+    *jit->countdown = INT64_MAX;
+    jit->exits = calloc(JIT_MAX_EXITS, sizeof(JitExit));
+    jit->block_opcodes = calloc(JIT_MAX_EXITS, sizeof(*jit->block_opcodes));
+    return jit;
+}
+
+void jit_reset(Jit *jit, VM *vm) {
+    jit->code_cache_used = 0;
+    memset(jit->exit_counts, 0, jit->exits_used * sizeof(uint64_t));
+    jit->exits_used = 0;
+    jit->blocks_used = 0;
+    jit->program_size = vm->program_size;
+    free(jit->blocks);
+    free(jit->block_ends);
+    free(jit->counters);
+    jit->blocks = calloc(vm->program_size, sizeof(JitBlock));
+    jit->block_ends = calloc(vm->program_size, sizeof(word));
+    jit->counters = calloc(vm->program_size, sizeof(uint32_t));
+}
+
+void free_jit(Jit *jit) {
+    if (!jit) {
+        return;
+    }
+    munmap(jit->code_cache, JIT_CODE_CACHE_SIZE);
+    free(jit->blocks);
+    free(jit->block_ends);
+    free(jit->counters);
+    free(jit->exit_counts);
+    free(jit->exits);
+    free(jit->block_opcodes);
+    free(jit);
+}
+
+size_t jit_enter(Jit *jit, VM *vm, size_t ip, word *registers) {
+    while (ip < jit->program_size) {
+        JitBlock block = jit->blocks[ip];
+        if (!block) {
+            // Blocks that failed to compile just keep counting past the threshold
+            if (++jit->counters[ip] != JIT_THRESHOLD) {
+                return ip;
+            }
+            block = jit_compile(jit, vm, ip);
+            if (!block) {
+                return ip;
+            }
+        }
+        size_t next_ip = block(registers, vm->memory, jit->exit_counts);
+        // The block exited at its first instruction, the interpreter has to execute it
+        if (next_ip == ip) {
+            return ip;
+        }
+        ip = next_ip;
+        // The interpreter takes the sample
+        if (*jit->countdown <= 0) {
+            return ip;
+        }
+    }
+    return ip;
+}
+
+void jit_invalidate(Jit *jit, size_t begin, size_t end) {
+    size_t from = begin >= JIT_MAX_BLOCK_BYTES ? begin - JIT_MAX_BLOCK_BYTES : 0;
+    end = min(end, jit->program_size);
+    for (size_t addr = from; addr < end; addr++) {
+        if (jit->blocks[addr] && jit->block_ends[addr] > begin) {
+            jit->blocks[addr] = NULL;
+            jit->counters[addr] = 0;
+        }
+    }
+}
+
+void jit_collect_stats(Jit *jit, VMStats *stats) {
+    for (size_t i = 0; i < jit->exits_used; i++) {
+        uint64_t count = jit->exit_counts[i];
+        if (count == 0) {
+            continue;
+        }
+        JitExit *exit = &jit->exits[i];
+        for (size_t j = 0; j < exit->executed; j++) {
+            stats->retired[jit->block_opcodes[exit->block][j]] += count;
+        }
+        if (exit->jif == JIT_JIF_TAKEN) {
+            stats->jif_taken += count;
+        } else if (exit->jif == JIT_JIF_NOT_TAKEN) {
+            stats->jif_not_taken += count;
+        }
+        jit->exit_counts[i] = 0;
+    }
+}
+
+#else
+
+Jit *new_jit(void) {
+    return NULL;
+}
+
+void jit_reset(Jit *jit, VM *vm) {
+    UNUSED(jit);
+    UNUSED(vm);
+}
+
+void free_jit(Jit *jit) {
+    UNUSED(jit);
+}
+
+size_t jit_enter(Jit *jit, VM *vm, size_t ip, word *registers) {
+    UNUSED(jit);
+    UNUSED(vm);
+    UNUSED(registers);
+    return ip;
+}
+
+void jit_invalidate(Jit *jit, size_t begin, size_t end) {
+    UNUSED(jit);
+    UNUSED(begin);
+    UNUSED(end);
+}
+
+void jit_collect_stats(Jit *jit, VMStats *stats) {
+    UNUSED(jit);
+    UNUSED(stats);
+}
+
+#endif
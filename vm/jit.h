@@ -0,0 +1,64 @@
+#ifndef __VM_JIT_H
+#define __VM_JIT_H
+
+#include "common/arch.h"
+#include <stddef.h>
+#include <stdint.h>
+
+// How many times a block has to be entered before it is compiled
+#define JIT_THRESHOLD 100
+#define JIT_MAX_BLOCK_INSTRS 64
+#define JIT_CODE_CACHE_SIZE (4 * 1024 * 1024)
+#define JIT_MAX_EXITS (64 * 1024)
+
+// Compiled block. Works on the register file and the memory of a VM, returns the next ip.
+// Every time it leaves or loops, it increments the counter of that exit
+typedef uint32_t (*JitBlock)(word *registers, byte *memory, uint64_t *exit_counts);
+
+// What was executed by the time the block reached an exit
+typedef struct {
+    uint32_t block;  // Index in Jit.block_opcodes
+    byte executed;   // How many instructions from the beginning of the block
+    byte jif;        // 0, or JIT_JIF_TAKEN/JIT_JIF_NOT_TAKEN if the last one is jif
+} JitExit;
+
+#define JIT_JIF_TAKEN 1
+#define JIT_JIF_NOT_TAKEN 2
+
+typedef struct {
+    byte *code_cache;   // mmap'd, executable
+    size_t code_cache_used;
+    size_t program_size;
+    JitBlock *blocks;   // Compiled block for every address of the program section, if any
+    word *block_ends;   // Address right after the last instruction of the block
+    uint32_t *counters; // How many times every address was reached by a jump
+    uint64_t *exit_counts; // JIT_MAX_EXITS entries
+    // Right after the exit counters. Blocks compiled for a profiled VM count down what they
+    // executed and leave when it runs out, so that the interpreter takes the sample
+    int64_t *countdown;
+    JitExit *exits;
+    size_t exits_used;
+    byte (*block_opcodes)[JIT_MAX_BLOCK_INSTRS]; // Opcodes of every compiled block, in order
+    size_t blocks_used;
+} Jit;
+
+struct VM;
+struct VMStats;
+
+// Returns NULL if the host cannot run generated code
+Jit *new_jit(void);
+void free_jit(Jit *jit);
+// Drops every compiled block and prepares the JIT for the program loaded into vm
+void jit_reset(Jit *jit, struct VM *vm);
+
+// Called when the interpreter jumps to ip. Runs compiled blocks (compiling hot ones) as long as
+// there are any and no sample is due, returns the address the interpreter has to continue from
+size_t jit_enter(Jit *jit, struct VM *vm, size_t ip, word *registers);
+
+// Drops every block that contains an instruction in [begin; end)
+void jit_invalidate(Jit *jit, size_t begin, size_t end);
+
+// Adds what compiled blocks executed since the last call to the stats
+void jit_collect_stats(Jit *jit, struct VMStats *stats);
+
+#endif
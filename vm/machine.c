@@ -1,13 +1,20 @@
+#define _GNU_SOURCE // memfd_create
 #include "machine.h"
 #include "common/io.h"
 #include "common/arch.h"
 #include "common/sex.h"
 #include "io.h"
 #include "common/str.h"
+#include "common/utils.h"
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <linux/futex.h>
+#include <unistd.h>
 
 Symbol new_symbol(const char *name, word declaration_address) {
     return (Symbol) { new_string(name), declaration_address };
@@ -18,316 +25,619 @@ void free_symbol(void *symbol) {
     free_string(&symb.name);
 }
 
-word read_word_as_big_endian(byte *memory) {
+word read_word_as_big_endian(const byte *memory) {
     word w = memory[0];
     w <<= 8;
     w |= memory[1];
     return w;
 }
 
-unsigned long read_ulong_as_big_endian(byte *memory) {
-    unsigned long buffer = memory[0];
-    for (size_t i = 1; i < sizeof(unsigned long); i++) {
-        buffer <<= 8;
-        buffer |= memory[i];
-    }
-    return buffer;
+// The word at addr of the guest memory, whose second byte wraps around as it does for `st`
+static word load_word(const byte *memory, word addr) {
+    return memory[addr] << 8 | memory[(word)(addr + 1)];
 }
 
-static word read_bits(unsigned long *buffer, size_t *read_bits_count, size_t size) {
-    word data = (*buffer >> (sizeof(unsigned long) - sizeof(word)) * 8);
-    data >>= sizeof(word) * 8 - size;
-    *buffer <<= size;
-    *read_bits_count += size;
-    return data;
-}
-#define read_opcode(buffer, read_count)    read_bits(buffer, read_count, OPCODE_BIT_SIZE)
-#define read_register(buffer, read_count)  read_bits(buffer, read_count, REGISTER_BIT_SIZE)
-#define read_flag(buffer, read_count)      read_bits(buffer, read_count, 1)
-#define read_number(buffer, read_count)    read_bits(buffer, read_count, NUMBER_BIT_SIZE)
-#define read_byte(buffer, read_count)      read_bits(buffer, read_count, 8)
-#define skip_alignment(buffer, read_count, alignment)  read_bits(buffer, read_count, alignment)
+// Value of the operand with index idx (see DecodedInstr)
+#define instr_operand(vm, instr, idx) \
+    (((instr).kinds & OPERAND_IMM(idx)) ? (instr).imm[(idx) - 1] : (vm)->registers[(instr).reg[idx]])
+
+#define count_call(stats) \
+    do { \
+        (stats)->call_depth++; \
+        (stats)->max_call_depth = max((stats)->max_call_depth, (stats)->call_depth); \
+    } while(0)
+// A program may drop return addresses, so the depth is only an estimate
+#define count_ret(stats) \
+    do { \
+        if ((stats)->call_depth > 0) (stats)->call_depth--; \
+    } while(0)
 
 // Perform binary operation in instructions like <reg> <reg/imm>
-#define reg_reg_binop(buffer, read_bits_count, op) \
+#define reg_reg_binop(vm, instr, op) \
     do {\
-        word src_reg = read_register(buffer, read_bits_count); \
-        word flag = read_flag(buffer, read_bits_count); \
-        short value; \
-        if (flag) { \
-            skip_alignment(buffer, read_bits_count, 6); \
-            value = read_number(buffer, read_bits_count); \
-        } else { \
-            value = vm->registers[read_register(buffer, read_bits_count)]; \
-        } \
-        vm->registers[src_reg] op value; \
+        short value = instr_operand(vm, instr, 1); \
+        (vm)->registers[(instr).reg[0]] op value; \
     } while(0);
 
 // ------------------------------------------------------------------------------------------------
 
-// Just a wraper around free_device that also calls dev.fini()
-static void unload_port(void *port) {
-    Device dev = ((Port *)port)->device;
-    word code = dev.fini();
+static void load_device(VM *vm, const char *device_file, int port_id, bool from_program);
+
+static Port *new_port_table(void) {
+    return calloc(PORT_COUNT, sizeof(Port));
+}
+
+// Calls init, or init_async with new rings for ABI v2 devices. Returns the code of the device
+static word start_device(VM *vm, Port *port) {
+    Device *dev = &port->device;
+    if (!dev->init_async) {
+        return dev->init(vm->memory);
+    }
+    port->rings = aligned_alloc(_Alignof(DeviceRings), sizeof(DeviceRings));
+    memset(port->rings, 0, sizeof(DeviceRings));
+    word code = dev->init_async(vm->memory, port->rings);
     if (code != 0) {
-        error_dev_close(dev.filename, code);
+        free(port->rings);
+        port->rings = NULL;
+    }
+    return code;
+}
+
+static void drain_all_ports(VM *vm) {
+    for (size_t id = 0; id < PORT_COUNT; id++) {
+        if (vm->ports[id].attached && vm->ports[id].rings) {
+            vm_port_wait(vm, &vm->ports[id]);
+        }
     }
-    free_device(&dev);
 }
 
-VM new_vm(const char *input_file) {
-    ExecFile exec_file = execfile_read(input_file);
-    byte *memory = malloc(MEMORY_SIZE);
+// Anonymous memory if fd is -1, otherwise a copy-on-write view of the file
+static byte *map_memory(int fd) {
+    int flags = fd == -1 ? MAP_PRIVATE | MAP_ANONYMOUS : MAP_PRIVATE;
+    byte *memory = mmap(NULL, MEMORY_SIZE, PROT_READ | PROT_WRITE, flags, fd, 0);
+    if (memory == MAP_FAILED) {
+        perror("mmap");
+        exit(EXIT_FAILURE);
+    }
+    return memory;
+}
 
-    vector(Port) ports = NULL;
-    vector_set_destructor(ports, unload_port);
+VM new_vm(void) {
     vector(Symbol) symbol_table = NULL;
     vector_set_destructor(symbol_table, free_symbol);
 
     VM vm = {
         .program_size = 0,
+        .code = NULL,
+        .jit = NULL,
+        .profiler = NULL,
+        .callgraph = NULL,
         .stack_begging = 0,
-        .memory = memory,
-        .ports = ports,
+        .memory = map_memory(-1),
+        .ports = new_port_table(),
+        .symbol_table = symbol_table,
+        .input_file = NULL,
+        .dump_file = NULL,
+        .on_error = NULL,
+        .private_devices = false,
+        .failed = false,
     };
     memset(vm.registers, 0, sizeof(vm.registers));
+    memset(&vm.stats, 0, sizeof(vm.stats));
+    return vm;
+}
 
-    vm_load_program_section(&vm, exec_file);
-    vm_perform_directives(&vm, exec_file);
-    vm_load_symbol_table(&vm, exec_file);
+void free_vm(void *vm) {
+    VM *v = (VM *)vm;
+    for (size_t id = 0; id < PORT_COUNT; id++) {
+        vm_unload_port(v, id);
+    }
+    free(v->ports);
+    free_vector(&v->symbol_table);
+    free(v->code);
+    free_jit(v->jit);
+    free_profiler(v->profiler);
+    free_callgraph(v->callgraph);
+    munmap(v->memory, MEMORY_SIZE);
+}
 
-    foreach(Symbol, s, vm.symbol_table) {
-        if (strcmp(s->name, ENTRY_POINT_NAME) == 0) {
-            vm.registers[REG_IP] = s->declaration_address;
-            break;
+static vector(Symbol) copy_symbol_table(vector(Symbol) symbol_table) {
+    vector(Symbol) copy = NULL;
+    vector_set_destructor(copy, free_symbol);
+    vector_reserve(copy, vector_size(symbol_table));
+    foreach(Symbol, s, symbol_table) {
+        vector_push_back(copy, new_symbol(s->name, s->declaration_address));
+    }
+    return copy;
+}
+
+VMSnapshot vm_snapshot(VM *vm) {
+    assert(vm->code != NULL && "vm has no program loaded");
+    // Requests in flight may still write to the memory
+    drain_all_ports(vm);
+    int memory_fd = memfd_create("svm-snapshot", MFD_CLOEXEC);
+    if (memory_fd == -1 || pwrite(memory_fd, vm->memory, MEMORY_SIZE, 0) != MEMORY_SIZE) {
+        if (memory_fd != -1) {
+            close(memory_fd);
         }
+        error_snapshot(vm);
     }
+    VMSnapshot snapshot = {
+        .memory_fd = memory_fd,
+        .program_size = vm->program_size,
+        .code = malloc((vm->program_size + INSTR_MAX_SIZE) * sizeof(DecodedInstr)),
+        .stack_begging = vm->stack_begging,
+        .ports = new_port_table(),
+        .symbol_table = copy_symbol_table(vm->symbol_table),
+        .stats = vm->stats,
+        .input_file = vm->input_file,
+        .enable_jit = vm->jit != NULL,
+    };
+    memcpy(snapshot.registers, vm->registers, sizeof(vm->registers));
+    memcpy(snapshot.code, vm->code, (vm->program_size + INSTR_MAX_SIZE) * sizeof(DecodedInstr));
+    for (size_t id = 0; id < PORT_COUNT; id++) {
+        Port *port = &snapshot.ports[id];
+        if (!vm->ports[id].attached) {
+            continue;
+        }
+        *port = vm->ports[id];
+        port->rings = NULL;
+        if (port->device.init_async) {
+            // The instance works on the rings of the VM, which are freed with the VM. Forks load
+            // their own instance anyway, so only the file is kept
+            port->device = (Device) { .filename = strdup(port->device.filename) };
+        } else {
+            port->device = device_ref(port->device);
+        }
+    }
+    return snapshot;
+}
 
-    return vm;
+void free_snapshot(void *snapshot) {
+    VMSnapshot *s = (VMSnapshot *)snapshot;
+    close(s->memory_fd);
+    free(s->code);
+    for (size_t id = 0; id < PORT_COUNT; id++) {
+        Port *p = &s->ports[id];
+        if (!p->attached) {
+            continue;
+        }
+        if (!p->device.refs) {
+            free(p->device.filename);
+        } else if (device_unref(&p->device)) {
+            p->device.fini();
+            close_device(&p->device);
+        }
+    }
+    free(s->ports);
+    free_vector(&s->symbol_table);
 }
 
-void free_vm(void *vm) {
-    VM *v = (VM *)vm;
-    free_vector(&v->ports);
-    free_vector(&v->symbol_table);
-    free(v->memory);
+void vm_fork(const VMSnapshot *snapshot, VM *vm) {
+    // A JIT is expensive to make, so the one of the previous fork is reused
+    Jit *jit = vm->jit;
+    if (snapshot->enable_jit && !jit) {
+        jit = new_jit();
+    } else if (!snapshot->enable_jit) {
+        free_jit(jit);
+        jit = NULL;
+    }
+    *vm = (VM) {
+        .memory = map_memory(snapshot->memory_fd),
+        .program_size = snapshot->program_size,
+        .code = malloc((snapshot->program_size + INSTR_MAX_SIZE) * sizeof(DecodedInstr)),
+        .stack_begging = snapshot->stack_begging,
+        .ports = new_port_table(),
+        .symbol_table = copy_symbol_table(snapshot->symbol_table),
+        .jit = jit,
+        .stats = snapshot->stats,
+        .input_file = snapshot->input_file,
+        .dump_file = NULL,
+        .on_error = vm->on_error,
+        .private_devices = true,
+        .failed = false,
+    };
+    memcpy(vm->registers, snapshot->registers, sizeof(vm->registers));
+    memcpy(vm->code, snapshot->code, (snapshot->program_size + INSTR_MAX_SIZE) * sizeof(DecodedInstr));
+    for (size_t id = 0; id < PORT_COUNT; id++) {
+        const Port *p = &snapshot->ports[id];
+        if (!p->attached) {
+            continue;
+        }
+        Port port = *p;
+        // Rings belong to a single VM, so asynchronous devices are never shared (see vm_snapshot)
+        if (p->device.share && p->device.share(vm->memory) == 0) {
+            port.device = device_ref(p->device);
+        } else {
+            // The instance belongs to another VM, so the fork gets its own one
+            const char *msg = new_device(p->device.filename, true, &port.device);
+            if (msg) {
+                error_dl(vm, msg);
+            }
+            word code = start_device(vm, &port);
+            if (code != 0) {
+                free_device(&port.device);
+                error_dev_open(vm, p->device.filename, code);
+            }
+        }
+        vm->ports[id] = port;
+    }
+    if (vm->jit) {
+        jit_reset(vm->jit, vm);
+    }
+}
+
+void vm_abort(VM *vm) {
+    if (vm->on_error) {
+        longjmp(*vm->on_error, 1);
+    }
+    exit(EXIT_FAILURE);
+}
+
+void vm_load(VM *vm, const char *input_file) {
+    vm->input_file = input_file;
+    ExecFile exec_file;
+    if (!execfile_read(input_file, &exec_file)) {
+        error_invalid_program(vm);
+    }
+    vm_load_execfile(vm, exec_file);
+    free_execfile(&exec_file);
+}
+
+void vm_load_execfile(VM *vm, ExecFile exec_file) {
+    // The names an object uses are still zeros in its program
+    if (execfile_get_section(exec_file, "relocs") || execfile_get_section(exec_file, "undefined")) {
+        error_unlinked_object(vm);
+    }
+    // A failed program may have left requests that would write to the new memory
+    drain_all_ports(vm);
+    vm->failed = false;
+    memset(vm->registers, 0, sizeof(vm->registers));
+    memset(vm->memory, 0, MEMORY_SIZE);
+    memset(&vm->stats, 0, sizeof(vm->stats));
+    vector_clean(vm->symbol_table);
+    free(vm->code);
+    vm->code = NULL;
+    vm->program_size = 0;
+
+    vm_load_program_section(vm, exec_file);
+    for (size_t id = 0; id < PORT_COUNT; id++) {
+        vm->ports[id].stale = vm->ports[id].from_program;
+        vm->ports[id].in_calls = vm->ports[id].out_calls = 0;
+        vm->ports[id].in_bytes = vm->ports[id].out_bytes = 0;
+        vm->ports[id].next_tag = 0;
+    }
+    vm_perform_directives(vm, exec_file);
+    for (size_t id = 0; id < PORT_COUNT; id++) {
+        if (vm->ports[id].stale) {
+            vm_unload_port(vm, id);
+        }
+    }
+    vm_load_symbol_table(vm, exec_file);
+    vm_predecode(vm);
+    if (vm->jit) {
+        jit_reset(vm->jit, vm);
+    }
+
+    foreach(Symbol, s, vm->symbol_table) {
+        if (strcmp(s->name, ENTRY_POINT_NAME) == 0) {
+            vm->registers[REG_IP] = s->declaration_address;
+            break;
+        }
+    }
 }
 
 void vm_load_program_section(VM *vm, ExecFile exec_file) {
-    vector(byte) compiled_program = execfile_get_section_content(exec_file, "program");
-    if (compiled_program == NULL) {
-        error_couldnot_find_section("program");
+    SectionView program = execfile_view_section(exec_file, "program");
+    if (program.data == NULL) {
+        error_no_section(vm, "program");
     }
-    size_t program_size = vector_size(compiled_program);
-    if (program_size > MEMORY_SIZE) {
-        error_too_big_program();
+    if (program.size > MEMORY_SIZE) {
+        error_too_big_program(vm);
     }
-    memcpy(vm->memory, compiled_program, vector_size(compiled_program));
-    vm->program_size = program_size;
-    vm->stack_begging = program_size + STACK_OFFSET + STACK_MAX_SIZE;
+    memcpy(vm->memory, program.data, program.size);
+    vm->program_size = program.size;
+    vm->code = calloc(program.size + INSTR_MAX_SIZE, sizeof(DecodedInstr));
+    for (size_t i = program.size; i < program.size + INSTR_MAX_SIZE; i++) {
+        vm->code[i].handler = HANDLER_HALT;
+    }
+    vm->stack_begging = program.size + STACK_OFFSET + STACK_MAX_SIZE;
     vm->registers[REG_SP] = vm->stack_begging;
-    free_vector(&compiled_program);
-    push_in_stack(vm, (word)program_size);
+    push_in_stack(vm, (word)program.size);
 }
 
 void vm_perform_directives(VM *vm, ExecFile exec_file) {
-    vector(byte) compiled_directives = execfile_get_section_content(exec_file, "directives");
-    if (!compiled_directives)
-        return;
-    byte *cursor = compiled_directives;
-    byte *section_end = cursor + vector_size(compiled_directives) - 1;
-    byte dir_code = *cursor++;
+    SectionView directives = execfile_view_section(exec_file, "directives");
+    const byte *cursor = directives.data;
+    const byte *section_end = cursor + directives.size;
     while (cursor < section_end) {
+        byte dir_code = *cursor++;
         switch (dir_code) {
+            // #use "path" port
             case 0b001: {
-                string path = NULL;
-                while (*cursor != 0) string_push_char(&path, *cursor++);
-                byte port = *(++cursor);
-                vm_load_device(vm, path, port);
-                free_string(&path);
+                const byte *path_end = memchr(cursor, 0, section_end - cursor);
+                if (!path_end || path_end + 1 >= section_end) {
+                    return;
+                }
+                byte port = path_end[1];
+                load_device(vm, (const char *)cursor, port, true);
+                cursor = path_end + 2;
             }; break;
+
+            default:
+                return;
         }
     }
-    free_vector(&compiled_directives);
 }
 
 void vm_load_symbol_table(VM *vm, ExecFile exec_file) {
-    vector(byte) compiled_symbols = execfile_get_section_content(exec_file, "symbols");
-    if (compiled_symbols == NULL) {
-        error_couldnot_find_section("symbols");
+    SectionView symbols = execfile_view_section(exec_file, "symbols");
+    if (symbols.data == NULL) {
+        error_no_section(vm, "symbols");
     }
-    byte *cursor = compiled_symbols;
-    byte *section_end = cursor + vector_size(compiled_symbols) - 1;
-    string name = NULL;
+    const byte *cursor = symbols.data;
+    const byte *section_end = cursor + symbols.size;
     while (cursor < section_end) {
-        while (*cursor != 0) string_push_char(&name, *cursor++);
-        word addr = read_word_as_big_endian(++cursor);
-        vector_push_back(vm->symbol_table, new_symbol(name, addr));
-        cursor += 2;
-        vector_clean(name);
+        const byte *name_end = memchr(cursor, 0, section_end - cursor);
+        if (!name_end || name_end + 2 >= section_end) {
+            break;
+        }
+        word addr = read_word_as_big_endian(name_end + 1);
+        vector_push_back(vm->symbol_table, new_symbol((const char *)cursor, addr));
+        cursor = name_end + 3;
     }
-    free_vector(&compiled_symbols);
-    free_string(&name);
 }
 
-void vm_load_device(VM *vm, const char *device_file, int port_id) {
+void vm_predecode(VM *vm) {
+    foreach(Symbol, s, vm->symbol_table) {
+        word addr = s->declaration_address;
+        // Stops on data, the end of the program or code that was already decoded
+        while (addr < vm->program_size && vm->code[addr].size == 0) {
+            DecodedInstr instr = decode_instr(vm->memory, MEMORY_SIZE, addr);
+            if (instr.opcode == 0 || instr.opcode >= INSTR_COUNT) {
+                break;
+            }
+            vm->code[addr] = instr;
+            addr += instr.size;
+        }
+    }
+    for (size_t addr = 0; addr < vm->program_size; addr++) {
+        DecodedInstr *first = &vm->code[addr];
+        if (first->size == 0 || addr + first->size >= vm->program_size) {
+            continue;
+        }
+        DecodedInstr *second = &vm->code[addr + first->size];
+        if (second->size != 0) {
+            first->handler = fuse_instrs(*first, *second);
+        }
+    }
+}
+
+void vm_invalidate_code(VM *vm, word addr, size_t size) {
+    size_t end = (size_t)addr + size;
+    if (end > MEMORY_SIZE) {
+        vm_invalidate_code(vm, 0, end - MEMORY_SIZE);
+        end = MEMORY_SIZE;
+    }
+    if (addr >= vm->program_size) {
+        return;
+    }
+    size_t begin = addr >= RECORD_MAX_SIZE - 1 ? addr - (RECORD_MAX_SIZE - 1) : 0;
+    end = min(end, vm->program_size);
+    memset(vm->code + begin, 0, (end - begin) * sizeof(DecodedInstr));
+    if (vm->jit) {
+        jit_invalidate(vm->jit, addr, end);
+    }
+}
+
+static void load_device(VM *vm, const char *device_file, int port_id, bool from_program) {
     byte id = port_id;
     if (port_id == -1) {
-        id = vm_get_free_port_id(*vm);
+        id = vm_get_free_port_id(vm);
         printf("Device %s attached to port %d\n", device_file, id);
     }
     if (id == 0) {
-        error_using_preserve_port();
+        error_using_preserve_port(vm);
+    }
+    Port *attached = vm_get_port(vm, id);
+    if (attached) {
+        // Reloading a device is expensive, so a reused VM keeps it
+        if (attached->from_program == from_program && strcmp(attached->device.filename, device_file) == 0) {
+            attached->stale = false;
+            return;
+        }
+        vm_unload_port(vm, id);
+    }
+    Port port = { .id = id, .attached = true, .from_program = from_program };
+    const char *msg = new_device(device_file, vm->private_devices, &port.device);
+    if (msg) {
+        error_dl(vm, msg);
     }
-    Device dev = new_device(device_file);
-    Port p = { id, dev };
-    vector_push_back(vm->ports, p);
-    word code = dev.init(vm->memory);
+    word code = start_device(vm, &port);
     if (code != 0) {
-        error_dev_open(device_file, code);
+        free_device(&port.device);
+        error_dev_open(vm, device_file, code);
     }
+    vm->ports[id] = port;
 }
 
-Port *vm_get_port(VM vm, byte port_id) {
-    Port *port = NULL;
-    foreach(Port, p, vm.ports) {
-        if (p->id == port_id) {
-            port = p;
+void vm_load_device(VM *vm, const char *device_file, int port_id) {
+    load_device(vm, device_file, port_id, false);
+}
+
+void vm_unload_port(VM *vm, byte port_id) {
+    Port *port = vm_get_port(vm, port_id);
+    if (!port) {
+        return;
+    }
+    if (port->rings) {
+        vm_port_wait(vm, port);
+    }
+    Device *dev = &port->device;
+    // Shared instances are closed by their last user
+    if (device_unref(dev)) {
+        word code = dev->fini();
+        if (code != 0) {
+            error_dev_close(vm, dev->filename, code);
+        }
+        close_device(dev);
+    }
+    free(port->rings);
+    memset(port, 0, sizeof(Port));
+}
+
+// ------------------------------------------------------------------------------------------------
+// Asynchronous ports (device ABI v2)
+
+static void collect_completions(VM *vm, Port *port) {
+    DeviceRings *rings = port->rings;
+    uint32_t head = atomic_load_explicit(&rings->cq_head, memory_order_relaxed);
+    uint32_t tail = atomic_load_explicit(&rings->cq_tail, memory_order_acquire);
+    for (; head != tail; head++) {
+        DeviceCompletion *c = &rings->cq[head % DEVICE_RING_SIZE];
+        if (c->request.op == DEVICE_READ) {
+            vm_invalidate_code(vm, c->request.addr, c->request.size);
+        }
+        port->async_result += c->result;
+    }
+    atomic_store_explicit(&rings->cq_head, head, memory_order_release);
+}
+
+// Sleeps until the device completes something. See device_complete for the other side
+static void wait_for_completions(DeviceRings *rings) {
+    uint32_t head = atomic_load_explicit(&rings->cq_head, memory_order_relaxed);
+    atomic_store(&rings->vm_waiting, true);
+    uint32_t tail = atomic_load(&rings->cq_tail);
+    if (tail == head) {
+        syscall(SYS_futex, &rings->cq_tail, FUTEX_WAIT_PRIVATE, tail, NULL, NULL, 0);
+    }
+    atomic_store(&rings->vm_waiting, false);
+}
+
+word vm_port_submit(VM *vm, Port *port, DeviceOp op, word addr, word size) {
+    DeviceRings *rings = port->rings;
+    uint32_t tail = atomic_load_explicit(&rings->sq_tail, memory_order_relaxed);
+    // Every uncollected request may need a slot in the completion ring
+    while (tail - atomic_load_explicit(&rings->cq_head, memory_order_relaxed) >= DEVICE_RING_SIZE) {
+        collect_completions(vm, port);
+        if (tail - atomic_load_explicit(&rings->cq_head, memory_order_relaxed) >= DEVICE_RING_SIZE) {
+            wait_for_completions(rings);
+        }
+    }
+    word tag = port->next_tag++;
+    rings->sq[tail % DEVICE_RING_SIZE] = (DeviceRequest) { op, addr, size, tag };
+    atomic_store(&rings->sq_tail, tail + 1);
+    // A device that is busy with the previous requests will pick this one up by itself
+    if (atomic_exchange(&rings->need_wakeup, false)) {
+        port->device.notify();
+    }
+    return tag;
+}
+
+word vm_port_wait(VM *vm, Port *port) {
+    DeviceRings *rings = port->rings;
+    if (!rings) {
+        return 0;
+    }
+    uint32_t tail = atomic_load_explicit(&rings->sq_tail, memory_order_relaxed);
+    for (;;) {
+        collect_completions(vm, port);
+        if (atomic_load_explicit(&rings->cq_head, memory_order_relaxed) == tail) {
             break;
         }
+        wait_for_completions(rings);
     }
-    return port;
+    word result = port->async_result;
+    port->async_result = 0;
+    return result;
 }
 
-byte vm_get_free_port_id(VM vm) {
-    for (word id = 1; id < 256; id++) {
-        Port *p = vm_get_port(vm, id);
-        if (!p) {
+byte vm_get_free_port_id(VM *vm) {
+    for (size_t id = 1; id < PORT_COUNT; id++) {
+        if (!vm->ports[id].attached) {
             return id;
         }
     }
-    error_no_free_ports();
+    error_no_free_ports(vm);
     return 0; // UNREACHABLE
 }
 
 int exec_instr(VM *vm) {
-    if (vm->registers[REG_IP] >= vm->program_size) {
+    word ip = vm->registers[REG_IP];
+    if (ip >= vm->program_size) {
         return 0;
     }
-    byte *mem = vm->memory + vm->registers[REG_IP];
-    unsigned long buffer = read_ulong_as_big_endian(mem);
-    size_t read_bits_count = 0;
-    byte opcode = read_bits(&buffer, &read_bits_count, OPCODE_BIT_SIZE);
-    switch (opcode) {
-        // mov
-        case 0b00001: {
-            word dest_reg = read_register(&buffer, &read_bits_count);
-            word flag = read_flag(&buffer, &read_bits_count);
-            word value;
-            if (flag) {
-                skip_alignment(&buffer, &read_bits_count, 6);
-                value = read_number(&buffer, &read_bits_count);
-            } else {
-                value = vm->registers[read_register(&buffer, &read_bits_count)];
-            }
-            vm->registers[dest_reg] = value;
-        }; break;
+    if (vm->code[ip].size == 0) {
+        vm->code[ip] = decode_instr(vm->memory, MEMORY_SIZE, ip);
+    }
+    // A copy, because the instruction may overwrite itself
+    DecodedInstr instr = vm->code[ip];
+    vm->stats.retired[instr.opcode]++;
+    switch (instr.opcode) {
+        case INSTR_MOV:
+            vm->registers[instr.reg[0]] = instr_operand(vm, instr, 1);
+            break;
 
-        // load
-        case 0b00010: {
-            word dest_reg = read_register(&buffer, &read_bits_count);
-            word flag = read_flag(&buffer, &read_bits_count);
-            word addr;
-            if (flag) {
-                skip_alignment(&buffer, &read_bits_count, 6);
-                addr = read_number(&buffer, &read_bits_count);
-            } else {
-                addr = vm->registers[read_register(&buffer, &read_bits_count)];
-            }
-            vm->registers[dest_reg] = read_word_as_big_endian(vm->memory + addr);
+        case INSTR_LD: {
+            word addr = instr_operand(vm, instr, 1);
+            vm->registers[instr.reg[0]] = load_word(vm->memory, addr);
         }; break;
 
-        // store
-        case 0b00011: {
-            word src_reg = read_register(&buffer, &read_bits_count);
-            word flag = read_flag(&buffer, &read_bits_count);
-            word addr;
-            if (flag) {
-                skip_alignment(&buffer, &read_bits_count, 6);
-                addr = read_number(&buffer, &read_bits_count);
-            } else {
-                addr = vm->registers[read_register(&buffer, &read_bits_count)];
-            }
-            word value = vm->registers[src_reg];
-            vm->memory[addr++] = value >> 8;
-            vm->memory[addr] = value & 0xff;
+        case INSTR_ST: {
+            word addr = instr_operand(vm, instr, 1);
+            word value = vm->registers[instr.reg[0]];
+            vm->memory[addr] = value >> 8;
+            vm->memory[(word)(addr + 1)] = value & 0xff;
+            vm_invalidate_code(vm, addr, 2);
         }; break;
 
-        // add, sub, mul, div, and, or, xor, shl, shr
-        case 0b00100: reg_reg_binop(&buffer, &read_bits_count, +=); break;
-        case 0b00101: reg_reg_binop(&buffer, &read_bits_count, -=); break;
-        case 0b00110: reg_reg_binop(&buffer, &read_bits_count, *=); break;
-        case 0b00111: reg_reg_binop(&buffer, &read_bits_count, /=); break;
-        case 0b01101: reg_reg_binop(&buffer, &read_bits_count, &=); break;
-        case 0b01110: reg_reg_binop(&buffer, &read_bits_count, |=); break;
-        case 0b01111: reg_reg_binop(&buffer, &read_bits_count, ^=); break;
-        case 0b10000: reg_reg_binop(&buffer, &read_bits_count, <<=); break;
-        case 0b10001: reg_reg_binop(&buffer, &read_bits_count, >>=); break;
-
-        // not
-        case 0b01000: {
-            word reg = read_register(&buffer, &read_bits_count);
-            vm->registers[reg] = ~vm->registers[reg];
-        }; break;
+        case INSTR_ADD: reg_reg_binop(vm, instr, +=); break;
+        case INSTR_SUB: reg_reg_binop(vm, instr, -=); break;
+        case INSTR_MUL: reg_reg_binop(vm, instr, *=); break;
+        case INSTR_DIV: reg_reg_binop(vm, instr, /=); break;
+        case INSTR_AND: reg_reg_binop(vm, instr, &=); break;
+        case INSTR_OR:  reg_reg_binop(vm, instr, |=); break;
+        case INSTR_XOR: reg_reg_binop(vm, instr, ^=); break;
+        case INSTR_SHL: reg_reg_binop(vm, instr, <<=); break;
+        case INSTR_SHR: reg_reg_binop(vm, instr, >>=); break;
+
+        case INSTR_NOT:
+            vm->registers[instr.reg[0]] = ~vm->registers[instr.reg[0]];
+            break;
 
-        // push
-        case 0b01001: {
-            word reg = read_register(&buffer, &read_bits_count);
-            push_in_stack(vm, vm->registers[reg]);
-        }; break;
+        case INSTR_PUSH:
+            push_in_stack(vm, vm->registers[instr.reg[0]]);
+            break;
 
-        // pop
-        case 0b01010: {
-            word reg = read_register(&buffer, &read_bits_count);
+        case INSTR_POP: {
             word value = pop_from_stack(vm);
-            vm->registers[reg] = value;
+            vm->registers[instr.reg[0]] = value;
         }; break;
 
-        // call
-        case 0b01011: {
-            skip_alignment(&buffer, &read_bits_count, 3);
-            word func_addr = read_number(&buffer, &read_bits_count);
-            word ret_addr = vm->registers[REG_IP] + 3;
-            push_in_stack(vm, ret_addr);
-            vm->registers[REG_IP] = func_addr;
+        case INSTR_CALL:
+            push_in_stack(vm, ip + instr.size);
+            vm->registers[REG_IP] = instr.imm[0];
+            count_call(&vm->stats);
+            if (vm->callgraph) {
+                callgraph_call(vm->callgraph, ip, instr.imm[0], ip + instr.size);
+            }
             return 1;
-        }; break;
 
-        // ret
-        case 0b01100: {
+        case INSTR_RET:
             vm->registers[REG_IP] = pop_from_stack(vm);
+            count_ret(&vm->stats);
+            if (vm->callgraph) {
+                callgraph_ret(vm->callgraph, vm->registers[REG_IP]);
+            }
             return 1;
-        }; break;
 
-        // jmp
-        case 0b10010: {
-            skip_alignment(&buffer, &read_bits_count, 3);
-            word addr = read_number(&buffer, &read_bits_count);
-            vm->registers[REG_IP] = addr;
+        case INSTR_JMP:
+            vm->registers[REG_IP] = instr.imm[0];
             return 1;
-        }; break;
 
-        // cmp
-        case 0b10011: {
-            word a = vm->registers[read_register(&buffer, &read_bits_count)];
-            word flag = read_flag(&buffer, &read_bits_count);
-            short b;
-            if (flag) {
-                skip_alignment(&buffer, &read_bits_count, 6);
-                b = read_number(&buffer, &read_bits_count);
-            } else {
-                b = vm->registers[read_register(&buffer, &read_bits_count)];
-            }
+        case INSTR_CMP: {
+            word a = vm->registers[instr.reg[0]];
+            short b = instr_operand(vm, instr, 1);
             vm->registers[REG_CF] = 0;
             if (a == b)      { vm->registers[REG_CF] = CMP_EQ; }
             else if (a <= b) { vm->registers[REG_CF] = CMP_LT; }
@@ -337,98 +647,287 @@ int exec_instr(VM *vm) {
             else if (a != b) { vm->registers[REG_CF] = CMP_NQ; }
         }; break;
 
-        // jif
-        case 0b10100: {
-            word cmp = read_bits(&buffer, &read_bits_count, 3);
-            word addr = read_number(&buffer, &read_bits_count);
+        case INSTR_JIF: {
+            word cmp = instr.aux;
             if ((cmp == CMP_NQ && vm->registers[REG_CF] != CMP_EQ) || cmp == vm->registers[REG_CF]) {
-                vm->registers[REG_IP] = addr;
+                vm->stats.jif_taken++;
+                vm->registers[REG_IP] = instr.imm[0];
                 return 1;
             }
+            vm->stats.jif_not_taken++;
         }; break;
 
-        // out
-        case 0b10101: {
-            byte port_id = read_byte(&buffer, &read_bits_count);
-            bool is_first_num = read_flag(&buffer, &read_bits_count);
-            bool is_second_num = read_flag(&buffer, &read_bits_count);
-            word addr;
-            if (is_first_num) {
-                skip_alignment(&buffer, &read_bits_count, 1);
-                addr = read_number(&buffer, &read_bits_count);
-            } else {
-                addr = vm->registers[read_register(&buffer, &read_bits_count)];
-            }
-            word size;
-            if (is_second_num) {
-                skip_alignment(&buffer, &read_bits_count, 1);
-                size = read_number(&buffer, &read_bits_count);
-            } else {
-                size = vm->registers[read_register(&buffer, &read_bits_count)];
-            }
-            Port *port = vm_get_port(*vm, port_id);
+        case INSTR_OUT: {
+            word addr = instr_operand(vm, instr, 1);
+            word size = instr_operand(vm, instr, 2);
+            Port *port = vm_get_port(vm, instr.aux);
             if (!port)
-                error_no_device_attached(port_id);
-            word code = port->device.write(addr, size);
+                error_no_device_attached(vm, instr.aux);
+            port->out_calls++;
+            port->out_bytes += size;
+            word code = port->rings ? vm_port_submit(vm, port, DEVICE_WRITE, addr, size)
+                                    : port->device.write(addr, size);
             vm->registers[0] = code;
         }; break;
 
-        // in
-        case 0b10110: {
-            byte port_id = read_byte(&buffer, &read_bits_count);
-            bool is_first_num = read_flag(&buffer, &read_bits_count);
-            bool is_second_num = read_flag(&buffer, &read_bits_count);
-            word addr;
-            if (is_first_num) {
-                skip_alignment(&buffer, &read_bits_count, 1);
-                addr = read_number(&buffer, &read_bits_count);
-            } else {
-                addr = vm->registers[read_register(&buffer, &read_bits_count)];
-            }
-            word size;
-            if (is_second_num) {
-                skip_alignment(&buffer, &read_bits_count, 1);
-                size = read_number(&buffer, &read_bits_count);
-            } else {
-                size = vm->registers[read_register(&buffer, &read_bits_count)];
-            }
-            Port *port = vm_get_port(*vm, port_id);
+        case INSTR_IN: {
+            word addr = instr_operand(vm, instr, 1);
+            word size = instr_operand(vm, instr, 2);
+            Port *port = vm_get_port(vm, instr.aux);
             if (!port)
-                error_no_device_attached(port_id);
+                error_no_device_attached(vm, instr.aux);
+            port->in_calls++;
+            port->in_bytes += size;
+            if (port->rings) {
+                // The code is invalidated when the request completes
+                vm->registers[0] = vm_port_submit(vm, port, DEVICE_READ, addr, size);
+                break;
+            }
             word code = port->device.read(addr, size);
             vm->registers[0] = code;
+            vm_invalidate_code(vm, addr, size);
+        }; break;
+
+        case INSTR_WAIT: {
+            Port *port = vm_get_port(vm, instr.aux);
+            if (!port)
+                error_no_device_attached(vm, instr.aux);
+            vm->registers[0] = vm_port_wait(vm, port);
         }; break;
 
         default:
-            printf("Reached unknown instruction with opcode: 0x%02x\n", opcode);
-            dump_vm(*vm, "instr_unknown.dump");
-            exit(EXIT_FAILURE);
+            error_unknown_instruction(vm, instr.opcode);
     }
-    size_t read_bytes_count = read_bits_count / 8;
-    if (read_bits_count / 8.0 > (int)(read_bits_count / 8.0)) {
-        read_bytes_count += 1;
-    }
-    vm->registers[REG_IP] += read_bytes_count;
+    vm->registers[REG_IP] += instr.size;
     return 1;
 }
 
+#ifdef VM_THREADED_DISPATCH
+
+#ifndef __GNUC__
+#error "Threaded dispatch needs labels as values, build with DISPATCH=switch"
+#endif
+
+// Moves the register file between the VM and the locals of vm_run
+#define regs_store() \
+    do { \
+        memcpy(vm->registers, regs, sizeof(regs)); \
+        vm->registers[REG_IP] = ip; \
+    } while(0)
+#define regs_load() \
+    do { \
+        memcpy(regs, vm->registers, sizeof(regs)); \
+        ip = vm->registers[REG_IP]; \
+    } while(0)
+
+#define operand(idx) \
+    ((instr->kinds & OPERAND_IMM(idx)) ? instr->imm[(idx) - 1] : regs[instr->reg[idx]])
+
+#define dispatch() \
+    do { \
+        sample(); \
+        dispatched[(instr = &code[ip])->handler]++; \
+        goto *handlers[instr->handler]; \
+    } while(0)
+// Instructions that may overwrite themselves must read their size beforehand
+#define next_by(size) do { ip += (size); dispatch(); } while(0)
+#define next() next_by(instr->size)
+#define jump(target) \
+    do { \
+        ip = (target); \
+        goto branch; \
+    } while(0)
+
+#define binop(op) \
+    do { \
+        short value = operand(1); \
+        regs[instr->reg[0]] op value; \
+        next(); \
+    } while(0)
+
+// Overflows and writes into the program section are left to push_in_stack
+#define push(value) \
+    do { \
+        word pushed = (value); \
+        if (stack_begging - regs[REG_SP] >= STACK_MAX_SIZE || regs[REG_SP] < program_size + 2) { \
+            regs_store(); \
+            push_in_stack(vm, pushed); \
+            regs_load(); \
+        } else { \
+            memory[--regs[REG_SP]] = pushed >> 8; \
+            memory[--regs[REG_SP]] = pushed & 0xff; \
+            stats->max_stack_size = max(stats->max_stack_size, stack_begging - regs[REG_SP]); \
+        } \
+    } while(0)
+
+#define pop(dest) \
+    do { \
+        if (regs[REG_SP] >= stack_begging) { \
+            regs_store(); \
+            pop_from_stack(vm); \
+        } \
+        dest = memory[regs[REG_SP]++]; \
+        dest |= memory[regs[REG_SP]++] << 8; \
+    } while(0)
+
+#define load() \
+    do { \
+        word addr = operand(1); \
+        regs[instr->reg[0]] = load_word(memory, addr); \
+    } while(0)
+
+#define compare() \
+    do { \
+        word a = regs[instr->reg[0]]; \
+        short b = operand(1); \
+        regs[REG_CF] = 0; \
+        if (a == b)      { regs[REG_CF] = CMP_EQ; } \
+        else if (a <= b) { regs[REG_CF] = CMP_LT; } \
+        else if (a >= b) { regs[REG_CF] = CMP_GT; } \
+        else if (a < b)  { regs[REG_CF] = CMP_LQ; } \
+        else if (a > b)  { regs[REG_CF] = CMP_GQ; } \
+        else if (a != b) { regs[REG_CF] = CMP_NQ; } \
+    } while(0)
+
+#define condition_met() \
+    ((instr->aux == CMP_NQ && regs[REG_CF] != CMP_EQ) || instr->aux == regs[REG_CF])
+
+#define sample()
+#define RUN_LOOP run_loop
+#define PROFILING 0
+#include "run_loop.h"
+#undef sample
+#undef RUN_LOOP
+#undef PROFILING
+
+#define sample() \
+    do { \
+        if (--countdown <= 0) { \
+            countdown = PROFILE_INTERVAL; \
+            profiler_sample(vm->profiler, vm, ip, regs[REG_SP]); \
+        } \
+    } while(0)
+#define RUN_LOOP run_loop_profiled
+#define PROFILING 1
+#include "run_loop.h"
+
+#else
+
+// Only jumps lead to the JIT
+static void enter_jit(VM *vm, word ip) {
+    word next_ip = vm->registers[REG_IP];
+    if (vm->jit && ip < vm->program_size && next_ip != ip + vm->code[ip].size) {
+        vm->registers[REG_IP] = jit_enter(vm->jit, vm, next_ip, vm->registers);
+    }
+}
+
+// Compiled blocks count down the same countdown and return here when a sample is due
+static void run_loop_profiled(VM *vm) {
+    int64_t local_countdown;
+    int64_t *countdown = vm->jit ? vm->jit->countdown : &local_countdown;
+    *countdown = PROFILE_INTERVAL;
+    word ip = vm->registers[REG_IP];
+    while (true) {
+        if (--*countdown <= 0) {
+            *countdown = PROFILE_INTERVAL;
+            profiler_sample(vm->profiler, vm, vm->registers[REG_IP], vm->registers[REG_SP]);
+        }
+        if (!exec_instr(vm)) {
+            break;
+        }
+        enter_jit(vm, ip);
+        ip = vm->registers[REG_IP];
+    }
+}
+
+static void run_loop(VM *vm) {
+    word ip = vm->registers[REG_IP];
+    while (exec_instr(vm)) {
+        enter_jit(vm, ip);
+        ip = vm->registers[REG_IP];
+    }
+}
+
+#endif
+
+// Every instruction goes through exec_instr, where call and ret feed the call graph
+static void run_loop_instrumented(VM *vm) {
+    CallGraph *graph = vm->callgraph;
+    while (vm->registers[REG_IP] < vm->program_size) {
+        graph->cost++;
+        exec_instr(vm);
+    }
+    callgraph_finish(graph);
+}
+
+void vm_run(VM *vm) {
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (vm->callgraph) {
+        run_loop_instrumented(vm);
+    } else if (vm->profiler) {
+        run_loop_profiled(vm);
+    } else {
+        run_loop(vm);
+    }
+    drain_all_ports(vm);
+    if (vm->jit) {
+        jit_collect_stats(vm->jit, &vm->stats);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    vm->stats.run_time += (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+unsigned long vm_stats_retired(const VMStats *stats, byte opcode) {
+    unsigned long count = stats->retired[opcode];
+    if (opcode < INSTR_COUNT) {
+        count += stats->dispatched[opcode];
+    }
+    for (byte handler = FUSED_FIRST; handler < HANDLER_COUNT; handler++) {
+        byte first, second;
+        fused_handler_opcodes(handler, &first, &second);
+        count += stats->dispatched[handler] * ((first == opcode) + (second == opcode));
+    }
+    return count;
+}
+
+unsigned long vm_stats_total_retired(const VMStats *stats) {
+    unsigned long count = 0;
+    for (size_t opcode = 1; opcode < ARRAY_LEN(stats->retired); opcode++) {
+        count += vm_stats_retired(stats, opcode);
+    }
+    return count;
+}
+
+void vm_stats_add(VMStats *total, const VMStats *stats) {
+    for (size_t i = 0; i < ARRAY_LEN(total->retired); i++) {
+        total->retired[i] += stats->retired[i];
+    }
+    for (size_t i = 0; i < HANDLER_COUNT; i++) {
+        total->dispatched[i] += stats->dispatched[i];
+    }
+    total->jif_taken += stats->jif_taken;
+    total->jif_not_taken += stats->jif_not_taken;
+    total->max_call_depth = max(total->max_call_depth, stats->max_call_depth);
+    total->max_stack_size = max(total->max_stack_size, stats->max_stack_size);
+    total->run_time += stats->run_time;
+}
+
 void push_in_stack(VM *vm, word value) {
     if (vm->stack_begging - vm->registers[REG_SP] >= STACK_MAX_SIZE) {
-        fprintf(stderr, "Stack overflow (vm dumped)\n");
-        dump_vm(*vm, "stackowerflow.dump");
-        exit(1);
+        error_stack_overflow(vm);
     }
     vm->memory[--vm->registers[REG_SP]] = value >> 8;
     vm->memory[--vm->registers[REG_SP]] = value & 0xff;
+    vm->stats.max_stack_size = max(vm->stats.max_stack_size, (word)(vm->stack_begging - vm->registers[REG_SP]));
+    vm_invalidate_code(vm, vm->registers[REG_SP], 2);
 }
 
 word pop_from_stack(VM *vm) {
     if (vm->registers[REG_SP] >= vm->stack_begging) {
-        fprintf(stderr, "Stack is empty (vm dumped)\n");
-        dump_vm(*vm, "stackisempty.dump");
-        exit(1);
+        error_stack_empty(vm);
     }
     word value = vm->memory[vm->registers[REG_SP]++];
-    value |= vm->memory[vm->registers[REG_SP]++];
+    value |= vm->memory[vm->registers[REG_SP]++] << 8;
     return value;
 }
@@ -4,7 +4,12 @@
 #include "common/arch.h"
 #include "common/sex.h"
 #include "common/vector.h"
+#include "vm/decoder.h"
 #include "vm/device.h"
+#include "vm/jit.h"
+#include "vm/callgraph.h"
+#include "vm/profiler.h"
+#include <setjmp.h>
 #include <stdio.h>
 
 #define STACK_MAX_SIZE 64 * 2 // Size in bytes
@@ -12,7 +17,7 @@
 
 #define MEMORY_SIZE 256 * 256
 
-word read_word_as_big_endian(byte *memory);
+word read_word_as_big_endian(const byte *memory);
 
 typedef struct {
     string name;
@@ -28,28 +33,110 @@ void free_symbol(void *symbol);
 #define REG_IP 14
 #define REG_CF 15
 
-typedef struct {
+// Counters of a single VM, updated by the thread that runs it without any synchronization.
+// Use vm_stats_retired for the instructions of one opcode, they are counted in several places
+typedef struct VMStats {
+    unsigned long retired[1 << OPCODE_BIT_SIZE]; // By exec_instr and the JIT, indexed by opcode
+    unsigned long dispatched[HANDLER_COUNT];     // By the threaded loop, indexed by handler
+    unsigned long jif_taken;
+    unsigned long jif_not_taken;
+    unsigned long call_depth; // Current one, calls minus returns
+    unsigned long max_call_depth;
+    word max_stack_size;      // In bytes, at most STACK_MAX_SIZE
+    double run_time;          // Seconds spent in vm_run
+} VMStats;
+
+unsigned long vm_stats_retired(const VMStats *stats, byte opcode);
+unsigned long vm_stats_total_retired(const VMStats *stats);
+// Adds the counters of stats to total, keeping the maximums
+void vm_stats_add(VMStats *total, const VMStats *stats);
+
+typedef struct VM {
     word registers[16];
     byte *memory;
     size_t program_size;
+    DecodedInstr *code; // One record per address of the program section followed by HANDLER_HALT
     word stack_begging;
-    vector(Port) ports;
+    Port *ports; // PORT_COUNT entries indexed by port id
     vector(Symbol) symbol_table;
+    Jit *jit; // NULL if the JIT is disabled
+    Profiler *profiler; // NULL if the program is not profiled
+    CallGraph *callgraph; // NULL if calls are not traced
+    VMStats stats;
+    const char *input_file; // Used in error messages
+    const char *dump_file;  // Where errors of the program dump the VM, NULL for next to input_file
+    jmp_buf *on_error;      // Where errors return to. If NULL, they exit the process
+    bool private_devices;   // Load a private copy of every device (see new_device)
+    bool failed;            // An error was reported that did not abort the VM
 } VM;
 
-VM new_vm(const char *input_file);
+// Creates a VM without a program. It can be reused: every vm_load replaces the previous program
+VM new_vm(void);
 void free_vm(void *vm);
 
+// Frozen state of a VM. Any number of VMs can be forked from it, they share the memory image
+// copy-on-write (by page) and start right where the snapshotted VM stopped
+typedef struct {
+    int memory_fd; // memfd with the memory image
+    word registers[16];
+    size_t program_size;
+    DecodedInstr *code;
+    word stack_begging;
+    Port *ports; // References to the synchronous devices of the snapshotted VM, only the file of
+                 // asynchronous ones
+    vector(Symbol) symbol_table;
+    VMStats stats;
+    const char *input_file;
+    bool enable_jit;
+} VMSnapshot;
+
+// Waits for the requests in flight on asynchronous ports first
+VMSnapshot vm_snapshot(VM *vm);
+void free_snapshot(void *snapshot);
+// Makes vm a fork of the snapshot. Only vm->on_error and vm->jit are kept. The snapshot may outlive
+// the frame of the snapshotted VM and forks run on other threads, so the caller sets on_error up for
+// the thread that runs the fork. Errors while forking already return there, and the fork can be
+// freed then. The JIT of a previous fork is reset and reused, vm->jit is NULL for a fresh VM.
+// Devices that export `word share(byte *memory)` and return 0 from it are shared with the fork,
+// others (and every asynchronous device) are loaded and initialized again. Since read/write do not tell which VM calls them,
+// only devices that do not depend on the memory passed to init can be shared
+void vm_fork(const VMSnapshot *snapshot, VM *vm);
+
+// Reports are done by the error_* functions, this only unwinds to vm->on_error or exits
+_Noreturn void vm_abort(VM *vm);
+
+void vm_load(VM *vm, const char *input_file);
+// Resets the registers, the memory and the stats, then loads the program. Devices attached by the
+// previous program are kept if this one uses them too
+void vm_load_execfile(VM *vm, ExecFile exec_file);
 void vm_load_program_section(VM *vm, ExecFile exec_file);
 void vm_perform_directives(VM *vm, ExecFile exec_file);
 void vm_load_symbol_table(VM *vm, ExecFile exec_file);
+// Decodes the code reachable from every symbol and fuses common pairs into superinstructions.
+// Everything else is decoded lazily
+void vm_predecode(VM *vm);
+// Must be called after writing to [addr; addr + size) to drop decoded instructions covering it
+void vm_invalidate_code(VM *vm, word addr, size_t size);
 
 void vm_load_device(VM *vm, const char *device_file, int port_id);
-Port *vm_get_port(VM vm, byte port_id);
-byte vm_get_free_port_id(VM vm);
+// Returns NULL if no device is attached to the port
+#define vm_get_port(vm, port_id) ((vm)->ports[(byte)(port_id)].attached ? &(vm)->ports[(byte)(port_id)] : NULL)
+void vm_unload_port(VM *vm, byte port_id);
+byte vm_get_free_port_id(VM *vm);
+
+// Asynchronous ports (see DeviceRings). `in`/`out` submit a request and return its tag, blocking only
+// while DEVICE_RING_SIZE requests are uncollected. `wait` blocks until every request of the port is
+// completed and returns the sum of their results. Ports are drained when the program halts
+word vm_port_submit(VM *vm, Port *port, DeviceOp op, word addr, word size);
+// Returns 0 for synchronous ports
+word vm_port_wait(VM *vm, Port *port);
 
 // Returns 0 if the last instruction was executed, otherwise returns 1
 int exec_instr(VM *vm);
+// Executes instructions until the last one. Uses threaded dispatch if VM_THREADED_DISPATCH is defined.
+// Samples every PROFILE_INTERVAL instructions if vm->profiler is set. If vm->callgraph is set, runs
+// every instruction through exec_instr instead and never enters the JIT
+void vm_run(VM *vm);
 
 void push_in_stack(VM *vm, word value);
 word pop_from_stack(VM *vm);
@@ -5,22 +5,31 @@
 #include "io.h"
 #include "common/vector.h"
 #include "machine.h"
+#include "batch.h"
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
+#include <getopt.h>
 #include <stdlib.h>
 
-// I don't know how to name it better, so it is what it is
-typedef struct {
-    const char *device_file;
-    int port_id; // May be negative. -1 means free port
-} DeviceFileAndPort;
-
-const char *INPUT_FILE_NAME;
 bool ENABLE_COLORS = true;
 
 void print_help(const char *name);
 
+static const struct option LONG_OPTIONS[] = {
+    { "help",   no_argument,       NULL, 'h' },
+    { "device", required_argument, NULL, 'd' },
+    { "no-jit", no_argument,       NULL, 'i' },
+    { "stats",  no_argument,       NULL, 's' },
+    { "batch",  required_argument, NULL, 'b' },
+    { "jobs",   required_argument, NULL, 'j' },
+    { "profile", required_argument, NULL, 'p' },
+    { "callgraph", required_argument, NULL, 'c' },
+    { "stats-json", required_argument, NULL, 'J' },
+    { "forks", required_argument, NULL, 'F' },
+    { NULL, 0, NULL, 0 },
+};
+
 int main(int argc, char *argv[]) {
     if (argc < 2) {
         print_help(argv[0]);
@@ -28,9 +37,41 @@ int main(int argc, char *argv[]) {
     }
 
     vector(DeviceFileAndPort) devices_to_attach = NULL;
+    bool enable_jit = true;
+    bool show_stats = false;
+    const char *jobs_file = NULL;
+    size_t workers = 0;
+    const char *profile_file = NULL;
+    const char *callgraph_file = NULL;
+    const char *stats_file = NULL;
+    size_t fork_count = 0;
     int res = 0;
-    while ( (res = getopt(argc, argv, "hd:")) != -1 ) {
+    while ( (res = getopt_long(argc, argv, "hisd:b:j:p:c:", LONG_OPTIONS, NULL)) != -1 ) {
         switch (res) {
+            case 'p':
+                profile_file = optarg;
+                break;
+            case 'c':
+                callgraph_file = optarg;
+                break;
+            case 'J':
+                stats_file = optarg;
+                break;
+            case 'F':
+                fork_count = strtoul(optarg, NULL, 10);
+                break;
+            case 'b':
+                jobs_file = optarg;
+                break;
+            case 'j':
+                workers = strtoul(optarg, NULL, 10);
+                break;
+            case 'i':
+                enable_jit = false;
+                break;
+            case 's':
+                show_stats = true;
+                break;
             case 'h':
                 print_help(argv[0]);
                 exit(0);
@@ -46,30 +87,91 @@ int main(int argc, char *argv[]) {
             }; break;
         }
     }
-    INPUT_FILE_NAME = argv[optind];
-    if (!INPUT_FILE_NAME) {
+    if (jobs_file) {
+        BatchOptions options = { devices_to_attach, enable_jit, workers, show_stats };
+        size_t failed = run_batch(jobs_file, options);
+        free_vector(&devices_to_attach);
+        return failed == 0 ? 0 : EXIT_FAILURE;
+    }
+
+    const char *input_file = argv[optind];
+    if (!input_file) {
         fprintf(stderr, "You have to provide a program file!\n");
         return 1;
     }
 
-    VM vm = new_vm(INPUT_FILE_NAME);
+    if (fork_count) {
+        BatchOptions options = { devices_to_attach, enable_jit, workers, show_stats };
+        size_t failed = run_forks(input_file, fork_count, options);
+        free_vector(&devices_to_attach);
+        return failed == 0 ? 0 : EXIT_FAILURE;
+    }
+    if (profile_file && callgraph_file) {
+        fprintf(stderr, "--profile and --callgraph cannot be used together!\n");
+        return 1;
+    }
+
+    VM vm = new_vm();
+    // Compiled blocks cannot be traced
+    if (enable_jit && !callgraph_file) {
+        vm.jit = new_jit();
+    }
+    vm_load(&vm, input_file);
+    if (profile_file) {
+        vm.profiler = new_profiler(&vm);
+    }
+    if (callgraph_file) {
+        vm.callgraph = new_callgraph(&vm);
+    }
     foreach(DeviceFileAndPort, port, devices_to_attach) {
         vm_load_device(&vm, port->device_file, port->port_id);
     }
-    while (exec_instr(&vm)) {}
+    vm_run(&vm);
 
     dump_vm(vm, "vm.dump");
+    if (show_stats) {
+        print_stats(&vm);
+    }
+    if (stats_file) {
+        write_stats_json(&vm, stats_file);
+    }
+    if (profile_file) {
+        write_profile(&vm, profile_file);
+        print_profile(&vm);
+    }
+    if (callgraph_file) {
+        write_callgraph(&vm, callgraph_file);
+    }
 
     free_vm(&vm);
     free_vector(&devices_to_attach);
 
-    return 0;
+    return vm.failed ? EXIT_FAILURE : 0;
 }
 
 void print_help(const char *name) {
     printf("%s - a simple virtual machine.\n", name);
     printf("Usage: %s [options] program_file\n", name);
+    printf("       %s [options] --batch jobs_file [-j N]\n", name);
     printf("Options:\n");
-    printf("  -h          Prints this message and exit\n");
-    printf("  -d <file>   Loads device\n");
+    printf("  -h            Prints this message and exit\n");
+    printf("  -d <file>     Loads device\n");
+    printf("  -i, --no-jit  Disables the JIT compiler\n");
+    printf("  -s, --stats   Prints execution statistics to stderr on exit (summed over the jobs\n");
+    printf("                with --batch)\n");
+    printf("  --stats-json <file>\n");
+    printf("                Writes execution statistics to the file as JSON\n");
+    printf("  -p, --profile <file>\n");
+    printf("                Samples the program, writes folded stacks to the file and prints the\n");
+    printf("                hottest symbols to stderr on exit\n");
+    printf("  -c, --callgraph <file>\n");
+    printf("                Counts the instructions of every function and call, writes them to the\n");
+    printf("                file in the callgrind format. Disables the JIT compiler\n");
+    printf("  -b, --batch <file>\n");
+    printf("                Runs every `program [dump_file]` line of the file, devices are attached\n");
+    printf("                to every program\n");
+    printf("  -j, --jobs <N>\n");
+    printf("                Number of worker threads for --batch and --forks (default: one per CPU)\n");
+    printf("  --forks <N>   Snapshots the program once it is loaded and its devices are attached,\n");
+    printf("                then runs N forks of the snapshot. Prints how long a load and a fork take\n");
 }
@@ -0,0 +1,149 @@
+#include "profiler.h"
+#include "machine.h"
+#include <stdlib.h>
+#include <string.h>
+
+static void free_profile_symbol(void *symbol) {
+    free_string(&((ProfileSymbol *)symbol)->name);
+}
+
+static int compare_symbols(const void *a, const void *b) {
+    const ProfileSymbol *x = a, *y = b;
+    if (x->addr != y->addr) {
+        return x->addr < y->addr ? -1 : 1;
+    }
+    return strcmp(x->name, y->name);
+}
+
+Profiler *new_profiler(const VM *vm) {
+    Profiler *profiler = calloc(1, sizeof(Profiler));
+    vector_set_destructor(profiler->symbols, free_profile_symbol);
+    foreach(Symbol, s, vm->symbol_table) {
+        ProfileSymbol symbol = { new_string(s->name), s->declaration_address, 0, 0, 0 };
+        vector_push_back(profiler->symbols, symbol);
+    }
+    qsort(profiler->symbols, vector_size(profiler->symbols), sizeof(ProfileSymbol), compare_symbols);
+    ProfileSymbol unknown = { new_string("[unknown]"), 0, 0, 0, 0 };
+    vector_push_back(profiler->symbols, unknown);
+    profiler->stacks_capacity = 256;
+    profiler->stacks = calloc(profiler->stacks_capacity, sizeof(ProfileStack));
+    return profiler;
+}
+
+void free_profiler(Profiler *profiler) {
+    if (!profiler) {
+        return;
+    }
+    for (size_t i = 0; i < profiler->stacks_capacity; i++) {
+        free(profiler->stacks[i].frames);
+    }
+    free(profiler->stacks);
+    free_vector(&profiler->symbols);
+    free(profiler);
+}
+
+// Index of the nearest symbol at or before addr
+static word find_symbol(const Profiler *profiler, word addr) {
+    size_t count = vector_size(profiler->symbols) - 1;
+    size_t begin = 0, end = count;
+    while (begin < end) {
+        size_t mid = (begin + end) / 2;
+        if (profiler->symbols[mid].addr <= addr) {
+            begin = mid + 1;
+        } else {
+            end = mid;
+        }
+    }
+    return begin == 0 ? count : begin - 1;
+}
+
+// Returns the size of the call right before addr, or 0 if there is none
+static word is_return_address(const VM *vm, word addr) {
+    if (addr > vm->program_size) {
+        return 0;
+    }
+    // A call takes 2 bytes with an offset and 3 with an address
+    for (word size = 2; size <= 3 && size <= addr; size++) {
+        DecodedInstr instr = vm->code[addr - size];
+        if (instr.size == 0) {
+            instr = decode_instr(vm->memory, MEMORY_SIZE, addr - size);
+        }
+        if (instr.opcode == INSTR_CALL && instr.size == size) {
+            return size;
+        }
+    }
+    return 0;
+}
+
+static uint32_t hash_frames(const word *frames, size_t depth) {
+    uint32_t hash = 2166136261u; // FNV-1a
+    for (size_t i = 0; i < depth; i++) {
+        hash = (hash ^ frames[i]) * 16777619u;
+    }
+    return hash;
+}
+
+static ProfileStack *find_stack(ProfileStack *stacks, size_t capacity, uint32_t hash,
+                                const word *frames, size_t depth)
+{
+    for (size_t i = hash & (capacity - 1);; i = (i + 1) & (capacity - 1)) {
+        ProfileStack *s = &stacks[i];
+        if (s->depth == 0 || (s->hash == hash && s->depth == depth &&
+                              memcmp(s->frames, frames, depth * sizeof(word)) == 0)) {
+            return s;
+        }
+    }
+}
+
+static void grow_stacks(Profiler *profiler) {
+    size_t capacity = profiler->stacks_capacity * 2;
+    ProfileStack *stacks = calloc(capacity, sizeof(ProfileStack));
+    for (size_t i = 0; i < profiler->stacks_capacity; i++) {
+        ProfileStack *s = &profiler->stacks[i];
+        if (s->depth != 0) {
+            *find_stack(stacks, capacity, s->hash, s->frames, s->depth) = *s;
+        }
+    }
+    free(profiler->stacks);
+    profiler->stacks = stacks;
+    profiler->stacks_capacity = capacity;
+}
+
+void profiler_sample(Profiler *profiler, const VM *vm, word ip, word sp) {
+    word frames[PROFILE_MAX_DEPTH];
+    size_t depth = 0;
+    frames[PROFILE_MAX_DEPTH - 1 - depth++] = find_symbol(profiler, ip);
+    // Words are pushed high byte first, so the low byte is at the lower address
+    for (size_t addr = sp; addr + 2 <= vm->stack_begging && depth < PROFILE_MAX_DEPTH; addr += 2) {
+        word value = vm->memory[addr] | vm->memory[addr + 1] << 8;
+        word call_size = is_return_address(vm, value);
+        if (call_size != 0) {
+            frames[PROFILE_MAX_DEPTH - 1 - depth++] = find_symbol(profiler, value - call_size);
+        }
+    }
+    word *stack = frames + PROFILE_MAX_DEPTH - depth;
+
+    profiler->samples++;
+    profiler->symbols[stack[depth - 1]].self++;
+    for (size_t i = 0; i < depth; i++) {
+        ProfileSymbol *symbol = &profiler->symbols[stack[i]];
+        if (symbol->last_sample != profiler->samples) {
+            symbol->last_sample = profiler->samples;
+            symbol->total++;
+        }
+    }
+
+    if (2 * (profiler->stacks_used + 1) > profiler->stacks_capacity) {
+        grow_stacks(profiler);
+    }
+    uint32_t hash = hash_frames(stack, depth);
+    ProfileStack *s = find_stack(profiler->stacks, profiler->stacks_capacity, hash, stack, depth);
+    if (s->depth == 0) {
+        s->hash = hash;
+        s->depth = depth;
+        s->frames = malloc(depth * sizeof(word));
+        memcpy(s->frames, stack, depth * sizeof(word));
+        profiler->stacks_used++;
+    }
+    s->count++;
+}
@@ -0,0 +1,50 @@
+#ifndef __VM_PROFILER_H
+#define __VM_PROFILER_H
+
+#include "common/arch.h"
+#include "common/str.h"
+#include "common/vector.h"
+#include <stddef.h>
+#include <stdint.h>
+
+// Instructions between two samples (a superinstruction counts as one). A prime, so that loops do not
+// run in step with the sampling
+#define PROFILE_INTERVAL 9973
+#define PROFILE_MAX_DEPTH 64
+#define PROFILE_TOP_COUNT 20
+
+typedef struct {
+    string name;
+    word addr;
+    unsigned long self;  // Samples taken in the symbol itself
+    unsigned long total; // Samples with the symbol anywhere in the stack
+    unsigned long last_sample; // Keeps recursion from being counted twice in total
+} ProfileSymbol;
+
+// Every distinct stack that was sampled
+typedef struct {
+    uint32_t hash;
+    byte depth;   // 0 for an empty slot
+    word *frames; // Indices in Profiler.symbols, the outermost first
+    unsigned long count;
+} ProfileStack;
+
+typedef struct {
+    vector(ProfileSymbol) symbols; // Sorted by address, the last one is "[unknown]"
+    ProfileStack *stacks;          // Open addressing
+    size_t stacks_capacity;
+    size_t stacks_used;
+    unsigned long samples;
+} Profiler;
+
+struct VM;
+
+// Takes the symbols of the program loaded into vm
+Profiler *new_profiler(const struct VM *vm);
+void free_profiler(Profiler *profiler);
+
+// Attributes a sample to ip and to every function with a return address on the stack. There are no
+// frame pointers, so any word on the stack that follows a `call` is taken for a return address
+void profiler_sample(Profiler *profiler, const struct VM *vm, word ip, word sp);
+
+#endif
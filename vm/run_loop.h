@@ -0,0 +1,218 @@
+// Body of the threaded dispatch loop. machine.c includes it once for every variant of vm_run with
+// RUN_LOOP set to the name of the function and PROFILING to 0 or 1, so that the profiler costs
+// nothing when it is off. While profiling, compiled blocks count down the same countdown and
+// return here when a sample is due
+
+static void RUN_LOOP(VM *vm) {
+    static const void *handlers[HANDLER_COUNT] = {
+        [HANDLER_DECODE]  = &&decode,
+#define X(name, mnemonic, opcode, shape) [INSTR_##name] = &&mnemonic,
+        INSTRUCTION_SET(X)
+#undef X
+        [HANDLER_GENERIC] = &&generic,
+        [HANDLER_HALT]    = &&halt,
+        [HANDLER_CMP_JIF]   = &&cmp_jif,
+        [HANDLER_LD_ADD]    = &&ld_add,
+        [HANDLER_PUSH_PUSH] = &&push_push,
+        [HANDLER_PUSH_CALL] = &&push_call,
+        [HANDLER_POP_POP]   = &&pop_pop,
+    };
+    byte *memory = vm->memory;
+    Port *ports = vm->ports;
+    DecodedInstr *code = vm->code;
+    size_t program_size = vm->program_size;
+    word stack_begging = vm->stack_begging;
+    VMStats *stats = &vm->stats;
+    unsigned long *dispatched = stats->dispatched;
+    DecodedInstr *instr;
+    word regs[16];
+    size_t ip;
+    int64_t countdown = PROFILE_INTERVAL; // Only used when PROFILING
+    (void)countdown;
+    regs_load();
+    jump(ip);
+
+branch:
+    if (ip >= program_size) goto halt;
+    if (vm->jit) {
+#if PROFILING
+        *vm->jit->countdown = countdown;
+        ip = jit_enter(vm->jit, vm, ip, regs);
+        countdown = *vm->jit->countdown;
+#else
+        ip = jit_enter(vm->jit, vm, ip, regs);
+#endif
+        if (ip >= program_size) goto halt;
+    }
+    dispatch();
+
+decode:
+    *instr = decode_instr(memory, MEMORY_SIZE, ip);
+    dispatched[instr->handler]++;
+    goto *handlers[instr->handler];
+
+mov:
+    regs[instr->reg[0]] = operand(1);
+    next();
+
+ld:
+    load();
+    next();
+
+str: {
+    byte size = instr->size;
+    word addr = operand(1);
+    word value = regs[instr->reg[0]];
+    memory[addr] = value >> 8;
+    memory[(word)(addr + 1)] = value & 0xff;
+    if (addr < program_size || addr == 0xffff) {
+        vm_invalidate_code(vm, addr, 2);
+    }
+    next_by(size);
+}
+
+add: binop(+=);
+sub: binop(-=);
+mul: binop(*=);
+div: binop(/=);
+and: binop(&=);
+or:  binop(|=);
+xor: binop(^=);
+shl: binop(<<=);
+shr: binop(>>=);
+
+not:
+    regs[instr->reg[0]] = ~regs[instr->reg[0]];
+    next();
+
+push:
+    push(regs[instr->reg[0]]);
+    next();
+
+pop: {
+    word value;
+    pop(value);
+    regs[instr->reg[0]] = value;
+    next();
+}
+
+call:
+    push(ip + instr->size);
+    count_call(stats);
+    jump(instr->imm[0]);
+
+ret: {
+    word ret_addr;
+    pop(ret_addr);
+    count_ret(stats);
+    jump(ret_addr);
+}
+
+jmp:
+    jump(instr->imm[0]);
+
+cmp:
+    compare();
+    next();
+
+jif:
+    if (condition_met()) {
+        stats->jif_taken++;
+        jump(instr->imm[0]);
+    }
+    stats->jif_not_taken++;
+    next();
+
+out: {
+    byte size = instr->size;
+    Port *port = &ports[instr->aux];
+    if (!port->attached) {
+        regs_store();
+        error_no_device_attached(vm, instr->aux);
+    }
+    port->out_calls++;
+    port->out_bytes += operand(2);
+    if (port->rings) {
+        regs[0] = vm_port_submit(vm, port, DEVICE_WRITE, operand(1), operand(2));
+    } else {
+        regs[0] = port->device.write(operand(1), operand(2));
+    }
+    next_by(size);
+}
+
+in: {
+    byte size = instr->size;
+    word addr = operand(1);
+    word buffer_size = operand(2);
+    Port *port = &ports[instr->aux];
+    if (!port->attached) {
+        regs_store();
+        error_no_device_attached(vm, instr->aux);
+    }
+    port->in_calls++;
+    port->in_bytes += buffer_size;
+    if (port->rings) {
+        regs[0] = vm_port_submit(vm, port, DEVICE_READ, addr, buffer_size);
+    } else {
+        regs[0] = port->device.read(addr, buffer_size);
+        vm_invalidate_code(vm, addr, buffer_size);
+    }
+    next_by(size);
+}
+
+wait: {
+    byte size = instr->size;
+    Port *port = &ports[instr->aux];
+    if (!port->attached) {
+        regs_store();
+        error_no_device_attached(vm, instr->aux);
+    }
+    regs[0] = vm_port_wait(vm, port);
+    next_by(size);
+}
+
+generic:
+    regs_store();
+    exec_instr(vm);
+    regs_load();
+    jump(ip);
+
+// Superinstructions. ip is moved to the second instruction before it is executed, so errors are
+// reported exactly like without fusion
+#define fused_second() \
+    do { \
+        ip += instr->size; \
+        instr = &code[ip]; \
+    } while(0)
+
+cmp_jif:
+    compare();
+    fused_second();
+    goto jif;
+
+ld_add:
+    load();
+    fused_second();
+    goto add;
+
+push_push:
+    push(regs[instr->reg[0]]);
+    fused_second();
+    goto push;
+
+push_call:
+    push(regs[instr->reg[0]]);
+    fused_second();
+    goto call;
+
+pop_pop: {
+    word value;
+    pop(value);
+    regs[instr->reg[0]] = value;
+    fused_second();
+    goto pop;
+}
+
+halt:
+    regs_store();
+}